@@ -0,0 +1,218 @@
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <algorithm>
+#include <omp.h>
+#include <unistd.h>
+
+#include "bench.hpp"
+#include "numa.hpp"
+
+bool bench_parse_ints(const std::string& text, std::vector<int>& out) {
+    out.clear();
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos)
+            end = text.size();
+        std::string item = text.substr(start, end - start);
+        char* tail;
+        long v = strtol(item.c_str(), &tail, 10);
+        if (item.empty() || *tail || v < 1 || v > 100000000)
+            return false;
+        out.push_back((int)v);
+        start = end + 1;
+    }
+    return !out.empty();
+}
+
+bool bench_parse_names(const std::string& text, const char* const* names, int count, std::vector<int>& out) {
+    out.clear();
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos)
+            end = text.size();
+        std::string item = text.substr(start, end - start);
+        int found = -1;
+        for (int i = 0; i < count; i++)
+            if (item == names[i])
+                found = i;
+        if (found < 0)
+            return false;
+        out.push_back(found);
+        start = end + 1;
+    }
+    return !out.empty();
+}
+
+static BenchResult bench_case(const std::function<void(GSimulation&)>& setup, int solver, int precision,
+                              int count, int threads, int warmup, int reps) {
+    omp_set_num_threads(threads);
+
+    GSimulation simulation;
+    setup(simulation);
+    simulation.count = count;
+    simulation.solver = solver;
+    simulation.precision = precision;
+    simulation.init();
+
+    for (int i = 0; i < warmup; i++)
+        simulation.tickTimed();
+
+    std::vector<double> times;
+    double interactions = 0.;
+    for (int i = 0; i < reps; i++) {
+        simulation.tickTimed();
+        times.push_back(simulation.computeTime);
+        interactions += simulation.interactions;
+    }
+    std::sort(times.begin(), times.end());
+
+    BenchResult r;
+    r.solver = simulation.forces_solver();
+    r.precision = simulation.forces_precision();
+    r.count = count;
+    r.threads = threads;
+    r.isa = kernel_isa_name(simulation.isa);
+    r.median = reps % 2 ? times[reps / 2] : .5 * (times[reps / 2 - 1] + times[reps / 2]);
+    r.p95 = times[std::max(0, (int)std::ceil(.95 * reps) - 1)];
+    r.min = times.front();
+    r.mean = 0.;
+    for (double t : times)
+        r.mean += t / reps;
+    r.interactionRate = r.median > 0. ? interactions / reps / r.median : 0.;
+    r.gflops = r.interactionRate * simulation.flops_per_interaction() / 1e9;
+    r.efficiency = 1.;
+    return r;
+}
+
+std::vector<BenchResult> bench_run(const BenchConfig& config, const std::function<void(GSimulation&)>& setup, FILE* log) {
+    std::vector<BenchResult> results;
+    const int maxThreads = omp_get_max_threads();
+    const int reps = std::max(1, config.reps);
+    const int warmup = std::max(0, config.warmup);
+
+    fprintf(log, "Bench: %d warmup and %d timed ticks per case\n", warmup, reps);
+    fprintf(log, "Solver     | Precision |   Bodies | Threads |  Median s  |   p95 s    | Interact/s | GFLOP/s | Efficiency\n");
+    for (int solver : config.solvers)
+        for (int precision : config.precisions)
+            for (int count : config.sizes) {
+                size_t first = results.size();
+                for (int threads : config.threads) {
+                    BenchResult r = bench_case(setup, solver, precision, count, threads, warmup, reps);
+
+                    // against the run of this case with the fewest threads
+                    const BenchResult* base = &r;
+                    for (size_t i = first; i < results.size(); i++)
+                        if (results[i].threads < base->threads)
+                            base = &results[i];
+                    r.efficiency = r.median > 0. ? base->median * base->threads / (r.median * r.threads) : 0.;
+
+                    fprintf(log, "%-10s | %-9s | %8d | %7d | %10.4e | %10.4e | %10.4e | %7.2f | %9.3f\n",
+                        solverNames[solver], precisionNames[precision], count, threads, r.median, r.p95,
+                        r.interactionRate, r.gflops, r.efficiency);
+                    fflush(log);
+                    results.push_back(r);
+                }
+            }
+
+    omp_set_num_threads(maxThreads);
+    return results;
+}
+
+namespace {
+
+struct Machine {
+    char host[256];
+    char date[32];
+    int cpus;
+    int nodes;
+};
+
+Machine machine() {
+    Machine m;
+    if (gethostname(m.host, sizeof(m.host)) != 0)
+        strcpy(m.host, "unknown");
+    m.host[sizeof(m.host) - 1] = 0;
+    time_t now = time(nullptr);
+    strftime(m.date, sizeof(m.date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    m.cpus = omp_get_num_procs();
+    m.nodes = numa_topology().nodes;
+    return m;
+}
+
+const char* compiler() {
+#ifdef __VERSION__
+    return __VERSION__;
+#else
+    return "unknown";
+#endif
+}
+
+// JSON and CSV both want quotes doubled or escaped, the names here hold
+// nothing stranger than that
+std::string quoted(const std::string& text, bool json) {
+    std::string out = "\"";
+    for (char c : text) {
+        if (c == '"')
+            out += json ? "\\\"" : "\"\"";
+        else if (c == '\\' && json)
+            out += "\\\\";
+        else if ((unsigned char)c >= 0x20)
+            out += c;
+    }
+    return out + "\"";
+}
+
+FILE* open_output(const char* path) {
+    return strcmp(path, "-") ? fopen(path, "w") : stdout;
+}
+
+bool close_output(FILE* f) {
+    if (f == stdout)
+        return fflush(f) == 0;
+    bool ok = !ferror(f);
+    return (fclose(f) == 0) && ok;
+}
+
+}
+
+bool bench_write_csv(const char* path, const BenchConfig& config, const std::vector<BenchResult>& results) {
+    FILE* f = open_output(path);
+    if (!f)
+        return false;
+    Machine m = machine();
+    fprintf(f, "label,date,host,cpus,numa_nodes,compiler,isa,solver,precision,bodies,threads,warmup,reps,"
+               "median_s,p95_s,mean_s,min_s,interactions_per_s,gflops,efficiency\n");
+    for (const BenchResult& r : results)
+        fprintf(f, "%s,%s,%s,%d,%d,%s,%s,%s,%s,%d,%d,%d,%d,%.6e,%.6e,%.6e,%.6e,%.6e,%.4f,%.4f\n",
+            quoted(config.label, false).c_str(), m.date, quoted(m.host, false).c_str(), m.cpus, m.nodes,
+            quoted(compiler(), false).c_str(), r.isa, solverNames[r.solver], precisionNames[r.precision],
+            r.count, r.threads, config.warmup, config.reps,
+            r.median, r.p95, r.mean, r.min, r.interactionRate, r.gflops, r.efficiency);
+    return close_output(f);
+}
+
+bool bench_write_json(const char* path, const BenchConfig& config, const std::vector<BenchResult>& results) {
+    FILE* f = open_output(path);
+    if (!f)
+        return false;
+    Machine m = machine();
+    fprintf(f, "{\n  \"label\": %s,\n  \"date\": \"%s\",\n", quoted(config.label, true).c_str(), m.date);
+    fprintf(f, "  \"machine\": {\"host\": %s, \"cpus\": %d, \"numa_nodes\": %d},\n", quoted(m.host, true).c_str(), m.cpus, m.nodes);
+    fprintf(f, "  \"build\": {\"compiler\": %s},\n", quoted(compiler(), true).c_str());
+    fprintf(f, "  \"warmup\": %d,\n  \"reps\": %d,\n  \"results\": [\n", config.warmup, config.reps);
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        fprintf(f, "    {\"isa\": \"%s\", \"solver\": \"%s\", \"precision\": \"%s\", \"bodies\": %d, \"threads\": %d, "
+                   "\"median_s\": %.6e, \"p95_s\": %.6e, \"mean_s\": %.6e, \"min_s\": %.6e, "
+                   "\"interactions_per_s\": %.6e, \"gflops\": %.4f, \"efficiency\": %.4f}%s\n",
+            r.isa, solverNames[r.solver], precisionNames[r.precision], r.count, r.threads,
+            r.median, r.p95, r.mean, r.min, r.interactionRate, r.gflops, r.efficiency,
+            i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    return close_output(f);
+}
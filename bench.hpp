@@ -0,0 +1,47 @@
+#ifndef BENCH_HPP_
+#define BENCH_HPP_
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "nbody.hpp"
+
+// The sweep: every solver x precision x size x thread count, each on a
+// fresh system.
+struct BenchConfig {
+    std::vector<int> solvers;
+    std::vector<int> precisions;
+    std::vector<int> sizes;
+    std::vector<int> threads;
+    int warmup;                 // ticks run before timing
+    int reps;                   // timed ticks
+    std::string label;          // goes into every result, to tell builds apart
+};
+
+struct BenchResult {
+    int solver;
+    int precision;
+    int count;
+    int threads;
+    const char* isa;
+    double median, p95, mean, min;  // seconds per tick
+    double interactionRate;         // per second, at the median
+    double gflops;                  // 0 for solvers without a flop count
+    double efficiency;              // against the fewest threads of the same case
+};
+
+// setup applies the command line to a fresh simulation before the sweep
+// sets its case. Rows are printed to log as they finish.
+std::vector<BenchResult> bench_run(const BenchConfig& config, const std::function<void(GSimulation&)>& setup, FILE* log);
+
+// Comma separated names or numbers, false on one that is neither.
+bool bench_parse_names(const std::string& text, const char* const* names, int count, std::vector<int>& out);
+bool bench_parse_ints(const std::string& text, std::vector<int>& out);
+
+// Results with the build and machine they ran on. path "-" is stdout.
+bool bench_write_csv(const char* path, const BenchConfig& config, const std::vector<BenchResult>& results);
+bool bench_write_json(const char* path, const BenchConfig& config, const std::vector<BenchResult>& results);
+
+#endif
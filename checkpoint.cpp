@@ -0,0 +1,498 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "checkpoint.hpp"
+
+static_assert(sizeof(CheckpointHeader) <= CHECKPOINT_PAGE, "checkpoint header must fit its page");
+static_assert(sizeof(CheckpointChunk) == 24, "checkpoint chunk table entries are 24 bytes");
+
+static const char MAGIC[8] = {'N', 'B', 'O', 'D', 'Y', 'C', 'K', 'P'};
+static const size_t TYPE_SIZE[Checkpoint_TypeCount] = {8, 4, 4};
+
+static uint64_t page_round(uint64_t bytes) {
+    return (bytes + CHECKPOINT_PAGE - 1) / CHECKPOINT_PAGE * CHECKPOINT_PAGE;
+}
+
+static bool fail(std::string* error, const char* what, const char* path) {
+    if (error) {
+        char text[512];
+        if (errno)
+            snprintf(text, sizeof(text), "%s %s: %s", what, path, strerror(errno));
+        else
+            snprintf(text, sizeof(text), "%s %s", what, path);
+        *error = text;
+    }
+    return false;
+}
+
+// Four independent multiply-xor lanes over 8 byte words, fast enough to
+// not show next to the disk.
+static uint64_t checksum(const char* data, size_t bytes) {
+    const uint64_t prime = 0x9e3779b97f4a7c15ull;
+    uint64_t lane[4] = {1, 2, 3, 4};
+    size_t i = 0;
+    for (; i + 32 <= bytes; i += 32)
+        for (int l = 0; l < 4; l++) {
+            uint64_t v;
+            std::memcpy(&v, data + i + l * 8, 8);
+            lane[l] = (lane[l] ^ v) * prime;
+            lane[l] ^= lane[l] >> 29;
+        }
+    uint64_t h = bytes;
+    for (int l = 0; l < 4; l++)
+        h = (h ^ lane[l]) * prime;
+    for (; i < bytes; i++)
+        h = (h ^ (unsigned char)data[i]) * prime;
+    return h ^ (h >> 32);
+}
+
+// Byte k of every value goes to plane k. Exponents and high mantissa bytes
+// of neighbouring bodies repeat a lot, they end up next to each other.
+static void shuffle(const char* src, char* dst, size_t values, size_t width) {
+    for (size_t i = 0; i < values; i++)
+        for (size_t k = 0; k < width; k++)
+            dst[k * values + i] = src[i * width + k];
+}
+
+static void unshuffle(const char* src, char* dst, size_t values, size_t width) {
+    for (size_t k = 0; k < width; k++)
+        for (size_t i = 0; i < values; i++)
+            dst[i * width + k] = src[k * values + i];
+}
+
+// LZ77 block codec in the spirit of LZ4: a token holds literal and match
+// lengths in its nibbles (15 continues in following bytes), then the
+// literals, then a 16 bit distance. The last sequence has literals only.
+static const int LZ_MIN_MATCH = 4;
+static const int LZ_HASH_BITS = 14;
+static const size_t LZ_WINDOW = 65535;
+
+static uint32_t load32(const unsigned char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+
+static unsigned char* put_length(unsigned char* out, size_t length) {
+    for (; length >= 255; length -= 255)
+        *out++ = 255;
+    *out++ = (unsigned char)length;
+    return out;
+}
+
+// Compressed size, 0 when the output would not fit into capacity.
+static size_t lz_compress(const unsigned char* src, size_t n, unsigned char* dst, size_t capacity) {
+    std::vector<uint32_t> table((size_t)1 << LZ_HASH_BITS, 0);
+    const unsigned char* const end = dst + capacity;
+    unsigned char* out = dst;
+    size_t anchor = 0, i = 0;
+    // the last bytes always go out as literals
+    const size_t limit = n > 12 ? n - 12 : 0;
+
+    auto emit = [&](size_t literals, size_t match, size_t distance) -> bool {
+        // token, two length tails, literals, distance
+        if ((size_t)(end - out) < 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1)
+            return false;
+        unsigned char* token = out++;
+        *token = (unsigned char)(std::min<size_t>(literals, 15) << 4);
+        if (literals >= 15)
+            out = put_length(out, literals - 15);
+        std::memcpy(out, src + anchor, literals);
+        out += literals;
+        if (match == 0)
+            return true;
+        out[0] = (unsigned char)distance;
+        out[1] = (unsigned char)(distance >> 8);
+        out += 2;
+        size_t m = match - LZ_MIN_MATCH;
+        *token |= (unsigned char)std::min<size_t>(m, 15);
+        if (m >= 15)
+            out = put_length(out, m - 15);
+        return true;
+    };
+
+    while (i < limit) {
+        uint32_t v = load32(src + i);
+        uint32_t h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[h];
+        table[h] = (uint32_t)i;
+        if (candidate >= i || i - candidate > LZ_WINDOW || load32(src + candidate) != v) {
+            i++;
+            continue;
+        }
+        size_t match = LZ_MIN_MATCH;
+        while (i + match < limit && src[candidate + match] == src[i + match])
+            match++;
+        if (!emit(i - anchor, match, i - candidate))
+            return 0;
+        i += match;
+        anchor = i;
+    }
+    if (!emit(n - anchor, 0, 0))
+        return 0;
+    return out - dst;
+}
+
+static bool lz_decompress(const unsigned char* src, size_t n, unsigned char* dst, size_t raw) {
+    const unsigned char* const srcEnd = src + n;
+    unsigned char* out = dst;
+    unsigned char* const outEnd = dst + raw;
+
+    auto get_length = [&](size_t length) -> size_t {
+        if (length != 15)
+            return length;
+        unsigned char b;
+        do {
+            if (src >= srcEnd)
+                return SIZE_MAX;
+            b = *src++;
+            length += b;
+        } while (b == 255);
+        return length;
+    };
+
+    while (src < srcEnd) {
+        unsigned char token = *src++;
+        size_t literals = get_length(token >> 4);
+        if (literals > (size_t)(srcEnd - src) || literals > (size_t)(outEnd - out))
+            return false;
+        std::memcpy(out, src, literals);
+        out += literals;
+        src += literals;
+        if (src == srcEnd)
+            break;
+
+        if (srcEnd - src < 2)
+            return false;
+        size_t distance = src[0] | (size_t)src[1] << 8;
+        src += 2;
+        size_t match = get_length(token & 15);
+        if (match == SIZE_MAX)
+            return false;
+        match += LZ_MIN_MATCH;
+        if (distance == 0 || distance > (size_t)(out - dst) || match > (size_t)(outEnd - out))
+            return false;
+        // overlapping copies repeat the last distance bytes, byte by byte
+        const unsigned char* from = out - distance;
+        for (size_t k = 0; k < match; k++)
+            out[k] = from[k];
+        out += match;
+    }
+    return out == outEnd;
+}
+
+bool checkpoint_write(const char* path, const CheckpointHeader& meta,
+                      const CheckpointSource* columns, int columnCount,
+                      CheckpointCodec codec, std::string* error) {
+    errno = 0;
+    if (columnCount > CHECKPOINT_MAX_COLUMNS)
+        return fail(error, "too many columns for", path);
+
+    CheckpointHeader* header = (CheckpointHeader*)std::calloc(1, CHECKPOINT_PAGE);
+    *header = meta;
+    std::memcpy(header->magic, MAGIC, sizeof(MAGIC));
+    header->version = CHECKPOINT_VERSION;
+    header->endianTag = CHECKPOINT_ENDIAN;
+    header->codec = codec;
+    header->columnCount = columnCount;
+
+    // chunks of all columns in one list, so one loop handles them all
+    struct Job {
+        int column;
+        const char* src;
+        uint32_t raw;
+        size_t width;
+    };
+    std::vector<Job> jobs;
+    for (int c = 0; c < columnCount; c++) {
+        CheckpointColumn& col = header->columns[c];
+        std::memset(&col, 0, sizeof(col));
+        strncpy(col.name, columns[c].name, sizeof(col.name) - 1);
+        col.type = columns[c].type;
+        col.components = columns[c].components;
+        col.rawBytes = (uint64_t)meta.count * columns[c].components * TYPE_SIZE[col.type];
+        col.firstChunk = (uint32_t)jobs.size();
+        for (uint64_t b = 0; b < col.rawBytes; b += CHECKPOINT_CHUNK)
+            jobs.push_back({c, (const char*)columns[c].data + b,
+                            (uint32_t)std::min<uint64_t>(CHECKPOINT_CHUNK, col.rawBytes - b), TYPE_SIZE[col.type]});
+        col.chunks = (uint32_t)jobs.size() - col.firstChunk;
+    }
+    const int count = (int)jobs.size();
+    header->chunkCount = count;
+
+    std::vector<CheckpointChunk> table(count);
+    std::vector<std::vector<char>> packed(codec == Checkpoint_Raw ? 0 : count);
+    if (codec == Checkpoint_ShuffleLZ) {
+        #pragma omp parallel for schedule(dynamic)
+        for (int j = 0; j < count; j++) {
+            std::vector<char> shuffled(jobs[j].raw);
+            shuffle(jobs[j].src, shuffled.data(), jobs[j].raw / jobs[j].width, jobs[j].width);
+            packed[j].resize(jobs[j].raw);
+            size_t stored = lz_compress((const unsigned char*)shuffled.data(), jobs[j].raw,
+                                        (unsigned char*)packed[j].data(), jobs[j].raw - 1);
+            // chunks that do not shrink are kept raw, stored == raw says so
+            if (stored == 0)
+                packed[j].clear();
+            else
+                packed[j].resize(stored);
+            table[j].stored = stored ? (uint32_t)stored : jobs[j].raw;
+            table[j].checksum = stored ? checksum(packed[j].data(), stored) : checksum(jobs[j].src, jobs[j].raw);
+        }
+    } else {
+        #pragma omp parallel for schedule(dynamic)
+        for (int j = 0; j < count; j++) {
+            table[j].stored = jobs[j].raw;
+            table[j].checksum = checksum(jobs[j].src, jobs[j].raw);
+        }
+    }
+
+    const uint64_t tableBytes = page_round((uint64_t)count * sizeof(CheckpointChunk));
+    uint64_t offset = CHECKPOINT_PAGE + tableBytes;
+    for (int j = 0; j < count; j++) {
+        CheckpointColumn& col = header->columns[jobs[j].column];
+        if ((uint32_t)j == col.firstChunk) {
+            offset = page_round(offset);
+            col.offset = offset;
+        }
+        table[j].offset = offset;
+        table[j].raw = jobs[j].raw;
+        offset += table[j].stored;
+    }
+    const uint64_t fileBytes = page_round(offset);
+
+    std::string temporary = std::string(path) + ".tmp";
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::free(header);
+        return fail(error, "cannot create", temporary.c_str());
+    }
+    bool ok = ftruncate(fd, fileBytes) == 0;
+
+    auto write_all = [fd](const void* data, size_t bytes, uint64_t at) -> bool {
+        const char* p = (const char*)data;
+        while (bytes > 0) {
+            ssize_t done = pwrite(fd, p, bytes, at);
+            if (done < 0 && errno == EINTR)
+                continue;
+            if (done <= 0)
+                return false;
+            p += done;
+            bytes -= done;
+            at += done;
+        }
+        return true;
+    };
+
+    ok = ok && write_all(header, CHECKPOINT_PAGE, 0);
+    ok = ok && (count == 0 || write_all(table.data(), count * sizeof(CheckpointChunk), CHECKPOINT_PAGE));
+    int failed = 0;
+    if (ok) {
+        #pragma omp parallel for schedule(dynamic) reduction(+:failed)
+        for (int j = 0; j < count; j++) {
+            const void* data = packed.empty() || packed[j].empty() ? (const void*)jobs[j].src : (const void*)packed[j].data();
+            if (!write_all(data, table[j].stored, table[j].offset))
+                failed++;
+        }
+    }
+    ok = ok && failed == 0;
+    ok = ok && fsync(fd) == 0;
+    int saved = errno;
+    ok = (::close(fd) == 0) && ok;
+    std::free(header);
+    if (!ok) {
+        if (saved)
+            errno = saved;
+        fail(error, "cannot write", temporary.c_str());
+        unlink(temporary.c_str());
+        return false;
+    }
+    if (rename(temporary.c_str(), path) != 0) {
+        fail(error, "cannot rename to", path);
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool checkpoint_probe(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return false;
+    char magic[8];
+    bool found = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && !std::memcmp(magic, MAGIC, sizeof(MAGIC));
+    fclose(f);
+    return found;
+}
+
+CheckpointFile::CheckpointFile() {
+    _fd = -1;
+    _size = 0;
+    _map = nullptr;
+    _header = nullptr;
+    _chunks = nullptr;
+}
+
+CheckpointFile::~CheckpointFile() {
+    close();
+}
+
+void CheckpointFile::close() {
+    if (_map)
+        munmap((void*)_map, _size);
+    if (_fd >= 0)
+        ::close(_fd);
+    _fd = -1;
+    _size = 0;
+    _map = nullptr;
+    _header = nullptr;
+    _chunks = nullptr;
+}
+
+bool CheckpointFile::open(const char* path, std::string* error) {
+    close();
+    errno = 0;
+    _fd = ::open(path, O_RDONLY);
+    if (_fd < 0)
+        return fail(error, "cannot open", path);
+
+    struct stat st;
+    if (fstat(_fd, &st) != 0) {
+        close();
+        return fail(error, "cannot stat", path);
+    }
+    if ((size_t)st.st_size < CHECKPOINT_PAGE) {
+        close();
+        errno = 0;
+        return fail(error, "too short for a checkpoint:", path);
+    }
+    _size = st.st_size;
+    void* map = mmap(nullptr, _size, PROT_READ, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED) {
+        _size = 0;
+        close();
+        return fail(error, "cannot map", path);
+    }
+    _map = (const char*)map;
+    madvise(map, _size, MADV_WILLNEED);
+
+    errno = 0;
+    const CheckpointHeader* h = (const CheckpointHeader*)_map;
+    const char* problem = nullptr;
+    if (std::memcmp(h->magic, MAGIC, sizeof(MAGIC)))
+        problem = "not a checkpoint:";
+    else if (h->endianTag != CHECKPOINT_ENDIAN)
+        problem = "checkpoint written with the other byte order:";
+    else if (h->version != CHECKPOINT_VERSION && h->version != 1)
+        problem = "unsupported checkpoint version in";
+    else if (h->codec >= Checkpoint_CodecCount)
+        problem = "unknown checkpoint compression in";
+    else if (h->columnCount > CHECKPOINT_MAX_COLUMNS || h->count < 0
+          || CHECKPOINT_PAGE + (uint64_t)h->chunkCount * sizeof(CheckpointChunk) > _size)
+        problem = "corrupt checkpoint header in";
+    if (!problem) {
+        _chunks = (const CheckpointChunk*)(_map + CHECKPOINT_PAGE);
+        for (uint32_t c = 0; c < h->columnCount && !problem; c++) {
+            const CheckpointColumn& col = h->columns[c];
+            // divided rather than multiplied, a huge count must not wrap around
+            const uint64_t body = col.type < Checkpoint_TypeCount ? (uint64_t)col.components * TYPE_SIZE[col.type] : 0;
+            if (body == 0 || (uint64_t)col.firstChunk + col.chunks > h->chunkCount
+             || col.rawBytes % body != 0 || col.rawBytes / body != (uint64_t)h->count
+             || col.chunks != (col.rawBytes + CHECKPOINT_CHUNK - 1) / CHECKPOINT_CHUNK) {
+                problem = "corrupt checkpoint column in";
+                break;
+            }
+            // read() places chunk j of a column at j * CHECKPOINT_CHUNK, so
+            // every chunk but the last must be a whole one and the last the rest
+            for (uint32_t j = 0; j < col.chunks && !problem; j++) {
+                const CheckpointChunk& chunk = _chunks[col.firstChunk + j];
+                const uint64_t raw = std::min<uint64_t>(CHECKPOINT_CHUNK, col.rawBytes - (uint64_t)j * CHECKPOINT_CHUNK);
+                if (chunk.raw != raw || chunk.raw % TYPE_SIZE[col.type] != 0)
+                    problem = "corrupt checkpoint chunk table in";
+                else if (chunk.offset > _size || chunk.stored > _size - chunk.offset || chunk.stored > chunk.raw)
+                    problem = "truncated checkpoint:";
+            }
+        }
+    }
+    if (problem) {
+        close();
+        return fail(error, problem, path);
+    }
+    _header = h;
+    return true;
+}
+
+const CheckpointColumn* CheckpointFile::find(const char* name) {
+    for (uint32_t c = 0; c < _header->columnCount; c++)
+        if (!strncmp(_header->columns[c].name, name, sizeof(_header->columns[c].name)))
+            return &_header->columns[c];
+    return nullptr;
+}
+
+bool CheckpointFile::read(const CheckpointColumn* column, void* dst, CheckpointType type, std::string* error) {
+    const bool realTypes = (column->type == Checkpoint_Float64 || column->type == Checkpoint_Float32)
+                        && (type == Checkpoint_Float64 || type == Checkpoint_Float32);
+    if (column->type != (uint32_t)type && !realTypes) {
+        errno = 0;
+        return fail(error, "checkpoint column has another type:", column->name);
+    }
+
+    const size_t width = TYPE_SIZE[column->type];
+    const size_t outWidth = TYPE_SIZE[type];
+    const int first = column->firstChunk;
+    const int chunks = column->chunks;
+    int failed = 0;
+
+    #pragma omp parallel for schedule(dynamic) reduction(+:failed)
+    for (int j = first; j < first + chunks; j++) {
+        const CheckpointChunk& chunk = _chunks[j];
+        const size_t values = chunk.raw / width;
+        // chunk offsets inside the column are multiples of CHECKPOINT_CHUNK
+        char* out = (char*)dst + (size_t)(j - first) * (CHECKPOINT_CHUNK / width) * outWidth;
+        const char* in = _map + chunk.offset;
+
+        if (checksum(in, chunk.stored) != chunk.checksum) {
+            failed++;
+            continue;
+        }
+
+        std::vector<char> decoded;
+        if (chunk.stored != chunk.raw) {
+            std::vector<char> shuffled(chunk.raw);
+            if (!lz_decompress((const unsigned char*)in, chunk.stored, (unsigned char*)shuffled.data(), chunk.raw)) {
+                failed++;
+                continue;
+            }
+            decoded.resize(chunk.raw);
+            unshuffle(shuffled.data(), decoded.data(), values, width);
+            in = decoded.data();
+        }
+
+        if (column->type == (uint32_t)type)
+            std::memcpy(out, in, chunk.raw);
+        else if (type == Checkpoint_Float64)
+            for (size_t i = 0; i < values; i++) {
+                float v;
+                std::memcpy(&v, in + i * 4, 4);
+                ((double*)out)[i] = v;
+            }
+        else
+            for (size_t i = 0; i < values; i++) {
+                double v;
+                std::memcpy(&v, in + i * 8, 8);
+                ((float*)out)[i] = (float)v;
+            }
+    }
+    if (failed) {
+        errno = 0;
+        return fail(error, "corrupt chunk in checkpoint column", column->name);
+    }
+    return true;
+}
@@ -0,0 +1,124 @@
+#ifndef CHECKPOINT_HPP_
+#define CHECKPOINT_HPP_
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Checkpoint file, version 2:
+//
+//   header       CheckpointHeader, one page
+//   chunk table  CheckpointChunk per chunk of every column, padded to a page
+//   columns      one after another, each starting on a page
+//
+// A column is split into chunks of CHECKPOINT_CHUNK raw bytes that are
+// written, read and (optionally) compressed independently, so all of it
+// runs in parallel. Uncompressed chunks are copied straight out of the
+// mapped file.
+// Everything is in the byte order of the machine that wrote the file,
+// endianTag tells a reader whether that is its own. Version 1 is version 2
+// without rng, its systems all came from mt19937.
+
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_PAGE 4096
+#define CHECKPOINT_CHUNK (1 << 20)
+#define CHECKPOINT_MAX_COLUMNS 32
+#define CHECKPOINT_ENDIAN 0x01020304u
+
+enum CheckpointType {
+    Checkpoint_Float64 = 0,
+    Checkpoint_Float32,
+    Checkpoint_Int32,
+    Checkpoint_TypeCount
+};
+
+enum CheckpointCodec {
+    Checkpoint_Raw = 0,     // stored as is
+    Checkpoint_ShuffleLZ,   // bytes grouped by significance, then LZ77
+    Checkpoint_CodecCount
+};
+
+struct CheckpointColumn {
+    char name[16];
+    uint32_t type;          // CheckpointType
+    uint32_t components;    // values per body
+    uint32_t firstChunk;    // into the chunk table
+    uint32_t chunks;
+    uint64_t offset;        // of the first chunk
+    uint64_t rawBytes;
+};
+
+struct CheckpointChunk {
+    uint64_t offset;
+    uint32_t stored;        // bytes in the file, equal to raw when not compressed
+    uint32_t raw;
+    uint64_t checksum;      // of the stored bytes
+};
+
+struct CheckpointHeader {
+    char magic[8];          // "NBODYCKP"
+    uint32_t version;
+    uint32_t endianTag;     // CHECKPOINT_ENDIAN as written
+    uint32_t realSize;      // sizeof(real_type) of the writer
+    uint32_t codec;         // CheckpointCodec
+    uint32_t columnCount;
+    uint32_t chunkCount;
+    int64_t count;          // bodies
+
+    int32_t tickCount;
+    int32_t seed;
+    double elapsedTime;
+    double dTime;
+    double initialEnergy;
+    double maxMass;
+
+    CheckpointColumn columns[CHECKPOINT_MAX_COLUMNS];
+
+    uint32_t rng;           // generator of the initial conditions, Rng of nbody.hpp
+};
+
+// A column to write, count bodies of components values each.
+struct CheckpointSource {
+    const char* name;
+    CheckpointType type;
+    int components;
+    const void* data;
+};
+
+// Writes to path + ".tmp" and renames it over path when everything made
+// it to the file. False with a message in error otherwise.
+bool checkpoint_write(const char* path, const CheckpointHeader& meta,
+                      const CheckpointSource* columns, int columnCount,
+                      CheckpointCodec codec, std::string* error);
+
+// A checkpoint mapped read-only.
+class CheckpointFile {
+    public:
+        CheckpointFile();
+        ~CheckpointFile();
+        CheckpointFile(const CheckpointFile&) = delete;
+        CheckpointFile& operator=(const CheckpointFile&) = delete;
+
+        bool open(const char* path, std::string* error);
+        void close();
+
+        const CheckpointHeader& header() {return *_header;}
+        const CheckpointColumn* find(const char* name);
+
+        // Checks and decodes the column into dst as type, converting
+        // float64 and float32 into each other. Chunks go in parallel.
+        bool read(const CheckpointColumn* column, void* dst, CheckpointType type, std::string* error);
+    private:
+        int _fd;
+        size_t _size;
+        const char* _map;
+        const CheckpointHeader* _header;
+        const CheckpointChunk* _chunks;
+};
+
+// True when the file starts like a checkpoint, as opposed to the headerless
+// dumps older builds wrote.
+bool checkpoint_probe(const char* path);
+
+#endif
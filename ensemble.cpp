@@ -0,0 +1,205 @@
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <omp.h>
+
+#include "ensemble.hpp"
+
+static std::vector<std::string> split(const std::string& text, char separator) {
+    std::vector<std::string> items;
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = text.find(separator, start);
+        if (end == std::string::npos)
+            end = text.size();
+        items.push_back(text.substr(start, end - start));
+        start = end + 1;
+    }
+    return items;
+}
+
+static bool parse_int(const std::string& text, long& v) {
+    char* tail;
+    v = strtol(text.c_str(), &tail, 10);
+    return !text.empty() && !*tail;
+}
+
+static bool parse_real(const std::string& text, double& v) {
+    char* tail;
+    v = strtod(text.c_str(), &tail);
+    return !text.empty() && !*tail && std::isfinite(v);
+}
+
+bool ensemble_parse_ints(const std::string& text, std::vector<int>& out) {
+    out.clear();
+    std::vector<std::string> range = split(text, ':');
+    if (range.size() == 2) {
+        long a, b;
+        if (!parse_int(range[0], a) || !parse_int(range[1], b) || b < a || b - a >= 1000000)
+            return false;
+        for (long v = a; v <= b; v++)
+            out.push_back((int)v);
+        return true;
+    }
+    for (const std::string& item : split(text, ',')) {
+        long v;
+        if (!parse_int(item, v))
+            return false;
+        out.push_back((int)v);
+    }
+    return !out.empty();
+}
+
+bool ensemble_parse_reals(const std::string& text, std::vector<double>& out) {
+    out.clear();
+    std::vector<std::string> range = split(text, ':');
+    if (range.size() == 3) {
+        double a, b;
+        long n;
+        if (!parse_real(range[0], a) || !parse_real(range[1], b) || !parse_int(range[2], n) || n < 1 || n > 1000000)
+            return false;
+        for (long i = 0; i < n; i++)
+            out.push_back(n == 1 ? a : a + (b - a) * i / (n - 1));
+        return true;
+    }
+    for (const std::string& item : split(text, ',')) {
+        double v;
+        if (!parse_real(item, v))
+            return false;
+        out.push_back(v);
+    }
+    return !out.empty();
+}
+
+static void run_one(const std::function<void(GSimulation&)>& setup, EnsembleRun& run) {
+    double start = omp_get_wtime();
+    GSimulation simulation;
+    setup(simulation);
+    simulation.seed = run.seed;
+    simulation.count = run.count;
+    simulation.dTime = run.dt;
+    simulation.maxMass = run.maxMass;
+    simulation.maxVel = run.maxVel;
+    simulation.init();
+    run.rng = simulation.get_rng();
+    simulation.run(run.ticks);
+
+    run.energyTick = simulation.energyTick;
+    run.fEnergy = simulation.fEnergy;
+    run.kEnergy = simulation.kEnergy;
+    run.pEnergy = simulation.pEnergy;
+    run.deviation = simulation.energy_deviation();
+    run.seconds = omp_get_wtime() - start;
+}
+
+std::vector<EnsembleRun> ensemble_run(const EnsembleSpec& spec, const std::function<void(GSimulation&)>& setup, FILE* log) {
+    // the command line's values stand in for lists not swept
+    GSimulation defaults;
+    setup(defaults);
+    auto orDefault = [](const std::vector<double>& list, double value) {
+        return list.empty() ? std::vector<double>(1, value) : list;
+    };
+    const std::vector<int> seeds = spec.seeds.empty() ? std::vector<int>(1, defaults.seed) : spec.seeds;
+    const std::vector<int> sizes = spec.sizes.empty() ? std::vector<int>(1, defaults.count) : spec.sizes;
+    const std::vector<double> dts = orDefault(spec.dts, defaults.dTime);
+    const std::vector<double> masses = orDefault(spec.masses, defaults.maxMass);
+    const std::vector<double> vels = orDefault(spec.vels, defaults.maxVel);
+
+    std::vector<EnsembleRun> runs;
+    for (int count : sizes)
+        for (double dt : dts)
+            for (double mass : masses)
+                for (double vel : vels)
+                    for (int seed : seeds) {
+                        EnsembleRun r;
+                        std::memset(&r, 0, sizeof(r));
+                        r.index = (int)runs.size();
+                        r.seed = seed;
+                        r.count = count;
+                        r.dt = dt;
+                        r.maxMass = mass;
+                        r.maxVel = vel;
+                        r.ticks = spec.ticks;
+                        runs.push_back(r);
+                    }
+
+    // longest first, by the direct sum's n^2 per tick, so the last tasks
+    // to start are short ones
+    std::vector<int> big, small;
+    for (const EnsembleRun& r : runs)
+        (r.count >= spec.packBelow ? big : small).push_back(r.index);
+    auto longer = [&](int a, int b) {
+        return (double)runs[a].count * runs[a].count * runs[a].ticks > (double)runs[b].count * runs[b].count * runs[b].ticks;
+    };
+    std::stable_sort(big.begin(), big.end(), longer);
+    std::stable_sort(small.begin(), small.end(), longer);
+
+    const int threads = omp_get_max_threads();
+    fprintf(log, "Ensemble: %d runs of %d ticks, %d on all %d threads, %d packed one per thread\n",
+        (int)runs.size(), spec.ticks, (int)big.size(), threads, (int)small.size());
+    fflush(log);
+
+    int done = 0;
+    auto finished = [&]() {
+        #pragma omp critical(ensemble_log)
+        {
+            done++;
+            fprintf(log, "\r%d/%d runs", done, (int)runs.size());
+            fflush(log);
+        }
+    };
+
+    for (int i : big) {
+        runs[i].threads = threads;
+        run_one(setup, runs[i]);
+        finished();
+    }
+
+    // one active level, so the runs' own regions get a single thread even
+    // with OMP_MAX_ACTIVE_LEVELS or OMP_NESTED set, instead of a team each
+    const int levels = omp_get_max_active_levels();
+    omp_set_max_active_levels(1);
+    const int packed = (int)small.size();
+    #pragma omp parallel
+    #pragma omp single
+    #pragma omp taskloop grainsize(1)
+    for (int k = 0; k < packed; k++) {
+        EnsembleRun& r = runs[small[k]];
+        r.threads = 1;
+        run_one(setup, r);
+        finished();
+    }
+    omp_set_max_active_levels(levels);
+
+    fprintf(log, "\n");
+    return runs;
+}
+
+void ensemble_print(const std::vector<EnsembleRun>& runs, double wall, FILE* out) {
+    double busy = 0.;
+    for (const EnsembleRun& r : runs)
+        busy += r.seconds * r.threads;
+    fprintf(out, "  Run |   Seed | Generator |   Bodies |     dt     |  Max mass  |  Max vel   | Ticks | Full energy      | Deviation|  Seconds  | Threads\n");
+    for (const EnsembleRun& r : runs)
+        fprintf(out, "%5d | %6d | %9s | %8d | %10.4e | %10.4e | %10.4e | %5d | %16.8f | %9.4f| %9.4f | %7d\n",
+            r.index, r.seed, rngNames[r.rng], r.count, r.dt, r.maxMass, r.maxVel, r.ticks, r.fEnergy, r.deviation, r.seconds, r.threads);
+    fprintf(out, "%d runs in %.3f s, %.2f runs/s, %.3f thread seconds\n",
+        (int)runs.size(), wall, wall > 0. ? runs.size() / wall : 0., busy);
+}
+
+bool ensemble_write_csv(const char* path, const std::vector<EnsembleRun>& runs) {
+    FILE* f = strcmp(path, "-") ? fopen(path, "w") : stdout;
+    if (!f)
+        return false;
+    fprintf(f, "run,seed,generator,bodies,dt,max_mass,max_vel,ticks,energy_tick,full_energy,kinetic_energy,potential_energy,"
+               "deviation,seconds,threads\n");
+    for (const EnsembleRun& r : runs)
+        fprintf(f, "%d,%d,%s,%d,%.9e,%.9e,%.9e,%d,%d,%.12e,%.12e,%.12e,%.6e,%.6e,%d\n",
+            r.index, r.seed, rngNames[r.rng], r.count, r.dt, r.maxMass, r.maxVel, r.ticks, r.energyTick,
+            r.fEnergy, r.kEnergy, r.pEnergy, r.deviation, r.seconds, r.threads);
+    if (f == stdout)
+        return fflush(f) == 0;
+    bool ok = !ferror(f);
+    return (fclose(f) == 0) && ok;
+}
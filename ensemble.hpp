@@ -0,0 +1,58 @@
+#ifndef ENSEMBLE_HPP_
+#define ENSEMBLE_HPP_
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "nbody.hpp"
+
+// The sweep: every seed x size x dt x mass x velocity, each a fresh
+// system run for ticks. Empty lists take the command line's value.
+struct EnsembleSpec {
+    std::vector<int> seeds;
+    std::vector<int> sizes;
+    std::vector<double> dts;
+    std::vector<double> masses;
+    std::vector<double> vels;
+    int ticks;
+    int packBelow;          // runs with fewer bodies share the threads, one run each
+};
+
+struct EnsembleRun {
+    int index;
+    int seed;
+    int rng;                // generator the seed went to, Rng
+    int count;
+    double dt, maxMass, maxVel;
+    int ticks;
+    int energyTick;         // tick of the energies below
+    double fEnergy, kEnergy, pEnergy;
+    double deviation;
+    double seconds;         // wall time of init and ticks
+    int threads;            // the run's team, 1 when packed
+};
+
+// Big runs go one after another on all threads. The small ones become
+// OpenMP tasks, longest first, that idle threads pick up (and steal, with
+// runtimes that keep a queue per thread); each runs on the thread that
+// took it, the inner parallel regions of a GSimulation being nested and
+// kept serial. A packed run gives the results of a standalone run on one
+// thread; against one on a bigger team, whose reductions add up in another
+// order, energies can differ in the last bits. setup applies the command
+// line to each fresh simulation before the sweep sets its case. Progress
+// goes to log.
+std::vector<EnsembleRun> ensemble_run(const EnsembleSpec& spec, const std::function<void(GSimulation&)>& setup, FILE* log);
+
+// "a:b" for every integer from a to b, or a comma separated list.
+bool ensemble_parse_ints(const std::string& text, std::vector<int>& out);
+// "a:b:n" for n values evenly from a to b, or a comma separated list.
+bool ensemble_parse_reals(const std::string& text, std::vector<double>& out);
+
+// The runs in index order, with the sweep's wall time.
+void ensemble_print(const std::vector<EnsembleRun>& runs, double wall, FILE* out);
+// path "-" is stdout.
+bool ensemble_write_csv(const char* path, const std::vector<EnsembleRun>& runs);
+
+#endif
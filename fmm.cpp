@@ -0,0 +1,442 @@
+#include <cmath>
+#include <algorithm>
+#include <omp.h>
+
+#include "fmm.hpp"
+
+// cells with fewer bodies than this are handled by the task that reached them
+#define FMM_TASK_THRESHOLD 2048
+
+typedef std::complex<double> complex_t;
+
+static inline double odd_or_even(int n) { return (n & 1) ? -1. : 1.; }
+static inline double ipow2n(int n)      { return n >= 0 ? 1. : odd_or_even(n); }
+
+static void cart2sph(const double dX[3], double& r, double& theta, double& phi) {
+    r = sqrt(dX[0] * dX[0] + dX[1] * dX[1] + dX[2] * dX[2]);
+    theta = r == 0. ? 0. : acos(std::max(-1., std::min(1., dX[2] / r)));
+    phi = atan2(dX[1], dX[0]);
+}
+
+static void sph2cart(double r, double theta, double phi, const double spherical[3], double cartesian[3]) {
+    double st = sin(theta), ct = cos(theta);
+    double sp = sin(phi), cp = cos(phi);
+    double invSin = st != 0. ? 1. / st : 0.;
+    cartesian[0] = st * cp * spherical[0] + ct * cp / r * spherical[1] - sp / r * invSin * spherical[2];
+    cartesian[1] = st * sp * spherical[0] + ct * sp / r * spherical[1] + cp / r * invSin * spherical[2];
+    cartesian[2] = ct * spherical[0] - st / r * spherical[1];
+}
+
+// r^n Y_n^m scaled for the multipole side, plus its theta derivative
+static void eval_multipole(int P, double rho, double alpha, double beta, complex_t* Ynm, complex_t* YnmTheta) {
+    double x = cos(alpha);
+    double y = sin(alpha);
+    double invY = y == 0. ? 0. : 1. / y;
+    double fact = 1.;
+    double pn = 1.;
+    double rhom = 1.;
+    complex_t ei = std::exp(complex_t(0., beta));
+    complex_t eim = 1.;
+    for (int m = 0; m < P; m++) {
+        double p = pn;
+        int npn = m * m + 2 * m;
+        int nmn = m * m;
+        Ynm[npn] = rhom * p * eim;
+        Ynm[nmn] = std::conj(Ynm[npn]);
+        double p1 = p;
+        p = x * (2 * m + 1) * p1;
+        YnmTheta[npn] = rhom * (p - (m + 1) * x * p1) * invY * eim;
+        rhom *= rho;
+        double rhon = rhom;
+        for (int n = m + 1; n < P; n++) {
+            int npm = n * n + n + m;
+            int nmm = n * n + n - m;
+            rhon /= -(n + m);
+            Ynm[npm] = rhon * p * eim;
+            Ynm[nmm] = std::conj(Ynm[npm]);
+            double p2 = p1;
+            p1 = p;
+            p = (x * (2 * n + 1) * p1 - (n + m) * p2) / (n - m + 1);
+            YnmTheta[npm] = rhon * ((n - m + 1) * p - (n + 1) * x * p1) * invY * eim;
+            rhon *= rho;
+        }
+        rhom /= -(2 * m + 2) * (2 * m + 1);
+        pn = -pn * fact * y;
+        fact += 2;
+        eim *= ei;
+    }
+}
+
+// r^-(n+1) Y_n^m scaled for the local side
+static void eval_local(int P, double rho, double alpha, double beta, complex_t* Ynm) {
+    double x = cos(alpha);
+    double y = sin(alpha);
+    double fact = 1.;
+    double pn = 1.;
+    double invR = -1. / rho;
+    double rhom = -invR;
+    complex_t ei = std::exp(complex_t(0., beta));
+    complex_t eim = 1.;
+    for (int m = 0; m < P; m++) {
+        double p = pn;
+        int npn = m * m + 2 * m;
+        int nmn = m * m;
+        Ynm[npn] = rhom * p * eim;
+        Ynm[nmn] = std::conj(Ynm[npn]);
+        double p1 = p;
+        p = x * (2 * m + 1) * p1;
+        rhom *= invR;
+        double rhon = rhom;
+        for (int n = m + 1; n < P; n++) {
+            int npm = n * n + n + m;
+            int nmm = n * n + n - m;
+            Ynm[npm] = rhon * p * eim;
+            Ynm[nmm] = std::conj(Ynm[npm]);
+            double p2 = p1;
+            p1 = p;
+            p = (x * (2 * n + 1) * p1 - (n + m) * p2) / (n - m + 1);
+            rhon *= invR * (n - m + 1);
+        }
+        pn = -pn * fact * y;
+        fact += 2;
+        eim *= ei;
+    }
+}
+
+Fmm::Fmm() {
+    order = 4;
+    theta = .5;
+    _terms = 0;
+    _softeningSquared = 0.;
+    _tree.leafSize = 64;
+}
+
+double Fmm::evaluate(const real_type* x, const real_type* y, const real_type* z, const real_type* mass,
+                     int n, real_type G, real_type softeningSquared,
+                     real_type* ax, real_type* ay, real_type* az, real_type* pe) {
+    order = std::max(0, std::min(order, FMM_MAX_ORDER));
+    int P = order + 1;
+    _terms = P * (P + 1) / 2;
+    _softeningSquared = softeningSquared;
+
+    _tree.build(x, y, z, mass, n, theta);
+
+    int nodes = _tree.node_count();
+    const OctreeNode* nd = _tree.nodes();
+
+    _M.assign((size_t)nodes * _terms, 0.);
+    _L.assign((size_t)nodes * _terms, 0.);
+    _radius.resize(nodes);
+    _count.assign(nodes, 0.);
+    for (int k = 0; k < 3; k++)
+        _acc[k].assign(n, 0.);
+    _pot.assign(n, 0.);
+
+    #pragma omp parallel for schedule(static)
+    for (int c = 0; c < nodes; c++)
+        _radius[c] = nd[c].size * sqrt(3.) * .5;
+
+    if (n > 0) {
+        #pragma omp parallel
+        #pragma omp single
+        {
+            upward(0);
+            traverse(0, 0);
+            downward(0);
+        }
+    }
+
+    // back to the original order, in gravity units
+    const int32_t* perm = _tree.order();
+    #pragma omp parallel for schedule(static)
+    for (int s = 0; s < n; s++) {
+        int i = perm[s];
+        if (ax) {
+            ax[i] = G * _acc[0][s];
+            ay[i] = G * _acc[1][s];
+            az[i] = G * _acc[2][s];
+        }
+        pe[i] = -G * _pot[s];
+    }
+
+    double interactions = 0.;
+    #pragma omp parallel for reduction(+ : interactions)
+    for (int c = 0; c < nodes; c++)
+        interactions += _count[c];
+
+    return interactions;
+}
+
+void Fmm::upward(int node) {
+    const OctreeNode& nd = _tree.nodes()[node];
+
+    if (nd.child < 0) {
+        p2m(node);
+        return;
+    }
+
+    for (int c = nd.child; c < nd.child + nd.childCount; c++) {
+        if (_tree.nodes()[c].end - _tree.nodes()[c].begin > FMM_TASK_THRESHOLD) {
+            #pragma omp task firstprivate(c)
+            upward(c);
+        } else {
+            upward(c);
+        }
+    }
+    #pragma omp taskwait
+
+    for (int c = nd.child; c < nd.child + nd.childCount; c++)
+        m2m(node, c);
+}
+
+// Only the target side is ever split into tasks, so no two tasks write the
+// same cell's local expansion or the same bodies.
+void Fmm::traverse(int ci, int cj) {
+    const OctreeNode* nodes = _tree.nodes();
+    const OctreeNode& a = nodes[ci];
+    const OctreeNode& b = nodes[cj];
+
+    double dx = a.center[0] - b.center[0];
+    double dy = a.center[1] - b.center[1];
+    double dz = a.center[2] - b.center[2];
+    double R2 = (dx * dx + dy * dy + dz * dz) * theta * theta;
+    double Rsum = _radius[ci] + _radius[cj];
+
+    if (R2 > Rsum * Rsum) {
+        m2l(ci, cj);
+    } else if (a.child < 0 && b.child < 0) {
+        p2p(ci, cj);
+    } else if (b.child < 0 || (a.child >= 0 && _radius[ci] >= _radius[cj])) {
+        for (int c = a.child; c < a.child + a.childCount; c++) {
+            if (a.end - a.begin > FMM_TASK_THRESHOLD) {
+                #pragma omp task firstprivate(c, cj)
+                traverse(c, cj);
+            } else {
+                traverse(c, cj);
+            }
+        }
+        #pragma omp taskwait
+    } else {
+        for (int c = b.child; c < b.child + b.childCount; c++)
+            traverse(ci, c);
+    }
+}
+
+void Fmm::downward(int node) {
+    const OctreeNode& nd = _tree.nodes()[node];
+
+    if (nd.child < 0) {
+        l2p(node);
+        return;
+    }
+
+    for (int c = nd.child; c < nd.child + nd.childCount; c++) {
+        l2l(node, c);
+        if (_tree.nodes()[c].end - _tree.nodes()[c].begin > FMM_TASK_THRESHOLD) {
+            #pragma omp task firstprivate(c)
+            downward(c);
+        } else {
+            downward(c);
+        }
+    }
+    #pragma omp taskwait
+}
+
+void Fmm::p2m(int node) {
+    const int P = order + 1;
+    const OctreeNode& nd = _tree.nodes()[node];
+    complex_t Ynm[(FMM_MAX_ORDER + 1) * (FMM_MAX_ORDER + 1)], YnmTheta[(FMM_MAX_ORDER + 1) * (FMM_MAX_ORDER + 1)];
+    complex_t* M = &_M[(size_t)node * _terms];
+
+    for (int s = nd.begin; s < nd.end; s++) {
+        double dX[3] = {_tree.sorted(0)[s] - nd.center[0], _tree.sorted(1)[s] - nd.center[1], _tree.sorted(2)[s] - nd.center[2]};
+        double rho, alpha, beta;
+        cart2sph(dX, rho, alpha, beta);
+        eval_multipole(P, rho, alpha, beta, Ynm, YnmTheta);
+        double q = _tree.sorted(3)[s];
+        for (int n = 0; n < P; n++)
+            for (int m = 0; m <= n; m++)
+                M[n * (n + 1) / 2 + m] += q * Ynm[n * n + n - m];
+    }
+}
+
+void Fmm::m2m(int parent, int child) {
+    const int P = order + 1;
+    const OctreeNode* nodes = _tree.nodes();
+    complex_t Ynm[(FMM_MAX_ORDER + 1) * (FMM_MAX_ORDER + 1)], YnmTheta[(FMM_MAX_ORDER + 1) * (FMM_MAX_ORDER + 1)];
+    complex_t* Mi = &_M[(size_t)parent * _terms];
+    const complex_t* Mj = &_M[(size_t)child * _terms];
+
+    double dX[3];
+    for (int k = 0; k < 3; k++)
+        dX[k] = nodes[parent].center[k] - nodes[child].center[k];
+    double rho, alpha, beta;
+    cart2sph(dX, rho, alpha, beta);
+    eval_multipole(P, rho, alpha, beta, Ynm, YnmTheta);
+
+    for (int j = 0; j < P; j++) {
+        for (int k = 0; k <= j; k++) {
+            complex_t M = 0.;
+            for (int n = 0; n <= j; n++) {
+                for (int m = std::max(-n, -j + k + n); m <= std::min(k - 1, n); m++) {
+                    int jnkms = (j - n) * (j - n + 1) / 2 + k - m;
+                    int nm = n * n + n - m;
+                    M += Mj[jnkms] * Ynm[nm] * (ipow2n(m) * odd_or_even(n));
+                }
+                for (int m = k; m <= std::min(n, j + k - n); m++) {
+                    int jnkms = (j - n) * (j - n + 1) / 2 - k + m;
+                    int nm = n * n + n - m;
+                    M += std::conj(Mj[jnkms]) * Ynm[nm] * odd_or_even(k + n + m);
+                }
+            }
+            Mi[j * (j + 1) / 2 + k] += M;
+        }
+    }
+}
+
+void Fmm::m2l(int ci, int cj) {
+    const int P = order + 1;
+    const OctreeNode* nodes = _tree.nodes();
+    complex_t Ynm[(FMM_MAX_ORDER + 1) * (FMM_MAX_ORDER + 1)];
+    complex_t* Li = &_L[(size_t)ci * _terms];
+    const complex_t* Mj = &_M[(size_t)cj * _terms];
+
+    double dX[3];
+    for (int k = 0; k < 3; k++)
+        dX[k] = nodes[ci].center[k] - nodes[cj].center[k];
+    double rho, alpha, beta;
+    cart2sph(dX, rho, alpha, beta);
+    eval_local(P, rho, alpha, beta, Ynm);
+
+    for (int j = 0; j < P; j++) {
+        double Cnm = odd_or_even(j);
+        for (int k = 0; k <= j; k++) {
+            complex_t L = 0.;
+            for (int n = 0; n < P - j; n++) {
+                for (int m = -n; m < 0; m++) {
+                    int nms = n * (n + 1) / 2 - m;
+                    int jnkm = (j + n) * (j + n) + j + n + m - k;
+                    L += std::conj(Mj[nms]) * Cnm * Ynm[jnkm];
+                }
+                for (int m = 0; m <= n; m++) {
+                    int nms = n * (n + 1) / 2 + m;
+                    int jnkm = (j + n) * (j + n) + j + n + m - k;
+                    double Cnm2 = Cnm * odd_or_even((k - m) * (k < m) + m);
+                    L += Mj[nms] * Cnm2 * Ynm[jnkm];
+                }
+            }
+            Li[j * (j + 1) / 2 + k] += L;
+        }
+    }
+
+    _count[ci] += 1.;
+}
+
+void Fmm::l2l(int parent, int child) {
+    const int P = order + 1;
+    const OctreeNode* nodes = _tree.nodes();
+    complex_t Ynm[(FMM_MAX_ORDER + 1) * (FMM_MAX_ORDER + 1)], YnmTheta[(FMM_MAX_ORDER + 1) * (FMM_MAX_ORDER + 1)];
+    complex_t* Li = &_L[(size_t)child * _terms];
+    const complex_t* Lj = &_L[(size_t)parent * _terms];
+
+    double dX[3];
+    for (int k = 0; k < 3; k++)
+        dX[k] = nodes[child].center[k] - nodes[parent].center[k];
+    double rho, alpha, beta;
+    cart2sph(dX, rho, alpha, beta);
+    eval_multipole(P, rho, alpha, beta, Ynm, YnmTheta);
+
+    for (int j = 0; j < P; j++) {
+        for (int k = 0; k <= j; k++) {
+            complex_t L = 0.;
+            for (int n = j; n < P; n++) {
+                for (int m = j + k - n; m < 0; m++) {
+                    int jnkm = (n - j) * (n - j) + n - j + m - k;
+                    int nms = n * (n + 1) / 2 - m;
+                    L += std::conj(Lj[nms]) * Ynm[jnkm] * odd_or_even(k);
+                }
+                for (int m = 0; m <= n; m++) {
+                    if (n - j >= abs(m - k)) {
+                        int jnkm = (n - j) * (n - j) + n - j + m - k;
+                        int nms = n * (n + 1) / 2 + m;
+                        L += Lj[nms] * Ynm[jnkm] * odd_or_even((m - k) * (m < k));
+                    }
+                }
+            }
+            Li[j * (j + 1) / 2 + k] += L;
+        }
+    }
+}
+
+void Fmm::l2p(int node) {
+    const int P = order + 1;
+    const OctreeNode& nd = _tree.nodes()[node];
+    complex_t Ynm[(FMM_MAX_ORDER + 1) * (FMM_MAX_ORDER + 1)], YnmTheta[(FMM_MAX_ORDER + 1) * (FMM_MAX_ORDER + 1)];
+    const complex_t* L = &_L[(size_t)node * _terms];
+    const complex_t I(0., 1.);
+
+    for (int s = nd.begin; s < nd.end; s++) {
+        double dX[3] = {_tree.sorted(0)[s] - nd.center[0], _tree.sorted(1)[s] - nd.center[1], _tree.sorted(2)[s] - nd.center[2]};
+        double r, theta, phi;
+        cart2sph(dX, r, theta, phi);
+        if (r == 0.)
+            r = 1e-300;
+        eval_multipole(P, r, theta, phi, Ynm, YnmTheta);
+
+        double pot = 0.;
+        double spherical[3] = {0., 0., 0.};
+        for (int n = 0; n < P; n++) {
+            int nm = n * n + n;
+            int nms = n * (n + 1) / 2;
+            pot += std::real(L[nms] * Ynm[nm]);
+            spherical[0] += std::real(L[nms] * Ynm[nm]) / r * n;
+            spherical[1] += std::real(L[nms] * YnmTheta[nm]);
+            for (int m = 1; m <= n; m++) {
+                nm = n * n + n + m;
+                nms = n * (n + 1) / 2 + m;
+                pot += 2 * std::real(L[nms] * Ynm[nm]);
+                spherical[0] += 2 * std::real(L[nms] * Ynm[nm]) / r * n;
+                spherical[1] += 2 * std::real(L[nms] * YnmTheta[nm]);
+                spherical[2] += 2 * std::real(L[nms] * Ynm[nm] * I) * m;
+            }
+        }
+
+        double cartesian[3];
+        sph2cart(r, theta, phi, spherical, cartesian);
+        _pot[s] += pot;
+        for (int k = 0; k < 3; k++)
+            _acc[k][s] += cartesian[k];
+    }
+}
+
+void Fmm::p2p(int ci, int cj) {
+    const OctreeNode* nodes = _tree.nodes();
+    const real_type *sx = _tree.sorted(0), *sy = _tree.sorted(1), *sz = _tree.sorted(2), *sm = _tree.sorted(3);
+    const OctreeNode& a = nodes[ci];
+    const OctreeNode& b = nodes[cj];
+
+    for (int s = a.begin; s < a.end; s++) {
+        double accX = 0., accY = 0., accZ = 0., pot = 0.;
+        for (int t = b.begin; t < b.end; t++) {
+            if (s == t)
+                continue;
+            double dx = sx[t] - sx[s];
+            double dy = sy[t] - sy[s];
+            double dz = sz[t] - sz[s];
+            double distanceSqr = std::max(dx * dx + dy * dy + dz * dz, (double)_softeningSquared);
+            double distanceInv = 1.0 / sqrt(distanceSqr);
+            double q = sm[t] * distanceInv;
+            double force = q * distanceInv * distanceInv;
+            accX += dx * force;
+            accY += dy * force;
+            accZ += dz * force;
+            pot += q;
+        }
+        _acc[0][s] += accX;
+        _acc[1][s] += accY;
+        _acc[2][s] += accZ;
+        _pot[s] += pot;
+    }
+
+    _count[ci] += (double)(a.end - a.begin) * (b.end - b.begin);
+}
@@ -0,0 +1,53 @@
+#ifndef FMM_HPP_
+#define FMM_HPP_
+
+#include <vector>
+#include <complex>
+
+#include "nbody.hpp"
+#include "octree.hpp"
+
+#define FMM_MAX_ORDER 20
+
+// Fast multipole method on the octree of the Barnes-Hut solver.
+// Expansions are in solid spherical harmonics about the cell centers,
+// cell pairs are found with a dual tree traversal and the near field is
+// summed directly with the same softening as the other solvers.
+class Fmm {
+    public:
+        int order;          // highest expansion degree, error falls roughly as theta^(order+1)
+        real_type theta;    // multipole acceptance: (Ri + Rj) < theta * distance
+
+        Fmm();
+
+        // Same contract as Octree::evaluate(): accelerations (optional) and
+        // potential per unit of mass in the original order, returns the number
+        // of near field pairs plus far field translations.
+        double evaluate(const real_type* x, const real_type* y, const real_type* z, const real_type* mass,
+                        int n, real_type G, real_type softeningSquared,
+                        real_type* ax, real_type* ay, real_type* az, real_type* pe);
+    private:
+        typedef std::complex<double> complex_t;
+
+        Octree _tree;
+        int _terms;
+        real_type _softeningSquared;
+
+        std::vector<complex_t> _M, _L;
+        std::vector<double> _radius;
+        std::vector<double> _acc[3], _pot;    // Morton order
+        std::vector<double> _count;           // per node, near field pairs + M2L
+
+        void upward(int node);
+        void downward(int node);
+        void traverse(int ci, int cj);
+
+        void p2m(int node);
+        void m2m(int parent, int child);
+        void m2l(int ci, int cj);
+        void l2l(int parent, int child);
+        void l2p(int node);
+        void p2p(int ci, int cj);
+};
+
+#endif
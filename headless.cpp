@@ -0,0 +1,439 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <omp.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "headless.hpp"
+#include "profile.hpp"
+
+// nearer than this to the eye is not drawn, as the GUI's near plane
+#define HEADLESS_NEAR (1.f / 16.f)
+#define SCREEN_STRIDE 8
+
+HeadlessView::HeadlessView() {
+    width = 1280;
+    height = 720;
+    eye[0] = 1.2f; eye[1] = 1.5f; eye[2] = 1.8f;
+    target[0] = target[1] = target[2] = .5f;
+    yFov = 60.f;
+    radius = .05f;
+    light[0] = light[1] = light[2] = 2.f;
+    background[0] = .10f; background[1] = .15f; background[2] = .20f;
+}
+
+HeadlessRenderer::HeadlessRenderer() {
+    frames = 0;
+    dropped = 0;
+    copyTime = 0.;
+    written = 0;
+    bytes = 0;
+    renderTime = 0.;
+    encodeTime = 0.;
+    verify = false;
+    mismatched = 0;
+    _threads = 1;
+    _open = false;
+    _closing = false;
+    _error = 0;
+}
+
+HeadlessRenderer::~HeadlessRenderer() {
+    close(nullptr);
+}
+
+bool HeadlessRenderer::open(const char* dir, const HeadlessView& view, int threads, std::string* error) {
+    close(nullptr);
+    if (view.width < 1 || view.height < 1 || view.width > 16384 || view.height > 16384) {
+        if (error)
+            *error = "render size is 1 to 16384 pixels a side";
+        return false;
+    }
+    if (::mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        if (error)
+            *error = std::string("cannot create ") + dir + ": " + strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if (::stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        if (error)
+            *error = std::string("cannot render to ") + dir + ": " + strerror(errno ? errno : ENOTDIR);
+        return false;
+    }
+
+    _dir = dir;
+    _view = view;
+    _threads = std::max(1, threads);
+    frames = 0;
+    dropped = 0;
+    copyTime = 0.;
+    written = 0;
+    bytes = 0;
+    renderTime = 0.;
+    encodeTime = 0.;
+    mismatched = 0;
+    _error = 0;
+    _failed.clear();
+    _closing = false;
+
+    _frames.assign(HEADLESS_BUFFERS, Frame());
+    int b;
+    while (_free.pop(b) || _filled.pop(b))
+        ;
+    for (int i = 0; i < HEADLESS_BUFFERS; i++)
+        _free.push(i);
+    _open = true;
+    _thread = std::thread(&HeadlessRenderer::loop, this);
+    return true;
+}
+
+bool HeadlessRenderer::record(GSimulation& simulation) {
+    PROFILE_PHASE(Phase_IO);
+    int b;
+    if (!_open)
+        return false;
+    if (!_free.pop(b)) {
+        dropped++;
+        return false;
+    }
+    double start = omp_get_wtime();
+
+    ParticleArray* p = simulation.getPtr();
+    const int n = simulation.get_count();
+    Frame& frame = _frames[b];
+    // dropped frames keep their numbers, frame k stays the k-th one asked for
+    frame.index = frames + dropped;
+    frame.count = n;
+    frame.pos.resize((size_t)n * 3);
+    frame.color.resize((size_t)n * 3);
+
+    // the splatter has a z-buffer, slot order is as good as any
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        for (int k = 0; k < 3; k++) {
+            frame.pos[(size_t)i * 3 + k] = (float)p->pos[k][i];
+            frame.color[(size_t)i * 3 + k] = p->color[i * 3 + k];
+        }
+    }
+
+    _filled.push(b);
+    frames++;
+    copyTime += omp_get_wtime() - start;
+    return true;
+}
+
+void HeadlessRenderer::loop() {
+    for (;;) {
+        // closing is read before the queue, a frame queued before close() is seen
+        bool closing = _closing;
+        int b;
+        if (_filled.pop(b)) {
+            const Frame& frame = _frames[b];
+            if (!_error) {
+                double start = omp_get_wtime();
+                splat(frame);
+                double splatted = omp_get_wtime();
+                renderTime = renderTime + (splatted - start);
+
+                _encoded.clear();
+                qoi_encode(_image.data(), _view.width, _view.height, _encoded);
+                if (verify) {
+                    int w, h;
+                    if (!qoi_decode(_encoded.data(), _encoded.size(), w, h, _decoded)
+                     || w != _view.width || h != _view.height || _decoded != _image)
+                        mismatched++;
+                }
+                char name[32];
+                snprintf(name, sizeof(name), "/frame_%06d.qoi", frame.index);
+                std::string path = _dir + name;
+                FILE* f = fopen(path.c_str(), "wb");
+                bool ok = f && fwrite(_encoded.data(), 1, _encoded.size(), f) == _encoded.size();
+                int failed = errno ? errno : EIO;
+                if (f && fclose(f) != 0) {
+                    failed = errno;
+                    ok = false;
+                }
+                if (ok) {
+                    written++;
+                    bytes += _encoded.size();
+                } else {
+                    _failed = path;
+                    _error = failed;
+                }
+                encodeTime = encodeTime + (omp_get_wtime() - splatted);
+            }
+            _free.push(b);
+            continue;
+        }
+        if (closing)
+            break;
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+}
+
+// Spheres as shaded discs with a per-pixel depth, lit by one point light
+// with the ambient, diffuse and specular of the GUI's fixed function
+// spheres. Each thread of the team owns a band of rows and walks all
+// bodies, so no pixel is written by two threads.
+void HeadlessRenderer::splat(const Frame& frame) {
+    const HeadlessView& v = _view;
+    const int w = v.width, h = v.height;
+    const int n = frame.count;
+    _image.resize((size_t)w * h * 3);
+    _depth.resize((size_t)w * h);
+    _screen.resize((size_t)n * SCREEN_STRIDE);
+
+    // camera basis, forward f, right r and up u
+    float f[3] = {v.target[0] - v.eye[0], v.target[1] - v.eye[1], v.target[2] - v.eye[2]};
+    float fl = std::sqrt(f[0]*f[0] + f[1]*f[1] + f[2]*f[2]);
+    for (int k = 0; k < 3; k++)
+        f[k] = fl > 0.f ? f[k] / fl : (k == 2 ? -1.f : 0.f);
+    float r[3] = {-f[2], 0.f, f[0]};                    // f x (0, 1, 0)
+    float rl = std::sqrt(r[0]*r[0] + r[2]*r[2]);
+    if (rl < 1e-6f) {
+        r[0] = 1.f;
+        r[2] = 0.f;
+    } else {
+        r[0] /= rl;
+        r[2] /= rl;
+    }
+    const float u[3] = {r[1]*f[2] - r[2]*f[1], r[2]*f[0] - r[0]*f[2], r[0]*f[1] - r[1]*f[0]};
+    const float focal = h / (2.f * std::tan(v.yFov * (float)M_PI / 360.f));
+    const float radius = v.radius;
+    const float* pos = frame.pos.data();
+    float* screen = _screen.data();
+
+    #pragma omp parallel for schedule(static) num_threads(_threads)
+    for (int i = 0; i < n; i++) {
+        const float d[3] = {pos[i*3] - v.eye[0], pos[i*3+1] - v.eye[1], pos[i*3+2] - v.eye[2]};
+        const float z = d[0]*f[0] + d[1]*f[1] + d[2]*f[2];
+        float* s = screen + (size_t)i * SCREEN_STRIDE;
+        if (!(z > HEADLESS_NEAR)) {
+            s[3] = 0.f;
+            continue;
+        }
+        s[0] = .5f * w + focal * (d[0]*r[0] + d[1]*r[1] + d[2]*r[2]) / z;
+        s[1] = .5f * h - focal * (d[0]*u[0] + d[1]*u[1] + d[2]*u[2]) / z;
+        s[2] = z;
+        // below a pixel a body still lights one
+        s[3] = std::max(focal * radius / z, .75f);
+
+        // the light's direction in view space, with z towards the eye
+        const float l[3] = {v.light[0] - pos[i*3], v.light[1] - pos[i*3+1], v.light[2] - pos[i*3+2]};
+        float lx = l[0]*r[0] + l[1]*r[1] + l[2]*r[2];
+        float ly = l[0]*u[0] + l[1]*u[1] + l[2]*u[2];
+        float lz = -(l[0]*f[0] + l[1]*f[1] + l[2]*f[2]);
+        float ll = std::sqrt(lx*lx + ly*ly + lz*lz);
+        if (ll > 0.f) {
+            lx /= ll;
+            ly /= ll;
+            lz /= ll;
+        }
+        s[4] = lx;
+        s[5] = ly;
+        s[6] = lz;
+    }
+
+    const float* color = frame.color.data();
+    uint8_t* image = _image.data();
+    float* depth = _depth.data();
+    const uint8_t background[3] = {(uint8_t)(255.f * v.background[0] + .5f), (uint8_t)(255.f * v.background[1] + .5f),
+                                   (uint8_t)(255.f * v.background[2] + .5f)};
+    const float ambient[3] = {.2f, .1f, .1f};
+
+    #pragma omp parallel num_threads(_threads)
+    {
+        const int t = omp_get_thread_num(), teamSize = omp_get_num_threads();
+        const int y0 = (int)((int64_t)h * t / teamSize), y1 = (int)((int64_t)h * (t + 1) / teamSize);
+        for (size_t p = (size_t)y0 * w; p < (size_t)y1 * w; p++) {
+            std::memcpy(image + p * 3, background, 3);
+            depth[p] = HUGE_VALF;
+        }
+
+        for (int i = 0; i < n; i++) {
+            const float* s = screen + (size_t)i * SCREEN_STRIDE;
+            const float pr = s[3];
+            if (pr == 0.f || s[1] + pr < y0 || s[1] - pr >= y1 || s[0] + pr < 0.f || s[0] - pr >= w)
+                continue;
+            const int ya = std::max(y0, (int)std::floor(s[1] - pr)), yb = std::min(y1 - 1, (int)std::ceil(s[1] + pr));
+            const int xa = std::max(0, (int)std::floor(s[0] - pr)), xb = std::min(w - 1, (int)std::ceil(s[0] + pr));
+            const float inv = 1.f / pr;
+            // Blinn-Phong half vector towards an eye straight ahead
+            float hx = s[4], hy = s[5], hz = s[6] + 1.f;
+            float hl = std::sqrt(hx*hx + hy*hy + hz*hz);
+            hx /= hl;
+            hy /= hl;
+            hz /= hl;
+            const float* c = color + (size_t)i * 3;
+
+            for (int y = ya; y <= yb; y++) {
+                const float dy = (s[1] - (y + .5f)) * inv;
+                for (int x = xa; x <= xb; x++) {
+                    const float dx = ((x + .5f) - s[0]) * inv;
+                    const float r2 = dx*dx + dy*dy;
+                    if (r2 > 1.f)
+                        continue;
+                    const float nz = std::sqrt(1.f - r2);
+                    const float z = s[2] - nz * radius;
+                    const size_t p = (size_t)y * w + x;
+                    if (z >= depth[p])
+                        continue;
+                    depth[p] = z;
+
+                    const float diffuse = std::max(dx*s[4] + dy*s[5] + nz*s[6], 0.f);
+                    float specular = 0.f;
+                    if (diffuse > 0.f) {
+                        // x^128 by squaring
+                        specular = std::max(dx*hx + dy*hy + nz*hz, 0.f);
+                        for (int k = 0; k < 7; k++)
+                            specular *= specular;
+                    }
+                    for (int k = 0; k < 3; k++) {
+                        float value = c[k] * (ambient[k] + diffuse) + specular;
+                        image[p * 3 + k] = (uint8_t)(std::min(value, 1.f) * 255.f + .5f);
+                    }
+                }
+            }
+        }
+    }
+}
+
+bool HeadlessRenderer::close(std::string* error) {
+    if (!_open)
+        return true;
+    _closing = true;
+    _thread.join();
+    _open = false;
+    _frames.clear();
+
+    int failed = _error;
+    if (failed && error)
+        *error = std::string("cannot write ") + _failed + ": " + strerror(failed);
+    return !failed;
+}
+
+// The Quite OK Image format, https://qoiformat.org: runs, a 64 entry
+// hash of recent pixels and small deltas, a byte or two per pixel on
+// a dark background. The index holds rgba and starts out zero, alpha
+// included, as a decoder's does; the pixels are all opaque.
+void qoi_encode(const uint8_t* rgb, int width, int height, std::vector<uint8_t>& out) {
+    auto be32 = [&](uint32_t v) {
+        out.push_back(v >> 24);
+        out.push_back(v >> 16);
+        out.push_back(v >> 8);
+        out.push_back(v);
+    };
+    out.insert(out.end(), {'q', 'o', 'i', 'f'});
+    be32(width);
+    be32(height);
+    out.push_back(3);       // channels
+    out.push_back(0);       // sRGB
+
+    uint8_t index[64][4];
+    std::memset(index, 0, sizeof(index));
+    uint8_t prev[4] = {0, 0, 0, 255};
+    int run = 0;
+    const size_t pixels = (size_t)width * height;
+    for (size_t i = 0; i < pixels; i++) {
+        const uint8_t px[4] = {rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2], 255};
+        if (!std::memcmp(px, prev, 4)) {
+            if (++run == 62 || i + 1 == pixels) {
+                out.push_back(0xc0 | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            out.push_back(0xc0 | (run - 1));
+            run = 0;
+        }
+
+        const int hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+        if (!std::memcmp(index[hash], px, 4)) {
+            out.push_back(hash);
+        } else {
+            std::memcpy(index[hash], px, 4);
+            const int8_t dr = (int8_t)(px[0] - prev[0]);
+            const int8_t dg = (int8_t)(px[1] - prev[1]);
+            const int8_t db = (int8_t)(px[2] - prev[2]);
+            const int8_t drg = dr - dg, dbg = db - dg;
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                out.push_back(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            } else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+                out.push_back(0x80 | (dg + 32));
+                out.push_back((drg + 8) << 4 | (dbg + 8));
+            } else {
+                out.insert(out.end(), {0xfe, px[0], px[1], px[2]});
+            }
+        }
+        std::memcpy(prev, px, 4);
+    }
+    out.insert(out.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+}
+
+// Follows the reference decoder op for op, alpha included, so it sees
+// whatever a viewer would.
+bool qoi_decode(const uint8_t* data, size_t size, int& width, int& height, std::vector<uint8_t>& rgb) {
+    auto be32 = [&](size_t at) {
+        return (uint32_t)data[at] << 24 | (uint32_t)data[at + 1] << 16 | (uint32_t)data[at + 2] << 8 | data[at + 3];
+    };
+    if (size < 14 + 8 || std::memcmp(data, "qoif", 4))
+        return false;
+    const uint32_t w = be32(4), h = be32(8);
+    if (w == 0 || h == 0 || w > 16384 || h > 16384 || (data[12] != 3 && data[12] != 4))
+        return false;
+    width = (int)w;
+    height = (int)h;
+    const size_t pixels = (size_t)w * h;
+    rgb.resize(pixels * 3);
+
+    uint8_t index[64][4];
+    std::memset(index, 0, sizeof(index));
+    uint8_t px[4] = {0, 0, 0, 255};
+    const size_t end = size - 8;
+    size_t at = 14;
+    int run = 0;
+    for (size_t i = 0; i < pixels; i++) {
+        if (run > 0) {
+            run--;
+        } else {
+            if (at >= end)
+                return false;
+            const uint8_t op = data[at++];
+            if (op == 0xfe) {
+                if (at + 3 > end)
+                    return false;
+                std::memcpy(px, data + at, 3);
+                at += 3;
+            } else if (op == 0xff) {
+                if (at + 4 > end)
+                    return false;
+                std::memcpy(px, data + at, 4);
+                at += 4;
+            } else if ((op & 0xc0) == 0x00) {
+                std::memcpy(px, index[op], 4);
+            } else if ((op & 0xc0) == 0x40) {
+                px[0] += ((op >> 4) & 3) - 2;
+                px[1] += ((op >> 2) & 3) - 2;
+                px[2] += (op & 3) - 2;
+            } else if ((op & 0xc0) == 0x80) {
+                if (at >= end)
+                    return false;
+                const int dg = (op & 0x3f) - 32;
+                const uint8_t b = data[at++];
+                px[0] += dg - 8 + (b >> 4);
+                px[1] += dg;
+                px[2] += dg - 8 + (b & 0x0f);
+            } else {
+                run = op & 0x3f;
+            }
+            std::memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+        }
+        std::memcpy(&rgb[i * 3], px, 3);
+    }
+    return at == end && !std::memcmp(data + end, "\0\0\0\0\0\0\0\1", 8);
+}
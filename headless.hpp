@@ -0,0 +1,96 @@
+#ifndef HEADLESS_HPP_
+#define HEADLESS_HPP_
+
+#include <atomic>
+#include <thread>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "nbody.hpp"
+#include "sim_thread.hpp"
+
+#define HEADLESS_BUFFERS 4
+
+// The camera and light of the GUI's defaults, so a movie looks like the
+// window would.
+struct HeadlessView {
+    int width, height;
+    float eye[3];
+    float target[3];
+    float yFov;             // degrees
+    float radius;           // of a body, in world units
+    float light[3];
+    float background[3];
+
+    HeadlessView();
+};
+
+// Renders frames of a GSimulation without a display into dir/frame_NNNNNN.qoi.
+// record() copies positions and colors into one of HEADLESS_BUFFERS pooled
+// buffers and hands it to an encoder thread, which splats the bodies as
+// shaded spheres on its own OpenMP team, then QOI compresses and writes
+// the image. Like TrajectoryWriter it never waits, a frame that finds no
+// free buffer is dropped and counted. NNNNNN counts every record() call,
+// dropped ones included, so a drop leaves a gap in the file names and frame
+// k stays the k-th frame asked for.
+class HeadlessRenderer {
+    public:
+        int frames;             // handed to the encoder
+        int dropped;            // no free buffer
+        double copyTime;        // seconds spent in record()
+        std::atomic<int> written;
+        std::atomic<uint64_t> bytes;
+        std::atomic<double> renderTime;     // encoder seconds splatting
+        std::atomic<double> encodeTime;     // encoder seconds compressing and writing
+        bool verify;                        // decode every frame again and compare, set before open()
+        std::atomic<int> mismatched;        // verified frames that did not decode to the image
+
+        HeadlessRenderer();
+        ~HeadlessRenderer();
+        HeadlessRenderer(const HeadlessRenderer&) = delete;
+        HeadlessRenderer& operator=(const HeadlessRenderer&) = delete;
+
+        // Creates dir when missing. threads is the splatter's team size.
+        bool open(const char* dir, const HeadlessView& view, int threads, std::string* error);
+        bool record(GSimulation& simulation);
+        // Encodes what is queued. False when any frame failed to write.
+        bool close(std::string* error);
+
+    private:
+        struct Frame {
+            int index;
+            int count;
+            std::vector<float> pos;     // xyz per body, slot order
+            std::vector<float> color;
+        };
+
+        HeadlessView _view;
+        std::string _dir;
+        int _threads;
+        std::vector<Frame> _frames;
+        SpscQueue<int, HEADLESS_BUFFERS> _free;     // encoder -> record()
+        SpscQueue<int, HEADLESS_BUFFERS> _filled;   // record() -> encoder
+        std::atomic<bool> _open;
+        std::atomic<bool> _closing;
+        std::atomic<int> _error;                    // errno of the first failed frame
+        std::string _failed;                        // its path, set before _error
+        std::thread _thread;
+
+        // encoder thread state
+        std::vector<uint8_t> _image;
+        std::vector<float> _depth;
+        std::vector<float> _screen;                 // x, y, depth, pixel radius per body
+        std::vector<uint8_t> _encoded;
+        std::vector<uint8_t> _decoded;
+
+        void loop();
+        void splat(const Frame& frame);
+};
+
+// QOI image of width x height rgb pixels, appended to out.
+void qoi_encode(const uint8_t* rgb, int width, int height, std::vector<uint8_t>& out);
+// The rgb pixels of a QOI image, false when it is malformed.
+bool qoi_decode(const uint8_t* data, size_t size, int& width, int& height, std::vector<uint8_t>& rgb);
+
+#endif
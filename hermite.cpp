@@ -0,0 +1,224 @@
+#include <cmath>
+#include <algorithm>
+#include <omp.h>
+
+#include "hermite.hpp"
+
+BlockHermite::BlockHermite() {
+    eta = .02;
+    etaStart = .01;
+    maxLevel = 12;
+    _count = -1;
+    _substeps = 0;
+    _mass = nullptr;
+}
+
+int BlockHermite::level_for(real_type dt, real_type dtMax) {
+    int level = 0;
+    real_type s = dtMax;
+    while (s > dt && level < maxLevel) {
+        s *= .5;
+        level++;
+    }
+    return level;
+}
+
+// Acceleration and jerk of body i from the predicted state of all bodies.
+// Inside the softening radius the clamp makes the force harmonic, which
+// drops the radial term of the jerk. i itself adds nothing, its offsets are 0.
+void BlockHermite::evaluate(int i, int n, real_type G, real_type softeningSquared, real_type a[3], real_type j[3]) {
+    const real_type *x = _pred[0].data(), *y = _pred[1].data(), *z = _pred[2].data();
+    const real_type *vx = _pred[3].data(), *vy = _pred[4].data(), *vz = _pred[5].data();
+    const real_type *mass = _mass;
+
+    const real_type xi = x[i], yi = y[i], zi = z[i];
+    const real_type vxi = vx[i], vyi = vy[i], vzi = vz[i];
+    real_type ax = 0., ay = 0., az = 0.;
+    real_type jx = 0., jy = 0., jz = 0.;
+
+    #pragma omp simd reduction(+ : ax, ay, az, jx, jy, jz)
+    for (int k = 0; k < n; k++) {
+        real_type dx = x[k] - xi;
+        real_type dy = y[k] - yi;
+        real_type dz = z[k] - zi;
+        real_type dvx = vx[k] - vxi;
+        real_type dvy = vy[k] - vyi;
+        real_type dvz = vz[k] - vzi;
+
+        real_type distanceSqr = dx * dx + dy * dy + dz * dz;
+        bool inside = distanceSqr < softeningSquared;
+        real_type distanceInv = 1.0 / sqrt(inside ? softeningSquared : distanceSqr);
+        real_type gm = G * mass[k] * distanceInv * distanceInv * distanceInv;
+        real_type rv = inside ? 0. : 3. * (dx * dvx + dy * dvy + dz * dvz) * distanceInv * distanceInv;
+
+        ax += gm * dx;
+        ay += gm * dy;
+        az += gm * dz;
+        jx += gm * (dvx - rv * dx);
+        jy += gm * (dvy - rv * dy);
+        jz += gm * (dvz - rv * dz);
+    }
+
+    a[0] = ax; a[1] = ay; a[2] = az;
+    j[0] = jx; j[1] = jy; j[2] = jz;
+}
+
+void BlockHermite::start(ParticleArray& p, int n, real_type G, real_type softeningSquared, real_type dtMax) {
+    _count = n;
+    _mass = p.mass;
+    maxLevel = std::max(0, std::min(maxLevel, HERMITE_MAX_LEVEL));
+
+    for (int k = 0; k < 3; k++)
+        _jerk[k].resize(n);
+    for (int k = 0; k < 6; k++)
+        _pred[k].resize(n);
+    _time.assign(n, 0);
+    _level.resize(n);
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        for (int k = 0; k < 3; k++) {
+            _pred[k][i] = p.pos[k][i];
+            _pred[3 + k][i] = p.vel[k][i];
+        }
+    }
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int i = 0; i < n; i++) {
+        real_type a[3], j[3];
+        evaluate(i, n, G, softeningSquared, a, j);
+        for (int k = 0; k < 3; k++) {
+            p.acc[k][i] = a[k];
+            _jerk[k][i] = j[k];
+        }
+
+        real_type A = sqrt(a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+        real_type J = sqrt(j[0] * j[0] + j[1] * j[1] + j[2] * j[2]);
+        _level[i] = (int8_t)level_for(J > 0. ? etaStart * A / J : dtMax, dtMax);
+    }
+}
+
+void BlockHermite::permute(const int32_t* order) {
+    if (_count < 0)
+        return;
+
+    for (int k = 0; k < 3; k++) {
+        std::vector<real_type>& scratch = _pred[k];
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < _count; i++)
+            scratch[i] = _jerk[k][order[i]];
+        _jerk[k].swap(scratch);
+    }
+
+    std::vector<int8_t> level(_count);
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < _count; i++)
+        level[i] = _level[order[i]];
+    _level.swap(level);
+}
+
+double BlockHermite::step(ParticleArray& p, int n, real_type G, real_type softeningSquared, real_type dtMax) {
+    maxLevel = std::max(0, std::min(maxLevel, HERMITE_MAX_LEVEL));
+    _mass = p.mass;
+
+    const int64_t end = (int64_t)1 << maxLevel;
+    const real_type unit = dtMax / (real_type)end;
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        _time[i] = 0;
+        _level[i] = (int8_t)std::min((int)_level[i], maxLevel);
+    }
+
+    double pairs = 0.;
+    _substeps = 0;
+
+    for (int64_t now = 0; now < end; _substeps++) {
+        // the next block time is the earliest end of a step
+        int64_t next = end;
+        #pragma omp parallel for schedule(static) reduction(min : next)
+        for (int i = 0; i < n; i++)
+            next = std::min(next, _time[i] + (end >> _level[i]));
+
+        // active set, every thread compacts its share
+        _active.clear();
+        #pragma omp parallel
+        {
+            std::vector<int32_t> local;
+            #pragma omp for schedule(static) nowait
+            for (int i = 0; i < n; i++)
+                if (_time[i] + (end >> _level[i]) == next)
+                    local.push_back(i);
+            #pragma omp critical
+            _active.insert(_active.end(), local.begin(), local.end());
+        }
+
+        // everybody predicted to the block time, the active bodies read this only
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < n; i++) {
+            real_type dt = (real_type)(next - _time[i]) * unit;
+            real_type dt2 = dt * dt * .5;
+            real_type dt3 = dt * dt2 / 3.;
+            for (int k = 0; k < 3; k++) {
+                _pred[k][i] = p.pos[k][i] + p.vel[k][i] * dt + p.acc[k][i] * dt2 + _jerk[k][i] * dt3;
+                _pred[3 + k][i] = p.vel[k][i] + p.acc[k][i] * dt + _jerk[k][i] * dt2;
+            }
+        }
+
+        const int active = (int)_active.size();
+
+        #pragma omp parallel for schedule(dynamic, 16)
+        for (int s = 0; s < active; s++) {
+            int i = _active[s];
+            real_type a1[3], j1[3];
+            evaluate(i, n, G, softeningSquared, a1, j1);
+
+            // Hermite corrector, snap and crackle from the two ends of the step
+            real_type dt = (real_type)(next - _time[i]) * unit;
+            real_type dt2 = dt * dt, dt3 = dt2 * dt;
+            real_type snap[3], crackle[3];
+            for (int k = 0; k < 3; k++) {
+                real_type a0 = p.acc[k][i], j0 = _jerk[k][i];
+                real_type s2 = (-6. * (a0 - a1[k]) - dt * (4. * j0 + 2. * j1[k])) / dt2;
+                real_type s3 = (12. * (a0 - a1[k]) + 6. * dt * (j0 + j1[k])) / dt3;
+
+                p.pos[k][i] = _pred[k][i] + s2 * dt2 * dt2 / 24. + s3 * dt2 * dt3 / 120.;
+                p.vel[k][i] = _pred[3 + k][i] + s2 * dt3 / 6. + s3 * dt2 * dt2 / 24.;
+                p.acc[k][i] = a1[k];
+                _jerk[k][i] = j1[k];
+
+                snap[k] = s2 + s3 * dt;
+                crackle[k] = s3;
+            }
+
+            // Aarseth criterion at the end of the step
+            real_type A = sqrt(a1[0] * a1[0] + a1[1] * a1[1] + a1[2] * a1[2]);
+            real_type J = sqrt(j1[0] * j1[0] + j1[1] * j1[1] + j1[2] * j1[2]);
+            real_type S = sqrt(snap[0] * snap[0] + snap[1] * snap[1] + snap[2] * snap[2]);
+            real_type C = sqrt(crackle[0] * crackle[0] + crackle[1] * crackle[1] + crackle[2] * crackle[2]);
+            real_type den = J * C + S * S;
+            real_type dtNew = den > 0. ? sqrt(eta * (A * S + J * J) / den) : dtMax;
+
+            // shrinking keeps a body on the block grid, growing is one level at
+            // a time and only where the doubled step starts on the grid too
+            int level = _level[i];
+            while (level < maxLevel && (real_type)(end >> level) * unit > dtNew)
+                level++;
+            if (level == _level[i] && level > 0 && (real_type)(end >> (level - 1)) * unit <= dtNew
+                    && next % (end >> (level - 1)) == 0)
+                level--;
+
+            _level[i] = (int8_t)level;
+            _time[i] = next;
+        }
+
+        pairs += (double)active * (n - 1);
+        now = next;
+    }
+
+    _histogram.assign(maxLevel + 1, 0);
+    for (int i = 0; i < n; i++)
+        _histogram[_level[i]]++;
+
+    return pairs;
+}
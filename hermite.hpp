@@ -0,0 +1,57 @@
+#ifndef HERMITE_HPP_
+#define HERMITE_HPP_
+
+#include <vector>
+#include <cstdint>
+
+#include "nbody.hpp"
+
+// deepest block level, steps are dtMax / 2^level
+#define HERMITE_MAX_LEVEL 30
+
+// Fourth order Hermite integrator with hierarchical block time steps.
+// Every body steps with dtMax / 2^level, the level comes from its
+// acceleration and jerk through the Aarseth criterion. A sub-step only
+// recomputes the bodies whose step ends there (the active set), against
+// all bodies predicted to that time. At the end of step() every body is
+// back in sync, so the columns of ParticleArray hold one consistent state.
+// Forces are direct sums of plain softened gravity.
+class BlockHermite {
+    public:
+        real_type eta;          // Aarseth accuracy parameter
+        real_type etaStart;     // first step is etaStart * |a| / |j|
+        int maxLevel;           // smallest step is dtMax / 2^maxLevel
+
+        BlockHermite();
+
+        // Accelerations and jerks of all bodies and their first levels.
+        // Needed whenever the state was changed from outside.
+        void start(ParticleArray& p, int n, real_type G, real_type softeningSquared, real_type dtMax);
+
+        // Advances every body by dtMax. Returns the number of pair interactions.
+        double step(ParticleArray& p, int n, real_type G, real_type softeningSquared, real_type dtMax);
+
+        // Carries jerks and levels along when ParticleArray::permute() moves the bodies.
+        void permute(const int32_t* order);
+
+        bool started(int n)      {return _count == n;}
+        int substeps()           {return _substeps;}
+        // bodies per level after the last step
+        const std::vector<int>& levels() {return _histogram;}
+    private:
+        int _count;
+        int _substeps;
+        const real_type* _mass;
+
+        std::vector<real_type> _jerk[3];
+        std::vector<real_type> _pred[6];    // predicted x, y, z, vx, vy, vz
+        std::vector<int64_t> _time;         // in units of the deepest step
+        std::vector<int8_t> _level;
+        std::vector<int32_t> _active;
+        std::vector<int> _histogram;
+
+        void evaluate(int i, int n, real_type G, real_type softeningSquared, real_type a[3], real_type j[3]);
+        int level_for(real_type dt, real_type dtMax);
+};
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef INTEGRATOR_HPP_
+#define INTEGRATOR_HPP_
+
+// Splitting integrators as compile time policies for GSimulation::integrate().
+// A tick runs stages times kick(s), drift(s) and a force pass, then the
+// closing kick(stages). Coefficients are fractions of dt. The accelerations
+// of the last force pass are reused by the first kick of the next tick, so
+// a policy with startForces needs them computed once before its first tick.
+
+// The original scheme: kick and drift with the accelerations of the last
+// tick, then forces. The direct solver pairs it with its predictor step.
+struct LegacyPolicy {
+    static const int stages = 1;
+    static const bool startForces = false;
+    static constexpr double kick(int s)  {return s == 0 ? 1. : 0.;}
+    static constexpr double drift(int /*s*/) {return 1.;}
+};
+
+// Kick-drift-kick leapfrog, second order and symplectic.
+struct LeapfrogPolicy {
+    static const int stages = 1;
+    static const bool startForces = true;
+    static constexpr double kick(int /*s*/)  {return .5;}
+    static constexpr double drift(int /*s*/) {return 1.;}
+};
+
+// Yoshida's fourth order composition of three leapfrog steps,
+// w1 = 1 / (2 - 2^(1/3)), w0 = 1 - 2 w1.
+struct Yoshida4Policy {
+    static const int stages = 3;
+    static const bool startForces = true;
+    static constexpr double w1 = 1.3512071919596578;
+    static constexpr double w0 = -1.7024143839193153;
+    static constexpr double kick(int s)  {return s == 0 || s == 3 ? w1 * .5 : (w0 + w1) * .5;}
+    static constexpr double drift(int s) {return s == 1 ? w0 : w1;}
+};
+
+#endif
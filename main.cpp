@@ -24,10 +24,27 @@
 #include <SDL_opengl.h>
 #include <GL/glu.h>
 #include <omp.h>
+#include <string>
+#include <memory>
+#ifdef __linux__
+#include <unistd.h>
+#endif
 
 #include "args.hxx"
 
 #include "nbody.hpp"
+#include "pm.hpp"
+#include "hermite.hpp"
+#include "numa.hpp"
+#include "sim_thread.hpp"
+#include "trajectory.hpp"
+#include "replay.hpp"
+#include "bench.hpp"
+#include "profile.hpp"
+#include "render.hpp"
+#include "headless.hpp"
+#include "picking.hpp"
+#include "ensemble.hpp"
 
 void cube(float x, float y, float z, float size)
 {
@@ -111,6 +128,8 @@ int main(int argc, char* argv[]) {
     args::HelpFlag help(parser, "help", "Display this help menu", { 'h', "help" });
     args::Flag gui(parser, "GUI", "Enable GUI", {'g', "gui"});
     args::ValueFlag<int> seed(parser, "seed", "Simulation seed", { "seed" });
+    std::unordered_map<std::string, int> rngMap{{"philox", Rng_Philox}, {"mt19937", Rng_MT19937}};
+    args::MapFlag<std::string, int> rng(parser, "rng", "Initial conditions generator: philox (parallel), mt19937 (sequences of earlier versions)", {"rng"}, rngMap);
     args::ValueFlag<int> size(parser, "size", "Initial object count", { "size" });
     args::ValueFlag<real_type> dT(parser, "delta time", "Delta time for simulation", { "dt" });
     args::ValueFlag<real_type> maxMass(parser, "max mass", "Maximum initial mass", { 'm', "mass" });
@@ -118,6 +137,69 @@ int main(int argc, char* argv[]) {
 
     args::ValueFlag<int> ticks(parser, "tick count", "Tick count for simulation", {'t', "ticks"});
 
+    std::unordered_map<std::string, KernelIsa> isaMap{
+        {"auto", KernelIsa_Auto}, {"scalar", KernelIsa_Scalar}, {"avx2", KernelIsa_AVX2}, {"avx512", KernelIsa_AVX512}};
+    args::MapFlag<std::string, KernelIsa> isa(parser, "isa", "Force kernel instruction set: auto, scalar, avx2, avx512", {"isa"}, isaMap);
+    std::unordered_map<std::string, int> solverMap{{"direct", Solver_Direct}, {"direct-sym", Solver_DirectSymmetric}, {"bh", Solver_BarnesHut}, {"fmm", Solver_FMM}, {"pm", Solver_PM}, {"p3m", Solver_P3M}};
+    args::MapFlag<std::string, int> solver(parser, "solver", "Force solver: direct, direct-sym, bh, fmm, pm, p3m", {"solver"}, solverMap);
+    args::ValueFlag<real_type> theta(parser, "theta", "Barnes-Hut opening angle, FMM acceptance", {"theta"});
+    args::ValueFlag<int> fmmOrder(parser, "order", "FMM expansion order", {"fmm-order"});
+    args::ValueFlag<int> meshGrid(parser, "cells", "PM grid cells per axis, rounded up to a power of two", {"pm-grid"});
+    std::unordered_map<std::string, int> assignmentMap{{"cic", Mesh_CIC}, {"tsc", Mesh_TSC}};
+    args::MapFlag<std::string, int> meshAssignment(parser, "scheme", "PM mass assignment: cic, tsc", {"pm-assign"}, assignmentMap);
+    args::ValueFlag<int> forceError(parser, "samples", "Report force error against a direct sum on this many bodies", {"force-error"});
+    args::ValueFlag<int> tileI(parser, "bodies", "Direct solver i-block size, 0 disables tiling", {"tile-i"});
+    args::ValueFlag<int> tileJ(parser, "bodies", "Direct solver j-tile size, rounded up to 16", {"tile-j"});
+    args::Flag tileSweep(parser, "tile sweep", "Print interactions/s of the direct solver for a range of tile sizes and exit", {"tile-sweep"});
+    std::unordered_map<std::string, int> precisionMap{{"double", Precision_Double}, {"float", Precision_Float}, {"mixed", Precision_Mixed}};
+    args::MapFlag<std::string, int> precision(parser, "precision", "Arithmetic: double, float, mixed (double state, float forces)", {"precision"}, precisionMap);
+    args::ValueFlag<int> energyEvery(parser, "K", "Sample energies every K ticks, the others only compute forces", {"energy-every"});
+    args::ValueFlag<int> batch(parser, "ticks", "Run this many ticks in one parallel region per table row", {"batch"});
+    args::ValueFlag<std::string> bind(parser, "policy", "Thread binding, OMP_PROC_BIND: close, spread, master, true, false", {"bind"});
+    args::ValueFlag<std::string> places(parser, "places", "Thread places, OMP_PLACES: cores, threads, sockets, numa_domains or a list", {"places"});
+    args::Flag replicate(parser, "replicate", "Give every NUMA node its own copy of the direct solver's j columns", {"replicate"});
+    args::ValueFlag<int> reorder(parser, "K", "Sort the bodies along a Morton curve every K ticks", {"reorder"});
+    args::Flag rsqrt(parser, "rsqrt", "Use rsqrt estimate with Newton refinement in the force kernel", {"rsqrt"});
+    std::unordered_map<std::string, int> integratorMap{{"legacy", Integrator_Legacy}, {"leapfrog", Integrator_Leapfrog}, {"yoshida4", Integrator_Yoshida4}, {"hermite4", Integrator_Hermite4}};
+    args::MapFlag<std::string, int> integrator(parser, "integrator", "Time integration: legacy, leapfrog, yoshida4, hermite4", {"integrator"}, integratorMap);
+    args::Flag blockSteps(parser, "block steps", "Individual block time steps, implies --integrator hermite4", {"block-steps"});
+    args::ValueFlag<real_type> eta(parser, "eta", "Block step accuracy parameter", {"eta"});
+    args::ValueFlag<int> maxLevel(parser, "level", "Deepest block level, steps go down to dt / 2^level", {"max-level"});
+    args::ValueFlag<std::string> restore(parser, "path", "Start from this checkpoint instead of a fresh system", {"restore"});
+    args::ValueFlag<std::string> checkpoint(parser, "path", "Write a checkpoint here after the ticks, also the GUI's save and load path", {"checkpoint"});
+    args::Flag compress(parser, "compress", "Compress checkpoints (byte shuffle + LZ77)", {"compress"});
+    args::ValueFlag<std::string> trajectory(parser, "path", "Stream frames of the --ticks run to this file", {"trajectory"});
+    args::ValueFlag<int> every(parser, "K", "Ticks between trajectory frames", {"every"});
+    args::Flag trajectoryVelocities(parser, "velocities", "Add velocities to the trajectory frames", {"trajectory-velocities"});
+    args::ValueFlag<int> quantize(parser, "bits", "Store trajectory positions as 16 or 32 bit fixed point over the frame's bounds", {"quantize"});
+    args::ValueFlag<std::string> replay(parser, "path", "Play a recorded trajectory back in the GUI instead of simulating", {"replay"});
+    args::Flag bench(parser, "bench", "Time ticks over a sweep of solvers, precisions, sizes and thread counts and exit", {"bench"});
+    args::ValueFlag<std::string> benchSolvers(parser, "list", "Bench solvers, comma separated", {"bench-solvers"});
+    args::ValueFlag<std::string> benchPrecisions(parser, "list", "Bench precisions, comma separated", {"bench-precisions"});
+    args::ValueFlag<std::string> benchSizes(parser, "list", "Bench body counts, comma separated", {"bench-sizes"});
+    args::ValueFlag<std::string> benchThreads(parser, "list", "Bench thread counts, comma separated, default powers of two up to the maximum", {"bench-threads"});
+    args::ValueFlag<int> benchWarmup(parser, "ticks", "Bench ticks before timing", {"bench-warmup"});
+    args::ValueFlag<int> benchReps(parser, "ticks", "Bench timed ticks per case", {"bench-reps"});
+    args::ValueFlag<std::string> benchLabel(parser, "label", "Bench label stored with the results, e.g. a commit", {"bench-label"});
+    args::ValueFlag<std::string> benchCsv(parser, "path", "Write bench results as CSV, - for stdout", {"bench-csv"});
+    args::ValueFlag<std::string> benchJson(parser, "path", "Write bench results as JSON, - for stdout", {"bench-json"});
+    args::Flag ensemble(parser, "ensemble", "Run a sweep of fresh systems for --ticks each in this process and exit", {"ensemble"});
+    args::ValueFlag<std::string> sweepSeeds(parser, "seeds", "Ensemble seeds, a:b or comma separated", {"sweep-seeds"});
+    args::ValueFlag<std::string> sweepSizes(parser, "sizes", "Ensemble body counts, a:b or comma separated", {"sweep-sizes"});
+    args::ValueFlag<std::string> sweepDt(parser, "dts", "Ensemble time steps, a:b:n or comma separated", {"sweep-dt"});
+    args::ValueFlag<std::string> sweepMass(parser, "masses", "Ensemble maximum masses, a:b:n or comma separated", {"sweep-mass"});
+    args::ValueFlag<std::string> sweepVel(parser, "velocities", "Ensemble maximum velocities, a:b:n or comma separated", {"sweep-vel"});
+    args::ValueFlag<int> ensemblePack(parser, "bodies", "Ensemble runs below this many bodies run one per thread, larger ones on all threads", {"ensemble-pack"});
+    args::ValueFlag<std::string> ensembleCsv(parser, "path", "Write ensemble results as CSV, - for stdout", {"ensemble-csv"});
+    args::ValueFlag<std::string> renderOut(parser, "dir", "Render frames of the --ticks run offscreen into this directory as QOI images", {"render-out"});
+    args::ValueFlag<int> renderEvery(parser, "K", "Ticks between rendered frames", {"render-every"});
+    args::ValueFlag<std::string> renderSize(parser, "WxH", "Rendered frame size, 1280x720 by default", {"render-size"});
+    args::ValueFlag<int> renderThreads(parser, "threads", "Threads splatting rendered frames, a quarter of the maximum by default", {"render-threads"});
+    args::Flag renderVerify(parser, "render-verify", "Decode every rendered frame again and count the ones that differ from the image", {"render-verify"});
+    args::Flag profile(parser, "profile", "Time the phases of every tick and print them after the ticks", {"profile"});
+    args::Flag perf(parser, "perf", "Add hardware counters to the profile: cycles, instructions, LLC misses", {"perf"});
+    args::ValueFlag<std::string> perfFp(parser, "event", "Raw PMU event counted as FP instructions, e.g. 0xffc7 on Intel", {"perf-fp"});
+
     try {
         parser.ParseCLI(argc, argv);
     } catch (args::Help) {
@@ -133,32 +215,328 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    GSimulation simulation;
+    // The OpenMP runtime reads its binding from the environment when it
+    // starts, which can be before main, so the process restarts itself
+    // with the variables set. It carries on unbound if that fails.
+    bool restart = false;
+    if (bind && (!getenv("OMP_PROC_BIND") || args::get(bind) != getenv("OMP_PROC_BIND"))) {
+        setenv("OMP_PROC_BIND", args::get(bind).c_str(), 1);
+        restart = true;
+    }
+    if (places && (!getenv("OMP_PLACES") || args::get(places) != getenv("OMP_PLACES"))) {
+        setenv("OMP_PLACES", args::get(places).c_str(), 1);
+        restart = true;
+    }
+#ifdef __linux__
+    if (restart) {
+        execv("/proc/self/exe", argv);
+        perror("restart with thread binding");
+    }
+#endif
+
+    if ((integrator && args::get(integrator) == Integrator_Hermite4) || blockSteps) {
+        if ((solver && args::get(solver) != Solver_Direct && args::get(solver) != Solver_DirectSymmetric) || benchSolvers)
+            std::cerr << "hermite4 runs direct forces, --solver and --bench-solvers do not apply" << std::endl;
+        if ((precision && args::get(precision) != Precision_Double) || benchPrecisions)
+            std::cerr << "hermite4 runs in double, --precision and --bench-precisions do not apply" << std::endl;
+    }
 
-    if (seed)    simulation.seed    = args::get(seed);
-    if (size)    simulation.count   = args::get(size);
-    if (dT)      simulation.dTime   = args::get(dT);
-    if (maxMass) simulation.maxMass = args::get(maxMass);
-    if (maxVel)  simulation.maxVel  = args::get(maxVel);
+    // the command line applied to a simulation, the bench gets fresh ones
+    auto configure = [&](GSimulation& simulation) {
+        if (seed)    simulation.seed    = args::get(seed);
+        if (rng)     simulation.rng     = args::get(rng);
+        if (size)    simulation.count   = args::get(size);
+        if (dT)      simulation.dTime   = args::get(dT);
+        if (maxMass) simulation.maxMass = args::get(maxMass);
+        if (maxVel)  simulation.maxVel  = args::get(maxVel);
+        if (solver)  simulation.solver  = args::get(solver);
+        if (theta)   simulation.theta   = args::get(theta);
+        if (fmmOrder) simulation.fmmOrder = args::get(fmmOrder);
+        if (meshGrid) simulation.meshGrid = args::get(meshGrid);
+        if (meshAssignment) simulation.meshAssignment = args::get(meshAssignment);
+        if (tileI)   simulation.tileI   = args::get(tileI);
+        if (tileJ)   simulation.tileJ   = args::get(tileJ);
+        if (precision) simulation.precision = args::get(precision);
+        if (energyEvery) simulation.energyEvery = std::max(1, args::get(energyEvery));
+        if (replicate) simulation.replicate = true;
+        if (reorder) simulation.reorderEvery = std::max(0, args::get(reorder));
+        if (isa)     simulation.isa     = args::get(isa);
+        if (rsqrt)   simulation.fastRsqrt = true;
+        if (integrator) simulation.integrator = args::get(integrator);
+        if (blockSteps) {
+            simulation.integrator = Integrator_Hermite4;
+            simulation.blockSteps = true;
+        }
+        if (eta)     simulation.eta     = args::get(eta);
+        if (maxLevel) simulation.maxLevel = std::max(0, std::min(args::get(maxLevel), HERMITE_MAX_LEVEL));
+    };
+
+    if (bench) {
+        BenchConfig config;
+        config.solvers = {solver ? args::get(solver) : Solver_Direct};
+        config.precisions = {precision ? args::get(precision) : Precision_Double};
+        config.sizes = {1000, 4000, 16000};
+        if (size)
+            config.sizes = {args::get(size)};
+        for (int t = omp_get_max_threads(); t >= 1; t /= 2)
+            config.threads.insert(config.threads.begin(), t);
+        config.warmup = benchWarmup ? args::get(benchWarmup) : 3;
+        config.reps = benchReps ? args::get(benchReps) : 10;
+        config.label = benchLabel ? args::get(benchLabel) : "";
+
+        bool parsed = true;
+        if (benchSolvers)    parsed &= bench_parse_names(args::get(benchSolvers), solverNames, Solver_Count, config.solvers);
+        if (benchPrecisions) parsed &= bench_parse_names(args::get(benchPrecisions), precisionNames, Precision_Count, config.precisions);
+        if (benchSizes)      parsed &= bench_parse_ints(args::get(benchSizes), config.sizes);
+        if (benchThreads)    parsed &= bench_parse_ints(args::get(benchThreads), config.threads);
+        if (!parsed) {
+            std::cerr << "bench lists are comma separated solver or precision names, or positive numbers" << std::endl;
+            return 1;
+        }
+        // stdout belongs to the machine readable results when they go there
+        const bool csvOut = benchCsv && args::get(benchCsv) == "-";
+        const bool jsonOut = benchJson && args::get(benchJson) == "-";
+        if (csvOut && jsonOut) {
+            std::cerr << "only one of --bench-csv and --bench-json can write to stdout" << std::endl;
+            return 1;
+        }
+        FILE* log = csvOut || jsonOut ? stderr : stdout;
+
+        numa_report(log);
+        std::vector<BenchResult> results = bench_run(config, configure, log);
+        if (benchCsv && !bench_write_csv(args::get(benchCsv).c_str(), config, results)) {
+            std::cerr << "cannot write " << args::get(benchCsv) << std::endl;
+            return 1;
+        }
+        if (benchJson && !bench_write_json(args::get(benchJson).c_str(), config, results)) {
+            std::cerr << "cannot write " << args::get(benchJson) << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (ensemble) {
+        EnsembleSpec spec;
+        spec.ticks = ticks ? std::max(0, args::get(ticks)) : 10;
+        spec.packBelow = ensemblePack ? args::get(ensemblePack) : 4096;
+
+        bool parsed = true;
+        if (sweepSeeds) parsed &= ensemble_parse_ints(args::get(sweepSeeds), spec.seeds);
+        if (sweepSizes) parsed &= ensemble_parse_ints(args::get(sweepSizes), spec.sizes);
+        if (sweepDt)    parsed &= ensemble_parse_reals(args::get(sweepDt), spec.dts);
+        if (sweepMass)  parsed &= ensemble_parse_reals(args::get(sweepMass), spec.masses);
+        if (sweepVel)   parsed &= ensemble_parse_reals(args::get(sweepVel), spec.vels);
+        for (int n : spec.sizes)
+            parsed &= n > 0;
+        if (!parsed) {
+            std::cerr << "sweeps are a:b (integers), a:b:n (reals) or comma separated lists, sizes positive" << std::endl;
+            return 1;
+        }
+
+        // stdout belongs to the CSV when it goes there
+        FILE* log = ensembleCsv && args::get(ensembleCsv) == "-" ? stderr : stdout;
+
+        GSimulation probe;
+        configure(probe);
+        fprintf(log, "Solver: %s, precision: %s, integrator: %s\n", solverNames[probe.forces_solver()],
+            precisionNames[probe.forces_precision()], integratorNames[probe.integrator]);
+        numa_report(log);
+        double start = omp_get_wtime();
+        std::vector<EnsembleRun> runs = ensemble_run(spec, configure, stderr);
+        ensemble_print(runs, omp_get_wtime() - start, log);
+        if (ensembleCsv && !ensemble_write_csv(args::get(ensembleCsv).c_str(), runs)) {
+            std::cerr << "cannot write " << args::get(ensembleCsv) << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    GSimulation simulation;
+    configure(simulation);
 
     simulation.init();
 
-    if (ticks) {
-        printf("Ticks |   Time    | Potential E      | Kinetic E        | Full energy      | Deviation| Comp Time|\n");
-        for (int i = 0; i < args::get(ticks); i++) {
-            simulation.tickTimed();
-            printf("%5d | %9.4f | %16.8f | %16.8f | %16.8f | %9.4f| %9.6f|\n", 
+    if (restore) {
+        std::string error;
+        double start = omp_get_wtime();
+        if (!simulation.read_state(args::get(restore).c_str(), &error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        printf("Restored %d bodies at tick %d from %s in %.3f s\n", simulation.get_count(), simulation.tickCount,
+            args::get(restore).c_str(), omp_get_wtime() - start);
+    }
+
+    if (tileSweep) {
+        const int sizesI[] = {16, 64, 256, 1024};
+        const int sizesJ[] = {256, 1024, 4096, 16384};
+
+        simulation.solver = Solver_Direct;
+        printf("Tile sweep, %d bodies, kernel: %s%s\n", simulation.get_count(), kernel_isa_name(simulation.isa), simulation.fastRsqrt ? " (rsqrt)" : "");
+        printf("Tile i | Tile j | Interact/s |\n");
+        simulation.tileI = simulation.tileJ = 0;
+        printf("%6s | %6s | %10.4e |\n", "-", "-", simulation.measure_forces());
+        for (int ti : sizesI) {
+            for (int tj : sizesJ) {
+                simulation.tileI = ti;
+                simulation.tileJ = tj;
+                printf("%6d | %6d | %10.4e |\n", ti, tj, simulation.measure_forces());
+            }
+        }
+        return 0;
+    }
+
+    uint64_t fpEvent = perfFp ? strtoull(args::get(perfFp).c_str(), nullptr, 0) : 0;
+    if (profile || perf) {
+        profile_enable(true);
+        if (perf) {
+            std::string error;
+            profile_counters(true, fpEvent, &error);
+            if (!error.empty())
+                std::cerr << error << std::endl;
+        }
+    }
+
+    TrajectoryReader reader;
+    if (replay) {
+        std::string error;
+        if (!reader.open(args::get(replay).c_str(), &error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        if (reader.frames() == 0) {
+            std::cerr << "no frames in " << args::get(replay) << std::endl;
+            return 1;
+        }
+    }
+
+    if (ticks && !replay) {
+        printf("Solver: %s, kernel: %s%s, precision: %s, integrator: %s\n", solverNames[simulation.forces_solver()], kernel_isa_name(simulation.isa),
+            simulation.fastRsqrt ? " (rsqrt)" : "", precisionNames[simulation.forces_precision()], integratorNames[simulation.integrator]);
+        numa_report();
+        if (simulation.energyEvery > 1)
+            printf("Energies sampled every %d ticks, rows show the latest sample\n", simulation.energyEvery);
+        if (simulation.integrator == Integrator_Hermite4 && simulation.blockSteps)
+            printf("Block time steps, eta %g, down to dt / 2^%d\n", simulation.eta, simulation.maxLevel);
+        printf("Ticks |   Time    | Potential E      | Kinetic E        | Full energy      | Deviation| Comp Time| Interact/s |\n");
+
+        TrajectoryWriter writer;
+        int frameEvery = every ? std::max(1, args::get(every)) : 1;
+        if (trajectory) {
+            std::string error;
+            if (!writer.open(args::get(trajectory).c_str(), simulation, frameEvery, trajectoryVelocities,
+                             quantize ? args::get(quantize) : 0, &error)) {
+                std::cerr << error << std::endl;
+                return 1;
+            }
+            if (simulation.tickCount % frameEvery == 0)
+                writer.record(simulation);
+        }
+
+        HeadlessRenderer renderer;
+        int renderFrameEvery = renderEvery ? std::max(1, args::get(renderEvery)) : 1;
+        if (renderOut) {
+            HeadlessView view;
+            if (renderSize && sscanf(args::get(renderSize).c_str(), "%dx%d", &view.width, &view.height) != 2) {
+                std::cerr << "render size is WIDTHxHEIGHT" << std::endl;
+                return 1;
+            }
+            std::string error;
+            int threads = renderThreads ? args::get(renderThreads) : std::max(1, omp_get_max_threads() / 4);
+            renderer.verify = renderVerify;
+            if (!renderer.open(args::get(renderOut).c_str(), view, threads, &error)) {
+                std::cerr << error << std::endl;
+                return 1;
+            }
+            if (simulation.tickCount % renderFrameEvery == 0)
+                renderer.record(simulation);
+        }
+
+        // with a batch a row shows the state after it and the mean tick time
+        int perRow = batch ? std::max(1, args::get(batch)) : 1;
+        for (int i = 0; i < args::get(ticks); i += perRow) {
+            int rowTicks = std::min(perRow, args::get(ticks) - i);
+            // batches stop at frame ticks
+            for (int done = 0; done < rowTicks; ) {
+                int step = rowTicks - done;
+                if (trajectory)
+                    step = std::min(step, frameEvery - simulation.tickCount % frameEvery);
+                if (renderOut)
+                    step = std::min(step, renderFrameEvery - simulation.tickCount % renderFrameEvery);
+                simulation.run(step);
+                done += step;
+                if (trajectory && simulation.tickCount % frameEvery == 0)
+                    writer.record(simulation);
+                if (renderOut && simulation.tickCount % renderFrameEvery == 0)
+                    renderer.record(simulation);
+            }
+            printf("%5d | %9.4f | %16.8f | %16.8f | %16.8f | %9.4f| %9.6f| %10.4e |\n", 
                 simulation.tickCount,
                 simulation.elapsedTime,
                 simulation.pEnergy,
                 simulation.kEnergy,
                 simulation.fEnergy,
                 simulation.energy_deviation(),
-                simulation.computeTime);
+                simulation.computeTime,
+                simulation.interactionRate);
+        }
+
+        if (trajectory) {
+            std::string error;
+            bool written = writer.close(&error);
+            printf("Trajectory: %d frames every %d ticks, %.1f MB to %s, %d dropped, %.3f s packing, %.3f s writing\n",
+                writer.frames, frameEvery, writer.bytes() / 1e6, args::get(trajectory).c_str(), writer.dropped,
+                writer.packTime, writer.writeTime.load());
+            if (!written) {
+                std::cerr << error << std::endl;
+                return 1;
+            }
+        }
+
+        if (renderOut) {
+            std::string error;
+            bool written = renderer.close(&error);
+            printf("Rendered: %d of %d frames every %d ticks, %.1f MB to %s, %d dropped, %.3f s copying, %.3f s splatting, %.3f s encoding\n",
+                renderer.written.load(), renderer.frames, renderFrameEvery, renderer.bytes / 1e6, args::get(renderOut).c_str(),
+                renderer.dropped, renderer.copyTime, renderer.renderTime.load(), renderer.encodeTime.load());
+            if (renderVerify)
+                printf("Verified: %d of %d frames did not decode to their image\n", renderer.mismatched.load(), renderer.written.load());
+            if (!written) {
+                std::cerr << error << std::endl;
+                return 1;
+            }
+        }
+
+        if (profile || perf) {
+            PhaseStats stats[Phase_Count];
+            profile_read(stats);
+            profile_print(stats, nullptr, args::get(ticks));
+        }
+
+        if (simulation.reorderCount > 0)
+            printf("Reordered %d times every %d ticks: %.6f s total, %.6f s last, tick speedup %.3f\n",
+                simulation.reorderCount, simulation.reorderEvery, simulation.reorderTotal, simulation.reorderTime,
+                simulation.reorderGain);
+
+        if (forceError) {
+            double rms, max;
+            simulation.force_error(args::get(forceError), &rms, &max);
+            printf("Force error vs direct sum (%d samples): rms %.4e, max %.4e\n", args::get(forceError), rms, max);
+        }
+
+        if (checkpoint) {
+            std::string error;
+            double start = omp_get_wtime();
+            if (!simulation.save_state(args::get(checkpoint).c_str(), compress, &error)) {
+                std::cerr << error << std::endl;
+                return 1;
+            }
+            printf("Checkpoint at tick %d written to %s in %.3f s\n", simulation.tickCount,
+                args::get(checkpoint).c_str(), omp_get_wtime() - start);
         }
     }
 
-    if (!gui)
+    if (!gui && !replay)
         return 0;
     
     // Setup SDL
@@ -236,6 +614,21 @@ int main(int argc, char* argv[]) {
 
     GLfloat sphereSize = 0.05;
 
+    char checkpointPath[512] = "state.bin";
+    if (checkpoint)
+        snprintf(checkpointPath, sizeof(checkpointPath), "%s", args::get(checkpoint).c_str());
+    bool compressCheckpoint = compress;
+    std::string checkpointStatus;
+
+    bool profiling = profile || perf;
+    bool perfCounters = profile_counters_on();
+    std::string perfStatus;
+    // the profile panel shows the last whole second
+    PhaseStats profileLast[Phase_Count] = {};
+    PhaseStats profileShown[Phase_Count] = {};
+    double profileWindow = 0.;
+    unsigned int profileAt = SDL_GetTicks();
+
     bool volumeShow, originShow, lightShow;
     volumeShow = true;
     originShow = true;
@@ -248,7 +641,7 @@ int main(int argc, char* argv[]) {
     bool runSimulation = false;
     int updtatesCount = 1;
 
-    Particle* particles = simulation.getPtr();
+    ParticleArray* particles = simulation.getPtr();
 
     RingBuffer energyHistory(1000);
     RingBuffer energyKHistory(1000);
@@ -257,6 +650,45 @@ int main(int argc, char* argv[]) {
 
     int lookAtObject = -1;
 
+    // object inspector: the ids of the bodies passing the filter, in the
+    // chosen order, rebuilt when either or the body count changes and on
+    // refresh. The rows read their values live.
+    const char* inspectorOrders[] = {"id", "mass", "full energy", "kinetic energy", "potential energy"};
+    int inspectorOrder = 0;
+    bool inspectorDescending = false;
+    bool filterMass = false, filterEnergy = false;
+    float massRange[2] = {0.f, (float)simulation.get_mass()};
+    float energyRange[2] = {-1e6f, 1e6f};
+    std::vector<int> inspectorRows;
+    int inspectorCount = -1;
+    int inspectedObject = -1;
+
+    // picking in the 3D view uses the last frame's matrices and a grid over
+    // the shown bodies, rebuilt for a click on a new snapshot and at most
+    // every 250 ms for hovering
+    PickGrid pickGrid;
+    unsigned int viewVersion = 0, pickVersion = ~0u;
+    unsigned int pickBuilt = 0;
+    GLdouble pickModel[16], pickProjection[16];
+    GLint pickViewport[4];
+    bool pickMatrices = false;
+
+    double forceErrorRms = 0., forceErrorMax = 0.;
+
+    // stepping runs on its own thread, the frame draws its latest snapshot
+    SimulationThread simThread(simulation);
+    simThread.snapshots.acquire();
+
+    // or the frames of a trajectory, the simulation then stays idle
+    std::unique_ptr<TrajectoryPlayer> player;
+    if (replay)
+        player.reset(new TrajectoryPlayer(reader));
+    double replayPosition = 0.;
+    bool replayPlaying = false;
+    bool replayLoop = true;
+    float replaySpeed = 10.f;
+    int replayShown = -1;
+
     // Main loop
     bool done = false;
 
@@ -265,7 +697,14 @@ int main(int argc, char* argv[]) {
     //glEnable(GL_LIGHTING);
     glEnable(GL_LIGHT0);
     glCullFace(GL_BACK);
-    
+
+    GLUquadric* quad = gluNewQuadric();
+    ParticleRenderer sprites;
+    std::string spritesError;
+    bool useSprites = sprites.init(&spritesError);
+    if (!useSprites)
+        printf("Drawing spheres, %s\n", spritesError.c_str());
+
     while (!done)
     {
         SDL_GetWindowSize(window, &windowWidth, &windowHeight);
@@ -285,6 +724,69 @@ int main(int argc, char* argv[]) {
                 done = true;
         }
 
+        const Snapshot* shown;
+        if (player) {
+            const int frames = reader.frames();
+            if (replayPlaying) {
+                replayPosition += replaySpeed * io.DeltaTime;
+                if (replayLoop)
+                    replayPosition = fmod(fmod(replayPosition, frames) + frames, frames);
+                else if (replayPosition < 0. || replayPosition >= frames)
+                    replayPlaying = false;
+            }
+            replayPosition = std::min(std::max(replayPosition, 0.), frames - 1.);
+            int k = (int)replayPosition;
+            shown = &player->frame(k, replayPlaying ? (replaySpeed >= 0.f ? 1 : -1) : 0);
+
+            // the plots show the frames up to this one, after a jump they are
+            // read again from the frame headers
+            if (k != replayShown) {
+                int first = k;
+                if (k != replayShown + 1) {
+                    energyHistory.clear();
+                    energyKHistory.clear();
+                    energyPHistory.clear();
+                    deviation.clear();
+                    first = std::max(0, k - energyHistory.get_size() + 1);
+                }
+                for (int f = first; f <= k; f++) {
+                    const TrajectoryFrame* frame = reader.frame(f);
+                    energyHistory.write(fabs(frame->fEnergy));
+                    energyKHistory.write(fabs(frame->kEnergy));
+                    energyPHistory.write(fabs(frame->pEnergy));
+                    deviation.write(frame->deviation);
+                }
+                replayShown = k;
+                viewVersion++;
+            }
+        } else {
+            if (simThread.snapshots.acquire())
+                viewVersion++;
+            shown = &simThread.snapshots.front();
+
+            EnergySample sample;
+            while (simThread.energies.pop(sample)) {
+                energyHistory.write(sample.full);
+                energyKHistory.write(sample.kinetic);
+                energyPHistory.write(sample.potential);
+                deviation.write(sample.deviation);
+            }
+        }
+        const Snapshot& view = *shown;
+
+        // The panels that change the simulation need it parked between two
+        // batches. That is asked for once per frame and only waited on
+        // briefly, after a slow batch the panels show a busy line instead.
+        bool owned = false, asked = false, changed = false;
+        auto own = [&]() {
+            if (!asked)
+                owned = simThread.acquire(.004);
+            asked = true;
+            if (!owned)
+                ImGui::TextDisabled("simulation busy, tick %d", view.tickCount);
+            return owned;
+        };
+
         // Start the Dear ImGui frame
         ImGui_ImplOpenGL2_NewFrame();
         ImGui_ImplSDL2_NewFrame();
@@ -302,10 +804,15 @@ int main(int argc, char* argv[]) {
                 ImGui::Checkbox("render one's volume", &volumeShow);
                 ImGui::Checkbox("show origin point", &originShow);
                 ImGui::SliderFloat("sphere sizes", &sphereSize, 0.001, 0.2);
-                ImGui::SliderInt("sphere subdivision", &subDivision, 2, 40);
+                if (sprites.ready())
+                    ImGui::Checkbox("point sprite spheres", &useSprites);
+                else
+                    ImGui::TextDisabled("%s", spritesError.c_str());
+                if (!useSprites)
+                    ImGui::SliderInt("sphere subdivision", &subDivision, 2, 40);
                 ImGui::Separator();
                 ImGui::DragFloat3("camera position", (float*)&cameraPosition, 0.1f, -2., 2.);
-                ImGui::DragInt("camera lookAt", &lookAtObject, 1, -1, simulation.get_count()-1);
+                ImGui::DragInt("camera lookAt", &lookAtObject, 1, -1, view.count-1);
                 ImGui::SliderFloat("yFov", &yFov, 10, 120);
                 ImGui::SliderFloat("spin divider", &spinDivider, 1., 10.);
                 if (ImGui::Button("start spin")) {
@@ -323,9 +830,34 @@ int main(int argc, char* argv[]) {
                 ImGui::Checkbox("show light point", &lightShow);
             }
 
-            if (ImGui::CollapsingHeader("Generator settings")) {
+            if (player && ImGui::CollapsingHeader("Replay", ImGuiTreeNodeFlags_DefaultOpen)) {
+                const TrajectoryHeader& h = reader.header();
+                ImGui::Text("%s, %d bodies, %d frames every %d ticks", args::get(replay).c_str(), (int)h.count, reader.frames(), h.every);
+                if (h.positionBits)
+                    ImGui::Text("Positions : %d bit fixed point", h.positionBits);
+                int k = (int)replayPosition;
+                if (ImGui::SliderInt("frame", &k, 0, reader.frames() - 1))
+                    replayPosition = k;
+                // dropped frames make ticks uneven, the frame knows its own
+                ImGui::Text("Tick : %d", view.tickCount);
+                if (ImGui::Button(replayPlaying ? "pause" : "play"))
+                    replayPlaying = !replayPlaying;
+                ImGui::SameLine();
+                if (ImGui::Button("<") && k > 0)
+                    replayPosition = k - 1;
+                ImGui::SameLine();
+                if (ImGui::Button(">") && k + 1 < reader.frames())
+                    replayPosition = k + 1;
+                ImGui::SameLine();
+                ImGui::Checkbox("loop", &replayLoop);
+                ImGui::SliderFloat("frames per second", &replaySpeed, -120.f, 120.f);
+                ImGui::Text("Prefetched %d, decoded on demand %d", player->hits, player->misses);
+            }
+
+            if (!player && ImGui::CollapsingHeader("Generator settings") && own()) {
                 ImGui::DragInt("seed", &simulation.seed);
-                ImGui::DragInt("object count", &simulation.count, 1, 1, 100000);
+                ImGui::Combo("generator", &simulation.rng, rngNames, Rng_Count);
+                ImGui::DragInt("object count", &simulation.count, 1, 1, 2000000);
                 real_type minValue = 0.1;
                 ImGui::DragScalar("max mass", ImGuiDataType_Real, &simulation.maxMass, 0.1f, &minValue);
                 real_type minValueAcc = 0.;
@@ -335,34 +867,89 @@ int main(int argc, char* argv[]) {
                     simulation.remove();
                     simulation.init();
                     particles = simulation.getPtr();
+                    changed = true;
                 }
             }
 
-            if (ImGui::CollapsingHeader("Simulation settings")) {
-                real_type mMin = 0.01;
-                real_type mMax = 1.;
-                ImGui::SliderScalar("delta time", ImGuiDataType_Real, &simulation.dTime, &mMin, &mMax);
-                ImGui::SliderInt("updates per frame", &updtatesCount, 1, 100);
-                ImGui::Checkbox("run simulation", &runSimulation);
+            if (!player && ImGui::CollapsingHeader("Simulation settings")) {
+                if (ImGui::Checkbox("run simulation", &runSimulation))
+                    simThread.running = runSimulation;
                 ImGui::SameLine();
-                if (ImGui::Button("next tick")) {
-                    simulation.tickTimed();
-                    energyHistory.write(fabs(simulation.fEnergy));
-                    energyKHistory.write(fabs(simulation.kEnergy));
-                    energyPHistory.write(fabs(simulation.pEnergy));
-					deviation.write(simulation.energy_deviation());
+                if (ImGui::Button("next tick"))
+                    simThread.step();
+                if (ImGui::SliderInt("ticks per batch", &updtatesCount, 1, 100))
+                    simThread.batch = updtatesCount;
+                ImGui::Text("Compute time : %f", view.computeTime);
+                ImGui::Text("Interactions/s : %.4e", view.interactionRate);
+
+                if (own()) {
+                    real_type mMin = 0.01;
+                    real_type mMax = 1.;
+                    ImGui::SliderScalar("delta time", ImGuiDataType_Real, &simulation.dTime, &mMin, &mMax);
+                    ImGui::SliderInt("energy every", &simulation.energyEvery, 1, 100);
+                    ImGui::SliderInt("reorder every", &simulation.reorderEvery, 0, 100);
+                    if (simulation.reorderCount > 0)
+                        ImGui::Text("Reorder : %f s, tick speedup %.3f", simulation.reorderTime, simulation.reorderGain);
+                    if (ImGui::Combo("solver", &simulation.solver, solverNames, Solver_Count)) {
+                        simulation.rewrite_initialEnergy();
+                        changed = true;
+                    }
+                    if (simulation.solver == Solver_BarnesHut || simulation.solver == Solver_FMM) {
+                        real_type tMin = 0.05;
+                        real_type tMax = 1.;
+                        ImGui::SliderScalar("opening angle", ImGuiDataType_Real, &simulation.theta, &tMin, &tMax);
+                    }
+                    if (simulation.solver == Solver_Direct) {
+                        ImGui::SliderInt("tile i", &simulation.tileI, 0, 4096);
+                        ImGui::SliderInt("tile j", &simulation.tileJ, 0, 65536);
+                        if (numa_topology().nodes > 1)
+                            ImGui::Checkbox("copy j per NUMA node", &simulation.replicate);
+                    }
+                    if (simulation.solver == Solver_FMM)
+                        ImGui::SliderInt("expansion order", &simulation.fmmOrder, 0, 12);
+                    if (simulation.solver == Solver_PM || simulation.solver == Solver_P3M) {
+                        const char* grids[] = {"32", "64", "128"};
+                        int gridItem = simulation.meshGrid <= 32 ? 0 : simulation.meshGrid <= 64 ? 1 : 2;
+                        if (ImGui::Combo("mesh grid", &gridItem, grids, 3))
+                            simulation.meshGrid = 32 << gridItem;
+                        ImGui::Combo("mass assignment", &simulation.meshAssignment, meshAssignmentNames, Mesh_Count);
+                    }
+                    if (ImGui::Button("measure force error"))
+                        simulation.force_error(1000, &forceErrorRms, &forceErrorMax);
+                    ImGui::SameLine();
+                    ImGui::Text("rms %.3e max %.3e", forceErrorRms, forceErrorMax);
+                    ImGui::Text("Kernel : %s", kernel_isa_name(simulation.isa));
+                    ImGui::SameLine();
+                    ImGui::Checkbox("rsqrt", &simulation.fastRsqrt);
+                    ImGui::Combo("precision", &simulation.precision, precisionNames, Precision_Count);
+                    ImGui::Combo("integrator", &simulation.integrator, integratorNames, Integrator_Count);
+                    if (simulation.integrator == Integrator_Hermite4) {
+                        ImGui::Text("Forces : %s, %s", solverNames[simulation.forces_solver()], precisionNames[simulation.forces_precision()]);
+                        ImGui::Checkbox("block time steps", &simulation.blockSteps);
+                    }
+                    if (simulation.integrator == Integrator_Hermite4 && simulation.blockSteps) {
+                        real_type eMin = 0.001;
+                        real_type eMax = 0.1;
+                        ImGui::SliderScalar("eta", ImGuiDataType_Real, &simulation.eta, &eMin, &eMax);
+                        ImGui::SliderInt("max level", &simulation.maxLevel, 0, 20);
+                        const std::vector<int>& levels = simulation.block_stepper()->levels();
+                        ImGui::Text("Sub-steps : %d", simulation.block_stepper()->substeps());
+                        for (int l = 0; l < (int)levels.size(); l++)
+                            if (levels[l] > 0)
+                                ImGui::Text("  level %2d : %d", l, levels[l]);
+                    }
                 }
-                ImGui::Text("Compute time : %f", simulation.computeTime);
             }
 
             if (ImGui::CollapsingHeader("Simulation view")) {
-                ImGui::Text("Elapsed ticks: %d", simulation.tickCount);
-                ImGui::Text("Elapsed time : %f", simulation.elapsedTime);
+                ImGui::Text("Elapsed ticks: %d", view.tickCount);
+                ImGui::Text("Elapsed time : %f", view.elapsedTime);
                 ImGui::Separator();
-                ImGui::Text("     Full energy %f", simulation.fEnergy);
-                ImGui::Text("  Kinetic energy %f", simulation.kEnergy);
-                ImGui::Text("Potential energy %f", simulation.pEnergy);
-                ImGui::Text("    Deviation, %% %f", simulation.energy_deviation());
+                ImGui::Text("     Sampled at tick %d", view.energyTick);
+                ImGui::Text("     Full energy %f", view.fEnergy);
+                ImGui::Text("  Kinetic energy %f", view.kEnergy);
+                ImGui::Text("Potential energy %f", view.pEnergy);
+                ImGui::Text("    Deviation, %% %f", view.deviation);
                 ImGui::PlotLines("Full energy", energyHistory.get_ptr(), energyHistory.get_size(), 0, NULL, FLT_MIN, FLT_MAX, ImVec2(300, 60));
                 ImGui::PlotLines("Kinetic energy", energyKHistory.get_ptr(), energyKHistory.get_size(), 0, NULL, FLT_MIN, FLT_MAX, ImVec2(300, 60));
                 ImGui::PlotLines("Potential energy", energyPHistory.get_ptr(), energyPHistory.get_size(), 0, NULL, FLT_MIN, FLT_MAX, ImVec2(300, 60));
@@ -374,65 +961,274 @@ int main(int argc, char* argv[]) {
                     deviation.clear();
 				}
                 ImGui::SameLine();
-                if (ImGui::Button("reset initial energy"))
+                if (!player && ImGui::Button("reset initial energy") && own()) {
                     simulation.rewrite_initialEnergy();
+                    changed = true;
+                }
+            }
+
+            if (ImGui::CollapsingHeader("Profile")) {
+                if (ImGui::Checkbox("time phases", &profiling))
+                    profile_enable(profiling);
+                ImGui::SameLine();
+                if (ImGui::Checkbox("hardware counters", &perfCounters)) {
+                    perfStatus.clear();
+                    perfCounters = profile_counters(perfCounters, fpEvent, &perfStatus);
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("reset")) {
+                    profile_reset();
+                    std::fill(profileLast, profileLast + Phase_Count, PhaseStats());
+                    std::fill(profileShown, profileShown + Phase_Count, PhaseStats());
+                }
+                if (!perfStatus.empty())
+                    ImGui::TextDisabled("%s", perfStatus.c_str());
+
+                unsigned int now = SDL_GetTicks();
+                if (now - profileAt >= 1000) {
+                    PhaseStats stats[Phase_Count];
+                    profile_read(stats);
+                    for (int p = 0; p < Phase_Count; p++) {
+                        profileShown[p].calls = stats[p].calls - profileLast[p].calls;
+                        profileShown[p].nanoseconds = stats[p].nanoseconds - profileLast[p].nanoseconds;
+                        for (int c = 0; c < Counter_Count; c++)
+                            profileShown[p].counters[c] = stats[p].counters[c] - profileLast[p].counters[c];
+                        profileLast[p] = stats[p];
+                    }
+                    profileWindow = (now - profileAt) / 1000.;
+                    profileAt = now;
+                }
+
+                // the simulation and this thread each fill up to a whole second
+                if (profileWindow > 0. && ImGui::BeginTable("phases", perfCounters ? 5 : 3)) {
+                    ImGui::TableSetupColumn("phase");
+                    ImGui::TableSetupColumn("calls/s");
+                    ImGui::TableSetupColumn("time");
+                    if (perfCounters) {
+                        ImGui::TableSetupColumn("IPC");
+                        ImGui::TableSetupColumn("LLC miss/kinstr");
+                    }
+                    ImGui::TableHeadersRow();
+                    for (int p = 0; p < Phase_Count; p++) {
+                        const PhaseStats& d = profileShown[p];
+                        double seconds = d.nanoseconds * 1e-9;
+                        ImGui::TableNextRow();
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%s", phaseNames[p]);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.1f", d.calls / profileWindow);
+                        ImGui::TableNextColumn();
+                        char label[32];
+                        snprintf(label, sizeof(label), "%.1f ms/s", 1e3 * seconds / profileWindow);
+                        ImGui::ProgressBar((float)(seconds / profileWindow), ImVec2(-1, 0), label);
+                        if (perfCounters) {
+                            const uint64_t* c = d.counters;
+                            ImGui::TableNextColumn();
+                            ImGui::Text("%.2f", c[Counter_Cycles] ? (double)c[Counter_Instructions] / c[Counter_Cycles] : 0.);
+                            ImGui::TableNextColumn();
+                            ImGui::Text("%.3f", c[Counter_Instructions] ? 1e3 * c[Counter_LLCMisses] / c[Counter_Instructions] : 0.);
+                        }
+                    }
+                    ImGui::EndTable();
+                }
             }
 
-            if (ImGui::CollapsingHeader("Object settings")) {
-                if (ImGui::Button("save state"))
-                    simulation.save_state();
+            if (!player && ImGui::CollapsingHeader("Object settings") && own()) {
+                ImGui::InputText("checkpoint", checkpointPath, sizeof(checkpointPath));
+                ImGui::SameLine();
+                ImGui::Checkbox("compress", &compressCheckpoint);
+
+                if (ImGui::Button("save state")) {
+                    std::string error;
+                    checkpointStatus = simulation.save_state(checkpointPath, compressCheckpoint, &error) ? "saved" : error;
+                }
 
                 ImGui::SameLine();
 
                 if (ImGui::Button("load state")) {
-                    simulation.read_state();
+                    std::string error;
+                    checkpointStatus = simulation.read_state(checkpointPath, &error) ? "loaded" : error;
                     particles = simulation.getPtr();
+                    inspectorCount = -1;
+                    changed = true;
                 }
 
                 ImGui::SameLine();
 
-                if (ImGui::Button("recalculate colors"))
+                if (ImGui::Button("recalculate colors")) {
                     simulation.init_color();
+                    changed = true;
+                }
+                if (!checkpointStatus.empty())
+                    ImGui::TextUnformatted(checkpointStatus.c_str());
+
+                ImGui::Separator();
+                const int n = simulation.get_count();
+                bool reorder = false;
+                reorder |= ImGui::Combo("order by", &inspectorOrder, inspectorOrders, IM_ARRAYSIZE(inspectorOrders));
+                ImGui::SameLine();
+                reorder |= ImGui::Checkbox("descending", &inspectorDescending);
+                reorder |= ImGui::Checkbox("##mass", &filterMass);
+                ImGui::SameLine();
+                reorder |= ImGui::DragFloatRange2("mass", &massRange[0], &massRange[1], simulation.get_mass() * .01f, 0.f, FLT_MAX);
+                reorder |= ImGui::Checkbox("##energy", &filterEnergy);
+                ImGui::SameLine();
+                reorder |= ImGui::DragFloatRange2("full energy", &energyRange[0], &energyRange[1], 100.f, -FLT_MAX, FLT_MAX);
+                if (ImGui::Button("refresh"))
+                    reorder = true;
+
+                if (reorder || inspectorCount != n) {
+                    auto key = [&](int i) {
+                        int s = particles->slot[i];
+                        switch (inspectorOrder) {
+                            case 1: return (double)particles->mass[s];
+                            case 2: return (double)particles->pEnergy[s] + particles->kEnergy[s];
+                            case 3: return (double)particles->kEnergy[s];
+                            case 4: return (double)particles->pEnergy[s];
+                        }
+                        return (double)i;
+                    };
+                    inspectorRows.clear();
+                    for (int i = 0; i < n; i++) {
+                        int s = particles->slot[i];
+                        double energy = particles->pEnergy[s] + particles->kEnergy[s];
+                        if (filterMass && (particles->mass[s] < massRange[0] || particles->mass[s] > massRange[1]))
+                            continue;
+                        if (filterEnergy && (energy < energyRange[0] || energy > energyRange[1]))
+                            continue;
+                        inspectorRows.push_back(i);
+                    }
+                    std::vector<std::pair<double, int>> keyed(inspectorRows.size());
+                    for (size_t r = 0; r < inspectorRows.size(); r++)
+                        keyed[r] = std::make_pair(inspectorDescending ? -key(inspectorRows[r]) : key(inspectorRows[r]), inspectorRows[r]);
+                    std::sort(keyed.begin(), keyed.end());
+                    for (size_t r = 0; r < keyed.size(); r++)
+                        inspectorRows[r] = keyed[r].second;
+                    inspectorCount = n;
+                }
+                ImGui::SameLine();
+                ImGui::Text("%d of %d bodies", (int)inspectorRows.size(), n);
+
+                // only the rows in sight are laid out
+                if (ImGui::BeginTable("objects", 4, ImGuiTableFlags_ScrollY | ImGuiTableFlags_RowBg | ImGuiTableFlags_Borders,
+                                      ImVec2(0.f, ImGui::GetTextLineHeightWithSpacing() * 12))) {
+                    ImGui::TableSetupScrollFreeze(0, 1);
+                    ImGui::TableSetupColumn("object");
+                    ImGui::TableSetupColumn("mass");
+                    ImGui::TableSetupColumn("kinetic energy");
+                    ImGui::TableSetupColumn("potential energy");
+                    ImGui::TableHeadersRow();
+                    ImGuiListClipper clipper;
+                    clipper.Begin((int)inspectorRows.size());
+                    while (clipper.Step()) {
+                        for (int r = clipper.DisplayStart; r < clipper.DisplayEnd; r++) {
+                            int i = inspectorRows[r];
+                            int s = particles->slot[i];
+                            char label[32];
+                            snprintf(label, sizeof(label), "#%d", i);
+                            ImGui::TableNextRow();
+                            ImGui::TableNextColumn();
+                            if (ImGui::Selectable(label, inspectedObject == i, ImGuiSelectableFlags_SpanAllColumns))
+                                inspectedObject = i;
+                            if (ImGui::IsItemHovered() && ImGui::IsMouseDoubleClicked(ImGuiMouseButton_Left))
+                                lookAtObject = i;
+                            ImGui::TableNextColumn();
+                            ImGui::Text("%g", (double)particles->mass[s]);
+                            ImGui::TableNextColumn();
+                            ImGui::Text("%f", (double)particles->kEnergy[s]);
+                            ImGui::TableNextColumn();
+                            ImGui::Text("%f", (double)particles->pEnergy[s]);
+                        }
+                    }
+                    clipper.End();
+                    ImGui::EndTable();
+                }
 
-                for (int i = 0; i < simulation.get_count(); i++) {
-                    if (ImGui::TreeNode((void *)(intptr_t)i, "Object #%d", i)) {
-                        ImGui::DragScalarN("Position", ImGuiDataType_Real, particles[i].pos, 3, .05);
-                        ImGui::DragScalarN("Velocity", ImGuiDataType_Real, particles[i].vel, 3, .05);
-                        ImGui::DragScalarN("Acceleration", ImGuiDataType_Real, particles[i].acc, 3, .05);
-                        real_type mMin = 0.;
-                        real_type mMax = simulation.get_mass()*10.;
-                        ImGui::DragScalar("Mass", ImGuiDataType_Real, &particles[i].mass);
-                        ImGui::ColorEdit3("Color", particles[i].color);
-                        ImGui::Text("     Full energy %f", particles[i].pEnergy+particles[i].kEnergy);
-                        ImGui::Text("  Kinetic energy %f", particles[i].kEnergy);
-                        ImGui::Text("Potential energy %f", particles[i].pEnergy);
-                        ImGui::TreePop();
+                if (inspectedObject >= 0 && inspectedObject < n) {
+                    const int i = inspectedObject;
+                    ImGui::Text("Object #%d", i);
+                    ImGui::SameLine();
+                    if (ImGui::SmallButton("look at"))
+                        lookAtObject = i;
+                    // i is the body, s the slot it sits in after the last reorder
+                    int s = particles->slot[i];
+                    // columns are strided, edit a gathered copy and scatter it back
+                    real_type pos[3] = {particles->pos[0][s], particles->pos[1][s], particles->pos[2][s]};
+                    real_type vel[3] = {particles->vel[0][s], particles->vel[1][s], particles->vel[2][s]};
+                    real_type acc[3] = {particles->acc[0][s], particles->acc[1][s], particles->acc[2][s]};
+                    bool edited = false;
+                    if (ImGui::DragScalarN("Position", ImGuiDataType_Real, pos, 3, .05)) {
+                        for (int k = 0; k < 3; k++) particles->pos[k][s] = pos[k];
+                        edited = true;
                     }
+                    if (ImGui::DragScalarN("Velocity", ImGuiDataType_Real, vel, 3, .05)) {
+                        for (int k = 0; k < 3; k++) particles->vel[k][s] = vel[k];
+                        edited = true;
+                    }
+                    if (ImGui::DragScalarN("Acceleration", ImGuiDataType_Real, acc, 3, .05))
+                        for (int k = 0; k < 3; k++) particles->acc[k][s] = acc[k];
+                    real_type mMin = 0.;
+                    real_type mMax = simulation.get_mass()*10.;
+                    if (ImGui::DragScalar("Mass", ImGuiDataType_Real, &particles->mass[s]))
+                        edited = true;
+                    if (edited) {
+                        simulation.restart_integrator();
+                        changed = true;
+                    }
+                    if (ImGui::ColorEdit3("Color", &particles->color[s*3]))
+                        changed = true;
+                    ImGui::Text("     Full energy %f", particles->pEnergy[s]+particles->kEnergy[s]);
+                    ImGui::Text("  Kinetic energy %f", particles->kEnergy[s]);
+                    ImGui::Text("Potential energy %f", particles->pEnergy[s]);
                 }
             }
             ImGui::End();
         }
 
-        //Simulate
-        if (runSimulation)
-            for (int i = 0; i < updtatesCount; i++) {
-                simulation.tickTimed();
-                energyHistory.write(abs(simulation.fEnergy));
-				energyKHistory.write(fabs(simulation.kEnergy));
-				energyPHistory.write(fabs(simulation.pEnergy));
-				deviation.write(simulation.energy_deviation());
+        // a body under the mouse in the 3D view, a click looks at it
+        if (pickMatrices && !io.WantCaptureMouse && view.count > 0) {
+            const bool click = ImGui::IsMouseClicked(ImGuiMouseButton_Left);
+            const unsigned int now = SDL_GetTicks();
+            if ((pickVersion != viewVersion || pickGrid.radius() != sphereSize) && (click || now - pickBuilt >= 250)) {
+                pickGrid.build(view, sphereSize);
+                pickVersion = viewVersion;
+                pickBuilt = now;
+            }
+            GLdouble nearPoint[3], farPoint[3];
+            const GLdouble x = io.MousePos.x, y = pickViewport[3] - io.MousePos.y;
+            if (gluUnProject(x, y, 0., pickModel, pickProjection, pickViewport, &nearPoint[0], &nearPoint[1], &nearPoint[2]) == GL_TRUE &&
+                gluUnProject(x, y, 1., pickModel, pickProjection, pickViewport, &farPoint[0], &farPoint[1], &farPoint[2]) == GL_TRUE) {
+                const double direction[3] = {farPoint[0] - nearPoint[0], farPoint[1] - nearPoint[1], farPoint[2] - nearPoint[2]};
+                int hit = pickGrid.pick(nearPoint, direction);
+                if (hit >= 0) {
+                    ImGui::SetTooltip("Object #%d", hit);
+                    if (click) {
+                        lookAtObject = hit;
+                        inspectedObject = hit;
+                    }
+                }
             }
+        }
+
+        // hand the simulation back, with a snapshot of what the panels changed.
+        // A request that timed out stays up for the next frame, unless that
+        // one does not need the simulation any more
+        if (owned) {
+            if (changed)
+                simThread.publish();
+            simThread.release();
+        } else if (!asked) {
+            simThread.release();
+        }
 
         // Rendering
+        PROFILE_PHASE(Phase_Render);
         ImGui::Render();
         glViewport(0, 0, (int)io.DisplaySize.x, (int)io.DisplaySize.y);
         glClearColor(clear_color.x * clear_color.w, clear_color.y * clear_color.w, clear_color.z * clear_color.w, clear_color.w);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         //glUseProgram(0); // You may want this if using this code in an OpenGL 3+ context where shaders may be bound
 
-        GLUquadric *quad;
-        quad = gluNewQuadric();
-
         glMatrixMode(GL_PROJECTION);
         glLoadIdentity();
         gluPerspective(yFov, (float)windowWidth/(float)windowHeight, 1./16., 256.);
@@ -442,15 +1238,14 @@ int main(int argc, char* argv[]) {
         double time = (SDL_GetTicks()-spinStart)/1000.;
 
         GLdouble lookX, lookY, lookZ;
-        if (lookAtObject == -1 || lookAtObject >= simulation.get_count()) {
+        if (lookAtObject == -1 || lookAtObject >= view.count) {
             lookX = .5;
             lookY = .5;
             lookZ = .5;
         } else {
-            Particle p = particles[lookAtObject];
-            lookX = p.pos[0];
-            lookY = p.pos[1];
-            lookZ = p.pos[2];
+            lookX = view.pos[lookAtObject * 3 + 0];
+            lookY = view.pos[lookAtObject * 3 + 1];
+            lookZ = view.pos[lookAtObject * 3 + 2];
         }
 
         if (spinCamera)
@@ -462,6 +1257,11 @@ int main(int argc, char* argv[]) {
                     , lookX, lookY, lookZ 
                     , 0., 1., 0.);
 
+        glGetDoublev(GL_MODELVIEW_MATRIX, pickModel);
+        glGetDoublev(GL_PROJECTION_MATRIX, pickProjection);
+        glGetIntegerv(GL_VIEWPORT, pickViewport);
+        pickMatrices = true;
+
         glColor3f(1,1,1);
         glDisable(GL_LIGHTING);
         if (originShow)
@@ -485,13 +1285,16 @@ int main(int argc, char* argv[]) {
         glMaterialfv(GL_FRONT, GL_SPECULAR, specular);
         glMaterialfv(GL_FRONT, GL_SHININESS, shiness);
 
-        for (int i = 0; i < simulation.get_count(); i++) {
-            glPushMatrix();
-            Particle obj = particles[i];
-            glTranslatef(obj.pos[0], obj.pos[1], obj.pos[2]);
-            glMaterialfv(GL_FRONT, GL_DIFFUSE, obj.color);
-            gluSphere(quad,sphereSize,subDivision,subDivision);
-            glPopMatrix();
+        if (useSprites) {
+            sprites.draw(view, sphereSize, (int)io.DisplaySize.y, yFov);
+        } else {
+            for (int i = 0; i < view.count; i++) {
+                glPushMatrix();
+                glTranslatef(view.pos[i*3 + 0], view.pos[i*3 + 1], view.pos[i*3 + 2]);
+                glMaterialfv(GL_FRONT, GL_DIFFUSE, &view.color[i*3]);
+                gluSphere(quad,sphereSize,subDivision,subDivision);
+                glPopMatrix();
+            }
         }
 
 
@@ -500,6 +1303,8 @@ int main(int argc, char* argv[]) {
     }
 
     // Cleanup
+    sprites.release();
+    gluDeleteQuadric(quad);
     ImGui_ImplOpenGL2_Shutdown();
     ImGui_ImplSDL2_Shutdown();
     ImGui::DestroyContext();
@@ -0,0 +1,143 @@
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+
+#include "morton.hpp"
+
+// spreads the low 21 bits of v so there are two zero bits between each
+static uint64_t morton_spread(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8)  & 0x100f00f00f00f00fULL;
+    v = (v | v << 4)  & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2)  & 0x1249249249249249ULL;
+    return v;
+}
+
+static uint32_t morton_compact(uint64_t v) {
+    v &= 0x1249249249249249ULL;
+    v = (v ^ (v >> 2))  & 0x10c30c30c30c30c3ULL;
+    v = (v ^ (v >> 4))  & 0x100f00f00f00f00fULL;
+    v = (v ^ (v >> 8))  & 0x1f0000ff0000ffULL;
+    v = (v ^ (v >> 16)) & 0x1f00000000ffffULL;
+    v = (v ^ (v >> 32)) & 0x1fffff;
+    return (uint32_t)v;
+}
+
+uint64_t morton_encode(uint32_t x, uint32_t y, uint32_t z) {
+    return morton_spread(x) | morton_spread(y) << 1 | morton_spread(z) << 2;
+}
+
+uint32_t morton_decode_axis(uint64_t key, int axis) {
+    return morton_compact(key >> axis);
+}
+
+void morton_bounds(const real_type* x, const real_type* y, const real_type* z, int n,
+                   real_type origin[3], real_type* size) {
+    real_type minX = INFINITY, minY = INFINITY, minZ = INFINITY;
+    real_type maxX = -INFINITY, maxY = -INFINITY, maxZ = -INFINITY;
+
+    #pragma omp parallel for reduction(min : minX, minY, minZ) reduction(max : maxX, maxY, maxZ)
+    for (int i = 0; i < n; i++) {
+        minX = std::min(minX, x[i]); maxX = std::max(maxX, x[i]);
+        minY = std::min(minY, y[i]); maxY = std::max(maxY, y[i]);
+        minZ = std::min(minZ, z[i]); maxZ = std::max(maxZ, z[i]);
+    }
+
+    if (n == 0) {
+        minX = minY = minZ = 0.;
+        maxX = maxY = maxZ = 1.;
+    }
+
+    real_type extent = std::max(maxX - minX, std::max(maxY - minY, maxZ - minZ));
+    // keep the points strictly inside so the top cell never overflows 21 bits
+    extent = extent > 0. ? extent * (1. + 1e-6) : 1.;
+
+    origin[0] = minX;
+    origin[1] = minY;
+    origin[2] = minZ;
+    *size = extent;
+}
+
+void morton_keys(const real_type* x, const real_type* y, const real_type* z, int n,
+                 const real_type origin[3], real_type size, uint64_t* keys) {
+    const real_type scale = (real_type)(1u << MORTON_BITS) / size;
+    const uint32_t top = (1u << MORTON_BITS) - 1;
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        uint32_t ix = std::min(top, (uint32_t)std::max((real_type)0., (x[i] - origin[0]) * scale));
+        uint32_t iy = std::min(top, (uint32_t)std::max((real_type)0., (y[i] - origin[1]) * scale));
+        uint32_t iz = std::min(top, (uint32_t)std::max((real_type)0., (z[i] - origin[2]) * scale));
+        keys[i] = morton_encode(ix, iy, iz);
+    }
+}
+
+void radix_sort(uint64_t* keys, int32_t* values, int n, uint64_t* tmpKeys, int32_t* tmpValues) {
+    const int radix = 256;
+    const int passes = (3 * MORTON_BITS + 7) / 8;
+
+    int threads = omp_get_max_threads();
+    std::vector<int> histogram((size_t)threads * radix);
+
+    uint64_t *srcK = keys, *dstK = tmpKeys;
+    int32_t *srcV = values, *dstV = tmpValues;
+
+    for (int pass = 0; pass < passes; pass++) {
+        int shift = pass * 8;
+        bool skip = false;
+
+        #pragma omp parallel num_threads(threads)
+        {
+            int t = omp_get_thread_num();
+            int nt = omp_get_num_threads();
+            int begin = (int)((int64_t)n * t / nt);
+            int end = (int)((int64_t)n * (t + 1) / nt);
+            int *h = &histogram[(size_t)t * radix];
+
+            std::fill_n(h, radix, 0);
+            for (int i = begin; i < end; i++)
+                h[(srcK[i] >> shift) & 0xff]++;
+
+            #pragma omp barrier
+            #pragma omp single
+            {
+                // exclusive offsets, digit major and thread minor keep the sort stable
+                int sum = 0;
+                for (int d = 0; d < radix; d++) {
+                    int digitTotal = 0;
+                    for (int tt = 0; tt < nt; tt++) {
+                        int c = histogram[(size_t)tt * radix + d];
+                        histogram[(size_t)tt * radix + d] = sum;
+                        sum += c;
+                        digitTotal += c;
+                    }
+                    // every key has the same digit, the pass would be a plain copy
+                    if (digitTotal == n)
+                        skip = true;
+                }
+            }
+
+            if (!skip)
+                for (int i = begin; i < end; i++) {
+                    int d = (srcK[i] >> shift) & 0xff;
+                    int dst = h[d]++;
+                    dstK[dst] = srcK[i];
+                    dstV[dst] = srcV[i];
+                }
+        }
+
+        if (!skip) {
+            std::swap(srcK, dstK);
+            std::swap(srcV, dstV);
+        }
+    }
+
+    if (srcK != keys) {
+        std::memcpy(keys, srcK, sizeof(uint64_t) * n);
+        std::memcpy(values, srcV, sizeof(int32_t) * n);
+    }
+}
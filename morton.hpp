@@ -0,0 +1,26 @@
+#ifndef MORTON_HPP_
+#define MORTON_HPP_
+
+#include <cstdint>
+
+#include "nbody.hpp"
+
+// 21 bits per axis interleaved into a 63 bit key, x in the lowest bit
+#define MORTON_BITS 21
+
+uint64_t morton_encode(uint32_t x, uint32_t y, uint32_t z);
+uint32_t morton_decode_axis(uint64_t key, int axis);
+
+// Bounding cube of n points: origin is the lower corner, size the edge.
+void morton_bounds(const real_type* x, const real_type* y, const real_type* z, int n,
+                   real_type origin[3], real_type* size);
+
+// Keys of n points quantized inside the cube given by origin/size.
+void morton_keys(const real_type* x, const real_type* y, const real_type* z, int n,
+                 const real_type origin[3], real_type size, uint64_t* keys);
+
+// Parallel LSD radix sort of keys carrying values along, 8 bits per pass.
+// tmpKeys/tmpValues are scratch of n entries. Stable, result ends up in keys/values.
+void radix_sort(uint64_t* keys, int32_t* values, int n, uint64_t* tmpKeys, int32_t* tmpValues);
+
+#endif
@@ -1,8 +1,31 @@
 #include <random>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include <cerrno>
+#include <climits>
 #include "nbody.hpp"
+#include "octree.hpp"
+#include "fmm.hpp"
+#include "pm.hpp"
+#include "hermite.hpp"
+#include "integrator.hpp"
+#include "morton.hpp"
+#include "numa.hpp"
+#include "checkpoint.hpp"
+#include "profile.hpp"
+#include "philox.hpp"
 
 //#define advisorAnnotations
 
+// bodies per tile of the symmetric direct kernel
+#define SYMMETRIC_TILE 512
+
+// doubles between the per-thread partial sums of run(), one cache line
+#define PARTIAL_STRIDE 8
+
 #ifdef advisorAnnotations
 #include <advisor-annotate.h>
 #endif
@@ -64,25 +87,250 @@ void hsv2rgb(float hue, float saturation, float value,
 }
 
 
+const char* const precisionNames[Precision_Count] = {"double", "float", "mixed"};
+
+const char* const solverNames[Solver_Count] = {"direct", "direct-sym", "bh", "fmm", "pm", "p3m"};
+
+const char* const integratorNames[Integrator_Count] = {"legacy", "leapfrog", "yoshida4", "hermite4"};
+
+const char* const rngNames[Rng_Count] = {"philox", "mt19937"};
+
+// Philox key word next to the seed, and the counter blocks of each body:
+// 0-4 for its position, velocity and acceleration, 5 for its mass
+#define PHILOX_KEY 0x6e626f64u
+#define PHILOX_STATE_BLOCKS 5
+#define PHILOX_MASS_BLOCK 5
+
+ParticleArray::ParticleArray() {
+    _count = 0;
+    _padded = 0;
+    _bytes = 0;
+    _block = nullptr;
+    release();
+}
+
+void ParticleArray::allocate(int32_t count) {
+    release();
+
+    _count = count;
+    _padded = (count + PARTICLE_PADDING - 1) / PARTICLE_PADDING * PARTICLE_PADDING;
+
+    // one block, every column starts on its own cache line
+    size_t realColumn  = ((size_t)_padded * sizeof(real_type) + PARTICLE_ALIGNMENT - 1) / PARTICLE_ALIGNMENT * PARTICLE_ALIGNMENT;
+    size_t colorColumn = ((size_t)_padded * 3 * sizeof(float) + PARTICLE_ALIGNMENT - 1) / PARTICLE_ALIGNMENT * PARTICLE_ALIGNMENT;
+    size_t floatColumn = ((size_t)_padded * sizeof(float) + PARTICLE_ALIGNMENT - 1) / PARTICLE_ALIGNMENT * PARTICLE_ALIGNMENT;
+    size_t intColumn   = ((size_t)_padded * sizeof(int32_t) + PARTICLE_ALIGNMENT - 1) / PARTICLE_ALIGNMENT * PARTICLE_ALIGNMENT;
+    _bytes = realColumn * 12 + colorColumn + floatColumn * 8 + intColumn * 2;
+
+    _block = std::aligned_alloc(PARTICLE_ALIGNMENT, _bytes);
+    carve((char*)_block);
+
+    // First touch: every thread zeroes the entries a static schedule over
+    // the bodies gives it, so on NUMA machines the pages of every column
+    // sit on the node of the thread that works on them.
+    struct { size_t column, entry; int count; } layout[] = {
+        {realColumn, sizeof(real_type), 12}, {colorColumn, 3 * sizeof(float), 1},
+        {floatColumn, sizeof(float), 8}, {intColumn, sizeof(int32_t), 2}};
+    #pragma omp parallel
+    {
+        int t = omp_get_thread_num();
+        int nt = omp_get_num_threads();
+        size_t begin = (size_t)_padded * t / nt;
+        size_t end = (size_t)_padded * (t + 1) / nt;
+
+        char *ptr = (char*)_block;
+        for (auto& l : layout) {
+            for (int c = 0; c < l.count; c++, ptr += l.column) {
+                std::memset(ptr + begin * l.entry, 0, (end - begin) * l.entry);
+                // the alignment tail of a column, whoever has the last entries
+                if (t == nt - 1)
+                    std::memset(ptr + end * l.entry, 0, l.column - end * l.entry);
+            }
+        }
+
+        for (size_t i = begin; i < end; i++)
+            id[i] = slot[i] = (int32_t)i;
+    }
+}
+
+void ParticleArray::carve(char* ptr) {
+    size_t realColumn  = ((size_t)_padded * sizeof(real_type) + PARTICLE_ALIGNMENT - 1) / PARTICLE_ALIGNMENT * PARTICLE_ALIGNMENT;
+    size_t colorColumn = ((size_t)_padded * 3 * sizeof(float) + PARTICLE_ALIGNMENT - 1) / PARTICLE_ALIGNMENT * PARTICLE_ALIGNMENT;
+    size_t floatColumn = ((size_t)_padded * sizeof(float) + PARTICLE_ALIGNMENT - 1) / PARTICLE_ALIGNMENT * PARTICLE_ALIGNMENT;
+    size_t intColumn   = ((size_t)_padded * sizeof(int32_t) + PARTICLE_ALIGNMENT - 1) / PARTICLE_ALIGNMENT * PARTICLE_ALIGNMENT;
+
+    auto column = [&](size_t bytes) { char *c = ptr; ptr += bytes; return c; };
+
+    for (int k = 0; k < 3; k++) pos[k] = (real_type*)column(realColumn);
+    for (int k = 0; k < 3; k++) vel[k] = (real_type*)column(realColumn);
+    for (int k = 0; k < 3; k++) acc[k] = (real_type*)column(realColumn);
+    mass    = (real_type*)column(realColumn);
+    kEnergy = (real_type*)column(realColumn);
+    pEnergy = (real_type*)column(realColumn);
+    color   = (float*)column(colorColumn);
+
+    for (int k = 0; k < 3; k++) posF[k] = (float*)column(floatColumn);
+    massF = (float*)column(floatColumn);
+    for (int k = 0; k < 3; k++) accF[k] = (float*)column(floatColumn);
+    peF   = (float*)column(floatColumn);
+    id    = (int32_t*)column(intColumn);
+    slot  = (int32_t*)column(intColumn);
+}
+
+// Gathers into a fresh block, the padding entries are copied as they are.
+void ParticleArray::permute(const int32_t* order) {
+    real_type *real[12] = {pos[0], pos[1], pos[2], vel[0], vel[1], vel[2],
+                           acc[0], acc[1], acc[2], mass, kEnergy, pEnergy};
+    float *oldColor = color;
+    int32_t *oldId = id;
+    void *old = _block;
+
+    _block = std::aligned_alloc(PARTICLE_ALIGNMENT, _bytes);
+    carve((char*)_block);
+    real_type *dst[12] = {pos[0], pos[1], pos[2], vel[0], vel[1], vel[2],
+                          acc[0], acc[1], acc[2], mass, kEnergy, pEnergy};
+
+    int n = _count;
+    int padded = _padded;
+    #pragma omp parallel
+    {
+        for (int c = 0; c < 12; c++) {
+            const real_type *src = real[c];
+            real_type *d = dst[c];
+            #pragma omp for schedule(static) nowait
+            for (int i = 0; i < padded; i++)
+                d[i] = i < n ? src[order[i]] : src[i];
+        }
+        #pragma omp for schedule(static) nowait
+        for (int i = 0; i < padded; i++) {
+            int s = i < n ? order[i] : i;
+            color[i * 3 + 0] = oldColor[s * 3 + 0];
+            color[i * 3 + 1] = oldColor[s * 3 + 1];
+            color[i * 3 + 2] = oldColor[s * 3 + 2];
+            id[i] = oldId[s];
+        }
+    }
+    // after the implicit barrier every id is in place
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < padded; i++)
+        slot[id[i]] = i;
+
+    std::free(old);
+}
+
+void ParticleArray::swap(ParticleArray& other) {
+    for (int k = 0; k < 3; k++) {
+        std::swap(pos[k], other.pos[k]);
+        std::swap(vel[k], other.vel[k]);
+        std::swap(acc[k], other.acc[k]);
+        std::swap(posF[k], other.posF[k]);
+        std::swap(accF[k], other.accF[k]);
+    }
+    std::swap(mass, other.mass);
+    std::swap(color, other.color);
+    std::swap(kEnergy, other.kEnergy);
+    std::swap(pEnergy, other.pEnergy);
+    std::swap(massF, other.massF);
+    std::swap(peF, other.peF);
+    std::swap(id, other.id);
+    std::swap(slot, other.slot);
+    std::swap(_count, other._count);
+    std::swap(_padded, other._padded);
+    std::swap(_bytes, other._bytes);
+    std::swap(_block, other._block);
+}
+
+void ParticleArray::release() {
+    std::free(_block);
+    _block = nullptr;
+    _count = 0;
+    _padded = 0;
+
+    for (int k = 0; k < 3; k++)
+        pos[k] = vel[k] = acc[k] = nullptr;
+    mass = kEnergy = pEnergy = nullptr;
+    color = nullptr;
+    for (int k = 0; k < 3; k++)
+        posF[k] = accF[k] = nullptr;
+    massF = peF = nullptr;
+    id = slot = nullptr;
+}
+
+ParticleArray::~ParticleArray() {
+    release();
+}
+
 GSimulation::GSimulation() {
     seed = 42;
+    rng = Rng_Philox;
+    _nrng = rng;
     count = 1000;
     maxMass = 1.;
     dTime = 0.02;
 
     maxVel = 0.;
     maxAcc = 0.;
+
+    computeTime = 0.;
+    interactions = 0.;
+    interactionRate = 0.;
+
+    solver = Solver_Direct;
+    theta = .5;
+    fmmOrder = 4;
+    meshGrid = 64;
+    meshAssignment = Mesh_TSC;
+    tileI = 0;
+    tileJ = 0;
+    precision = Precision_Double;
+    energyEvery = 1;
+    energyTick = 0;
+    integrator = Integrator_Legacy;
+    blockSteps = false;
+    eta = .02;
+    maxLevel = 12;
+
+    replicate = false;
+    reorderEvery = 0;
+    reorderCount = 0;
+    reorderTime = 0.;
+    reorderTotal = 0.;
+    reorderGain = 0.;
+
+    isa = KernelIsa_Auto;
+    fastRsqrt = false;
+
+    _octree = new Octree();
+    _fmm = new Fmm();
+    _mesh = new ParticleMesh();
+    _hermite = new BlockHermite();
+    _replica = new NumaReplica();
+    _integratorState = -1;
+    _reordered = false;
+    _reorderBefore = 0.;
+    _gainSum = 0.;
+    _gainCount = 0;
 }
 
 void GSimulation::init() {
     _ncount = count;
     _nmaxmass = maxMass;
     _nseed = seed;
+    _nrng = rng;
 
     tickCount = 0;
     elapsedTime = 0;
 
-    particles = new Particle[get_count()];
+    particles.allocate(get_count());
+    _integratorState = -1;
+
+    reorderCount = 0;
+    reorderTotal = 0.;
+    reorderGain = 0.;
+    _reordered = false;
+    _reorderBefore = 0.;
+    _gainSum = 0.;
+    _gainCount = 0;
 
     init_pos();
     init_mass();
@@ -94,74 +342,445 @@ void GSimulation::init() {
 }
 
 void GSimulation::remove() {
-    delete particles;
+    particles.release();
 }
 
-Particle* GSimulation::getPtr() {
-    return particles;
+ParticleArray* GSimulation::getPtr() {
+    return &particles;
 }
 
 void GSimulation::init_pos()  {
-  std::random_device rd;	//random number generator
-  std::mt19937 gen(_nseed);      
-  std::uniform_real_distribution<real_type> unif_d(0. , 1.);
-  std::uniform_real_distribution<real_type> unif_r(-1., 1.);
-  
-  for(int i=0; i<get_count(); ++i)
-  {
-    particles[i].pos[0] = unif_d(gen);
-    particles[i].pos[1] = unif_d(gen);
-    particles[i].pos[2] = unif_d(gen);
-
-    particles[i].vel[0] = unif_r(gen) * maxVel;
-    particles[i].vel[1] = unif_r(gen) * maxVel;
-    particles[i].vel[2] = unif_r(gen) * maxVel;
-
-    particles[i].acc[0] = unif_r(gen) * maxAcc;
-    particles[i].acc[1] = unif_r(gen) * maxAcc;
-    particles[i].acc[2] = unif_r(gen) * maxAcc;
+  if (_nrng == Rng_MT19937) {
+    std::mt19937 gen(_nseed);
+    std::uniform_real_distribution<real_type> unif_d(0. , 1.);
+    std::uniform_real_distribution<real_type> unif_r(-1., 1.);
+
+    for(int i=0; i<get_count(); ++i)
+    {
+      particles.pos[0][i] = unif_d(gen);
+      particles.pos[1][i] = unif_d(gen);
+      particles.pos[2][i] = unif_d(gen);
+
+      particles.vel[0][i] = unif_r(gen) * maxVel;
+      particles.vel[1][i] = unif_r(gen) * maxVel;
+      particles.vel[2][i] = unif_r(gen) * maxVel;
+
+      particles.acc[0][i] = unif_r(gen) * maxAcc;
+      particles.acc[1][i] = unif_r(gen) * maxAcc;
+      particles.acc[2][i] = unif_r(gen) * maxAcc;
+    }
+    return;
+  }
+
+  // body i draws from counters (i, block), the same on any thread count;
+  // static schedule like allocate(), each thread writes what it touched first
+  const int n = get_count();
+  const uint32_t key = (uint32_t)_nseed;
+  const double vel = maxVel, acc = maxAcc;
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < n; i++) {
+    uint32_t w[4 * PHILOX_STATE_BLOCKS];
+    for (int b = 0; b < PHILOX_STATE_BLOCKS; b++) {
+      Philox4x32 r = philox4x32((uint32_t)i, (uint32_t)b, 0u, 0u, key, PHILOX_KEY);
+      for (int k = 0; k < 4; k++)
+        w[b * 4 + k] = r.v[k];
+    }
+    for (int k = 0; k < 3; k++) {
+      particles.pos[k][i] = (real_type)philox_unit(w[2*k], w[2*k + 1]);
+      particles.vel[k][i] = (real_type)((2. * philox_unit(w[6 + 2*k], w[7 + 2*k]) - 1.) * vel);
+      particles.acc[k][i] = (real_type)((2. * philox_unit(w[12 + 2*k], w[13 + 2*k]) - 1.) * acc);
+    }
   }
 }
 
 void GSimulation::init_mass()  {
-  std::random_device rd;	//random number generator
-  std::mt19937 gen(_nseed);      
-  std::uniform_real_distribution<real_type> unif_d(0, _nmaxmass);
-  
-  for(int i=0; i<get_count(); ++i)
-  {
-    particles[i].mass = unif_d(gen);
+  if (_nrng == Rng_MT19937) {
+    // seeded as init_pos(), the masses repeat its first draws
+    std::mt19937 gen(_nseed);
+    std::uniform_real_distribution<real_type> unif_d(0, _nmaxmass);
+
+    for(int i=0; i<get_count(); ++i)
+    {
+      particles.mass[i] = unif_d(gen);
+    }
+    return;
+  }
+
+  const int n = get_count();
+  const uint32_t key = (uint32_t)_nseed;
+  const double mass = _nmaxmass;
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < n; i++) {
+    Philox4x32 r = philox4x32((uint32_t)i, PHILOX_MASS_BLOCK, 0u, 0u, key, PHILOX_KEY);
+    particles.mass[i] = (real_type)(philox_unit(r.v[0], r.v[1]) * mass);
   }
 }
 
 void GSimulation::init_color()  {
     real_type mass = _nmaxmass;
+    #pragma omp parallel for schedule(static)
     for(int i=0; i<get_count(); ++i) {
         float r,g,b;
-        hsv2rgb((float)i*360./get_count() , 1.0, (mass-particles[i].mass)*.8/mass + .2, &r, &g, &b);
-        particles[i].color[0] = r;
-        particles[i].color[1] = g;
-        particles[i].color[2] = b;
+        hsv2rgb((float)i*360./get_count() , 1.0, (mass-particles.mass[i])*.8/mass + .2, &r, &g, &b);
+        particles.color[i*3+0] = r;
+        particles.color[i*3+1] = g;
+        particles.color[i*3+2] = b;
     }
 }
 
 void GSimulation::tick() {
+    PROFILE_PHASE(Phase_Step);
     elapsedTime += dTime;
     tickCount++;
 
-    int n = get_count();
-    real_type dt = get_dt();
-
     //const double softeningSquared = 1e-3;
     //prevents explosion in the case the particles are really close to each other 
     //const double G = 6.67259e-11;
 
-    kEnergy = 0.;
-    pEnergy = 0.;
+    // energies are a diagnostic sample, the other ticks keep the last one
+    bool sample = energyEvery <= 1 || tickCount % energyEvery == 0;
 
     double _tKe = 0.;
     double _tPe = 0.;
 
+    switch (integrator) {
+        case Integrator_Leapfrog:
+            _tPe = integrate<LeapfrogPolicy>(sample, &_tKe);
+            break;
+        case Integrator_Yoshida4:
+            _tPe = integrate<Yoshida4Policy>(sample, &_tKe);
+            break;
+        case Integrator_Hermite4:
+            _tPe = integrate_hermite(sample, &_tKe);
+            break;
+        default:
+            _tPe = integrate<LegacyPolicy>(sample, &_tKe);
+            break;
+    }
+    _integratorState = integrator;
+
+    if (sample) {
+        pEnergy = _tPe;
+        kEnergy = _tKe;
+        fEnergy = pEnergy + kEnergy;
+        energyTick = tickCount;
+    }
+
+    _reordered = reorderEvery > 0 && tickCount % reorderEvery == 0;
+    if (_reordered)
+        reorder();
+}
+
+// Only the direct solvers in double under the splitting integrators with a
+// single force pass have all their phases as worksharing loops.
+bool GSimulation::team_ticks() {
+    if (precision != Precision_Double)
+        return false;
+    if (integrator == Integrator_Legacy)
+        return solver == Solver_DirectSymmetric || (solver == Solver_Direct && (tileI <= 0 || tileJ <= 0));
+    if (integrator == Integrator_Leapfrog)
+        return solver == Solver_Direct || solver == Solver_DirectSymmetric;
+    return false;
+}
+
+void GSimulation::run(int ticks) {
+    while (ticks > 0) {
+        if (!team_ticks()) {
+            tickTimed();
+            ticks--;
+            continue;
+        }
+
+        PROFILE_PHASE(Phase_Step);
+        // a batch stops at the next reorder, which runs in between
+        int batch = ticks;
+        if (reorderEvery > 0)
+            batch = std::min(batch, reorderEvery - tickCount % reorderEvery);
+
+        double startTime = omp_get_wtime();
+        double pairs = 0.;
+        if (integrator == Integrator_Leapfrog && _integratorState != integrator) {
+            forces(false);
+            pairs += interactions;
+        }
+        double first, last;
+        run_team(batch, &first, &last);
+        _integratorState = integrator;
+        _reordered = reorderEvery > 0 && tickCount % reorderEvery == 0;
+        if (_reordered)
+            reorder();
+
+        // as tickTimed() does, the last tick before a reorder against the first after it
+        measure_gain(first);
+        if (_reordered)
+            _reorderBefore = last;
+
+        double endTime = omp_get_wtime();
+        interactions = (double)get_count() * (get_count() - 1);
+        computeTime = (endTime - startTime) / batch;
+        interactionRate = endTime > startTime ? (pairs + interactions * batch) / (endTime - startTime) : 0.;
+        ticks -= batch;
+    }
+}
+
+// ticks ticks of tick() in one parallel region. The phases end on the
+// barriers of their worksharing loops, the team stays up from one tick to
+// the next. Sums are per thread and added up in thread order, so they do
+// not depend on timing; they can differ in the last bits from the ones of
+// tick(), where reduction(+) adds them up in an order of its choosing.
+void GSimulation::run_team(int ticks, double* first, double* last) {
+    int threads = omp_get_max_threads();
+    std::vector<double> partial((size_t)threads * PARTIAL_STRIDE);
+    int startTick = tickCount;
+    bool leapfrog = integrator == Integrator_Leapfrog;
+    bool predictor = !leapfrog && solver == Solver_Direct;
+    double previous = omp_get_wtime();
+
+    #pragma omp parallel num_threads(threads)
+    for (int k = 0; k < ticks; k++) {
+        int tick = startTick + k + 1;
+        bool sample = energyEvery <= 1 || tick % energyEvery == 0;
+
+        double ke = team_advance(leapfrog ? LeapfrogPolicy::kick(0) : LegacyPolicy::kick(0), 1., partial.data());
+        double pe = predictor ? team_predictor(sample, partial.data()) : team_symmetric(sample, partial.data());
+        if (leapfrog)
+            ke = team_advance(LeapfrogPolicy::kick(1), 0., partial.data());
+
+        #pragma omp single
+        {
+            elapsedTime += dTime;
+            tickCount++;
+            if (sample) {
+                pEnergy = pe;
+                kEnergy = ke;
+                fEnergy = pEnergy + kEnergy;
+                energyTick = tickCount;
+            }
+            // every thread is past the last phase's barrier, the tick is done
+            double now = omp_get_wtime();
+            if (k == 0)
+                *first = now - previous;
+            if (k == ticks - 1)
+                *last = now - previous;
+            previous = now;
+        }
+    }
+}
+
+// every thread adds up the same partials in the same order
+static double team_sum(const double* partial, int slot) {
+    double sum = 0.;
+    for (int t = 0; t < omp_get_num_threads(); t++)
+        sum += partial[t * PARTIAL_STRIDE + slot];
+    return sum;
+}
+
+// advance<double>() as a worksharing loop, returns the kinetic energy
+double GSimulation::team_advance(real_type kick, real_type drift, double* partial) {
+    PROFILE_PHASE(Phase_Advance);
+    int n = get_count();
+    double dt = get_dt();
+
+    real_type *px = particles.pos[0], *py = particles.pos[1], *pz = particles.pos[2];
+    real_type *vx = particles.vel[0], *vy = particles.vel[1], *vz = particles.vel[2];
+    real_type *ax = particles.acc[0], *ay = particles.acc[1], *az = particles.acc[2];
+    real_type *mass = particles.mass;
+
+    double _tKe = 0.;
+    #pragma omp for schedule(static)
+    for (int i = 0; i < n; ++i) {
+        double vxi = vx[i] + ax[i] * dt * kick;	//2flops
+        double vyi = vy[i] + ay[i] * dt * kick;	//2flops
+        double vzi = vz[i] + az[i] * dt * kick;	//2flops
+
+        px[i] = px[i] + vxi * dt * drift;	//2flops
+        py[i] = py[i] + vyi * dt * drift;	//2flops
+        pz[i] = pz[i] + vzi * dt * drift;	//2flops
+
+        vx[i] = vxi;
+        vy[i] = vyi;
+        vz[i] = vzi;
+
+        particles.kEnergy[i] = mass[i] * (vxi * vxi + vyi * vyi + vzi * vzi) * .5;
+        _tKe += particles.kEnergy[i];
+    }
+    partial[omp_get_thread_num() * PARTIAL_STRIDE] = _tKe;
+    #pragma omp barrier
+    return team_sum(partial, 0);
+}
+
+// the untiled forces_direct<double>() as a worksharing loop
+double GSimulation::team_predictor(bool energy, double* partial) {
+    PROFILE_PHASE(Phase_Forces);
+    int n = get_count();
+
+    real_type *px = particles.pos[0], *py = particles.pos[1], *pz = particles.pos[2];
+    real_type *vx = particles.vel[0], *vy = particles.vel[1], *vz = particles.vel[2];
+    real_type *ax = particles.acc[0], *ay = particles.acc[1], *az = particles.acc[2];
+
+    predictor_kernel<double> row = kernel_set(kernel_table(isa), double()).predictor[fastRsqrt ? 1 : 0];
+    ForceSource<double> src = {px, py, pz, particles.mass, particles.padded(), 0};
+    ForceConst<double> fc = {G, softeningSquared, get_dt()};
+
+    if (replicate && numa_topology().nodes > 1) {
+        const void* columns[4] = {px, py, pz, particles.mass};
+        double* const* copy = (double* const*)_replica->refresh(columns, 4, (size_t)particles.padded() * sizeof(double));
+        src = {copy[0], copy[1], copy[2], copy[3], particles.padded(), 0};
+    }
+
+    double _tPe = 0.;
+    #pragma omp for schedule(static)
+    for (int i = 0; i < n; i++) {
+        ForceTarget<double> tgt = {px[i], py[i], pz[i], vx[i], vy[i], vz[i], i};
+        double acc[3] = {0., 0., 0.};
+        double pe = 0.;
+
+        row(src, tgt, fc, acc, energy ? &pe : nullptr);
+
+        ax[i] = acc[0];
+        ay[i] = acc[1];
+        az[i] = acc[2];
+        if (energy) {
+            particles.pEnergy[i] = pe * particles.mass[i];
+            _tPe += particles.pEnergy[i] * .5;
+        }
+    }
+    partial[omp_get_thread_num() * PARTIAL_STRIDE + 1] = _tPe;
+    #pragma omp barrier
+    return team_sum(partial, 1);
+}
+
+// forces_symmetric<double>() with accelerations inside the team
+double GSimulation::team_symmetric(bool energy, double* partial) {
+    PROFILE_PHASE(Phase_Forces);
+    int n = get_count();
+
+    symmetric_pass<double>(particles.pos, particles.mass, particles.acc, particles.pEnergy, true, energy);
+
+    double _tPe = 0.;
+    if (energy) {
+        #pragma omp for schedule(static)
+        for (int i = 0; i < n; i++) {
+            particles.pEnergy[i] *= particles.mass[i];
+            _tPe += particles.pEnergy[i] * .5;
+        }
+    }
+    partial[omp_get_thread_num() * PARTIAL_STRIDE + 1] = _tPe;
+    #pragma omp barrier
+    return team_sum(partial, 1);
+}
+
+// Sorts the bodies along the Morton curve of their positions, so bodies
+// close in space are close in memory. Everything indexed by slot moves
+// with them, the ids in ParticleArray keep track of who is who.
+void GSimulation::reorder() {
+    PROFILE_PHASE(Phase_Reorder);
+    double startTime = omp_get_wtime();
+    int n = get_count();
+
+    std::vector<uint64_t> keys(n), tmpKeys(n);
+    std::vector<int32_t> order(n), tmpOrder(n);
+
+    real_type origin[3], size;
+    morton_bounds(particles.pos[0], particles.pos[1], particles.pos[2], n, origin, &size);
+    morton_keys(particles.pos[0], particles.pos[1], particles.pos[2], n, origin, size, keys.data());
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++)
+        order[i] = i;
+    radix_sort(keys.data(), order.data(), n, tmpKeys.data(), tmpOrder.data());
+
+    particles.permute(order.data());
+    if (_integratorState == Integrator_Hermite4)
+        _hermite->permute(order.data());
+
+    reorderTime = omp_get_wtime() - startTime;
+    reorderTotal += reorderTime;
+    reorderCount++;
+}
+
+// One tick of a splitting policy from integrator.hpp. Returns the potential
+// energy of the last force pass and the kinetic energy in ke, the latter of
+// the velocities after the closing kick. interactions add up over the passes.
+template<typename I>
+double GSimulation::integrate(bool sample, double* ke) {
+    double pairs = 0.;
+    double pe = 0.;
+
+    // Hermite took its reference from the direct potential, not the solver's
+    if (_integratorState == Integrator_Hermite4)
+        rewrite_initialEnergy();
+
+    if (I::startForces && _integratorState != integrator) {
+        forces(false);
+        pairs += interactions;
+    }
+
+    for (int s = 0; s < I::stages; s++) {
+        *ke = precision == Precision_Float ? advance<float>(I::kick(s), I::drift(s))
+                                           : advance<double>(I::kick(s), I::drift(s));
+        pe = forces(sample && s == I::stages - 1);
+        pairs += interactions;
+    }
+    if (I::kick(I::stages) != 0.)
+        *ke = precision == Precision_Float ? advance<float>(I::kick(I::stages), 0.)
+                                           : advance<double>(I::kick(I::stages), 0.);
+
+    interactions = pairs;
+    return pe;
+}
+
+// Hermite steps, shared or on block levels, with plain softened direct forces
+// in double. The stepper keeps jerks and levels between ticks, anything else
+// that moved the bodies makes it start over.
+double GSimulation::integrate_hermite(bool sample, double* ke) {
+    int n = get_count();
+    double pe = 0.;
+
+    _hermite->eta = eta;
+    _hermite->maxLevel = blockSteps ? maxLevel : 0;
+
+    interactions = 0.;
+    {
+        // predictor, forces and corrector in one, counted as forces
+        PROFILE_PHASE(Phase_Forces);
+        if (_integratorState != Integrator_Hermite4 || !_hermite->started(n)) {
+            _hermite->start(particles, n, G, softeningSquared, dTime);
+            interactions += (double)n * (n - 1);
+            // the reference of another integrator can be another solver's
+            // potential, take it again from the one sampled below
+            if (_integratorState >= 0 && _integratorState != Integrator_Hermite4) {
+                double pairs;
+                _initialEnergy = kinetic_energy() + forces_symmetric(false, true, &pairs);
+            }
+        }
+        interactions += _hermite->step(particles, n, G, softeningSquared, dTime);
+    }
+
+    *ke = kinetic_energy();
+    if (sample) {
+        PROFILE_PHASE(Phase_Energy);
+        double pairs;
+        pe = forces_symmetric(false, true, &pairs);
+    }
+    return pe;
+}
+
+// Kick and drift in the state precision T, the columns store what T can hold.
+// Velocities move by kick * dt * a, positions by drift * dt * v.
+// Returns the kinetic energy, summed in double whatever T is.
+template<typename T>
+double GSimulation::advance(real_type kick, real_type drift) {
+    PROFILE_PHASE(Phase_Advance);
+    int n = get_count();
+    T dt = get_dt();
+
+    double _tKe = 0.;
+
+    real_type *px = particles.pos[0], *py = particles.pos[1], *pz = particles.pos[2];
+    real_type *vx = particles.vel[0], *vy = particles.vel[1], *vz = particles.vel[2];
+    real_type *ax = particles.acc[0], *ay = particles.acc[1], *az = particles.acc[2];
+    real_type *mass = particles.mass;
+
 #ifdef advisorAnnotations
     ANNOTATE_SITE_BEGIN(pos_update);
 #else
@@ -172,23 +791,25 @@ void GSimulation::tick() {
         ANNOTATE_ITERATION_TASK(pos_task);
         {
 #endif
-            real_type coef = 1.;
+            T vxi = (T)vx[i] + (T)ax[i] * dt * (T)kick;	//2flops
+            T vyi = (T)vy[i] + (T)ay[i] * dt * (T)kick;	//2flops
+            T vzi = (T)vz[i] + (T)az[i] * dt * (T)kick;	//2flops
 
-            particles[i].vel[0] += particles[i].acc[0] * dt * coef;	//2flops
-            particles[i].vel[1] += particles[i].acc[1] * dt * coef;	//2flops
-            particles[i].vel[2] += particles[i].acc[2] * dt * coef;	//2flops
+            px[i] = (T)px[i] + vxi * dt * (T)drift;	//2flops
+            py[i] = (T)py[i] + vyi * dt * (T)drift;	//2flops
+            pz[i] = (T)pz[i] + vzi * dt * (T)drift;	//2flops
 
-            particles[i].pos[0] += particles[i].vel[0] * dt * coef;	//2flops
-            particles[i].pos[1] += particles[i].vel[1] * dt * coef;	//2flops
-            particles[i].pos[2] += particles[i].vel[2] * dt * coef;	//2flops
+            vx[i] = vxi;
+            vy[i] = vyi;
+            vz[i] = vzi;
 
-            particles[i].kEnergy = particles[i].mass * (
-                particles[i].vel[0] * particles[i].vel[0] +
-                particles[i].vel[1] * particles[i].vel[1] +
-                particles[i].vel[2] * particles[i].vel[2]
-                ) * .5;
+            particles.kEnergy[i] = (T)mass[i] * (
+                vxi * vxi +
+                vyi * vyi +
+                vzi * vzi
+                ) * (T).5;
 
-            _tKe += particles[i].kEnergy;
+            _tKe += particles.kEnergy[i];
 #ifdef advisorAnnotations
         }
         //ANNOTATE_TASK_END();
@@ -198,6 +819,89 @@ void GSimulation::tick() {
     ANNOTATE_SITE_END();
 #endif
 
+    return _tKe;
+}
+
+// float copies of what the single precision kernels read
+void GSimulation::to_single() {
+    int padded = particles.padded();
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < padded; i++) {
+        for (int k = 0; k < 3; k++)
+            particles.posF[k][i] = (float)particles.pos[k][i];
+        particles.massF[i] = (float)particles.mass[i];
+    }
+}
+
+double GSimulation::forces(bool energy) {
+    PROFILE_PHASE(Phase_Forces);
+    switch (solver) {
+        case Solver_DirectSymmetric:
+            return forces_symmetric(true, energy, &interactions);
+        case Solver_BarnesHut:
+            return forces_tree(true, &interactions);
+        case Solver_FMM:
+            return forces_fmm(true, &interactions);
+        case Solver_PM:
+        case Solver_P3M:
+            return forces_mesh(true, &interactions);
+        default:
+            // the predictor pairs belong to the legacy scheme, the others
+            // integrate plain softened gravity
+            if (integrator != Integrator_Legacy)
+                return forces_symmetric(true, energy, &interactions);
+            return forces_direct(energy);
+    }
+}
+
+double GSimulation::measure_forces() {
+    double startTime = omp_get_wtime();
+    forces(true);
+    double endTime = omp_get_wtime();
+    return endTime > startTime ? interactions / (endTime - startTime) : 0.;
+}
+
+double GSimulation::flops_per_interaction() {
+    double share = 1. / std::max(1, energyEvery);
+    if (integrator == Integrator_Hermite4)
+        return 0.;
+    if (solver == Solver_DirectSymmetric || (solver == Solver_Direct && integrator != Integrator_Legacy))
+        return (SYMMETRIC_FLOPS + SYMMETRIC_ENERGY_FLOPS * share) / 2.;
+    if (solver == Solver_Direct)
+        return PREDICTOR_FLOPS + PREDICTOR_ENERGY_FLOPS * share;
+    return 0.;
+}
+
+double GSimulation::forces_direct(bool energy) {
+    if (single_forces()) {
+        to_single();
+        return forces_direct<float>(particles.posF, particles.massF, energy);
+    }
+    return forces_direct<double>(particles.pos, particles.mass, energy);
+}
+
+template<typename T>
+double GSimulation::forces_direct(T* const pos[3], const T* mass, bool energy) {
+    int n = get_count();
+    real_type dt = get_dt();
+
+    double _tPe = 0.;
+
+    T *px = pos[0], *py = pos[1], *pz = pos[2];
+    real_type *vx = particles.vel[0], *vy = particles.vel[1], *vz = particles.vel[2];
+    real_type *ax = particles.acc[0], *ay = particles.acc[1], *az = particles.acc[2];
+
+    // the j loop runs in the SIMD kernel, over the zero mass padded tail too
+    predictor_kernel<T> row = kernel_set(kernel_table(isa), T()).predictor[fastRsqrt ? 1 : 0];
+    ForceSource<T> src = {px, py, pz, mass, particles.padded(), 0};
+    ForceConst<T> fc = {(T)G, (T)softeningSquared, (T)dt};
+
+    if (tileI > 0 && tileJ > 0)
+        return forces_direct_tiled<T>(pos, mass, row, fc, energy);
+    if (replicate && numa_topology().nodes > 1)
+        return forces_direct_replicated<T>(pos, mass, row, fc, energy);
+
 #ifdef advisorAnnotations
     ANNOTATE_SITE_BEGIN(acc_update);
 #else
@@ -208,224 +912,600 @@ void GSimulation::tick() {
         ANNOTATE_ITERATION_TASK(acc_task);
         {
 #endif
-            particles[i].acc[0] = 0.;
-            particles[i].acc[1] = 0.;
-            particles[i].acc[2] = 0.;
+            ForceTarget<T> tgt = {px[i], py[i], pz[i], (T)vx[i], (T)vy[i], (T)vz[i], i};
+            T acc[3] = {0., 0., 0.};
+            T pe = 0.;
+
+            row(src, tgt, fc, acc, energy ? &pe : nullptr);
+
+            ax[i] = acc[0];
+            ay[i] = acc[1];
+            az[i] = acc[2];
+            if (energy) {
+                particles.pEnergy[i] = pe * particles.mass[i];
+                _tPe += particles.pEnergy[i] * .5;
+            }
+#ifdef advisorAnnotations
+        }
+        //ANNOTATE_TASK_END();
+#endif
+    }
+#ifdef advisorAnnotations
+    ANNOTATE_SITE_END();
+#endif
+
+    interactions = (double)n * (n - 1);
 
-            particles[i].pEnergy = 0.;
+    return _tPe;
+}
 
-            for (int j = 0; j < n; j++) {
-                if (i == j)
-                    continue;
+// Every row streams all of j, on a NUMA machine half of it from the other
+// socket. The rows read a copy of the j columns on their own node instead.
+template<typename T>
+double GSimulation::forces_direct_replicated(T* const pos[3], const T* mass,
+                                             predictor_kernel<T> row, const ForceConst<T>& fc, bool energy) {
+    int n = get_count();
+    int padded = particles.padded();
 
-                real_type dx, dy, dz;
-                real_type _dx, _dy, _dz;
-                real_type distanceSqr = 0.0;
-                real_type distanceInv = 0.0;
+    T *px = pos[0], *py = pos[1], *pz = pos[2];
+    real_type *vx = particles.vel[0], *vy = particles.vel[1], *vz = particles.vel[2];
+    real_type *ax = particles.acc[0], *ay = particles.acc[1], *az = particles.acc[2];
 
-                dx = particles[j].pos[0] - particles[i].pos[0];	//1flop
-                dy = particles[j].pos[1] - particles[i].pos[1];	//1flop	
-                dz = particles[j].pos[2] - particles[i].pos[2];	//1flop
+    const void* columns[4] = {px, py, pz, mass};
+    double _tPe = 0.;
 
-                distanceSqr = dx * dx + dy * dy + dz * dz;	//6flops
+    #pragma omp parallel reduction(+ : _tPe)
+    {
+        T* const* copy = (T* const*)_replica->refresh(columns, 4, (size_t)padded * sizeof(T));
+        ForceSource<T> src = {copy[0], copy[1], copy[2], copy[3], padded, 0};
+
+        #pragma omp for
+        for (int i = 0; i < n; i++) {
+            ForceTarget<T> tgt = {px[i], py[i], pz[i], (T)vx[i], (T)vy[i], (T)vz[i], i};
+            T acc[3] = {0., 0., 0.};
+            T pe = 0.;
+
+            row(src, tgt, fc, acc, energy ? &pe : nullptr);
+
+            ax[i] = acc[0];
+            ay[i] = acc[1];
+            az[i] = acc[2];
+            if (energy) {
+                particles.pEnergy[i] = pe * particles.mass[i];
+                _tPe += particles.pEnergy[i] * .5;
+            }
+        }
+    }
 
-                double _distanceSqr = distanceSqr;
-                //FAILSAFE part 1
-                if (distanceSqr <= softeningSquared)
-                    _distanceSqr = softeningSquared;	//6flops
+    interactions = (double)n * (n - 1);
 
-                distanceInv = 1.0 / sqrt(_distanceSqr);			//1div+1sqrt
-                real_type force1 = G * particles[j].mass * distanceInv * distanceInv * distanceInv; //* 0.5;
-                particles[i].pEnergy -= .5 * force1 * particles[i].mass * (_distanceSqr);
+    return _tPe;
+}
 
-                //2nd part
-                real_type tmpAcc[3];
-                real_type tmpVel[3];
-                real_type tmpPos[3];
+// i-blocks x j-blocks: a thread copies one j tile into its own aligned
+// buffer and runs every row of its i block against it, so the tile stays
+// in cache instead of the whole j range streaming through once per body.
+template<typename T>
+double GSimulation::forces_direct_tiled(T* const pos[3], const T* mass,
+                                        predictor_kernel<T> row, const ForceConst<T>& fc, bool energy) {
+    int n = get_count();
+    int padded = particles.padded();
 
-                tmpAcc[0] = dx * (force1);
-                tmpAcc[1] = dy * (force1);
-                tmpAcc[2] = dz * (force1);
+    T *px = pos[0], *py = pos[1], *pz = pos[2];
+    real_type *vx = particles.vel[0], *vy = particles.vel[1], *vz = particles.vel[2];
+    real_type *ax = particles.acc[0], *ay = particles.acc[1], *az = particles.acc[2];
 
-                tmpVel[0] = particles[i].vel[0] + tmpAcc[0] * dt;// *.5;
-                tmpVel[1] = particles[i].vel[1] + tmpAcc[1] * dt;// * .5;
-                tmpVel[2] = particles[i].vel[2] + tmpAcc[2] * dt;// * .5;
+    int blockI = std::max(1, tileI);
+    // rounded up here only, the setting stays as the user left it
+    int blockJ = std::max(PARTICLE_PADDING, (tileJ + PARTICLE_PADDING - 1) / PARTICLE_PADDING * PARTICLE_PADDING);
 
-                tmpPos[0] = particles[i].pos[0] + tmpVel[0] * dt;// * .5;
-                tmpPos[1] = particles[i].pos[1] + tmpVel[1] * dt;// * .5;
-                tmpPos[2] = particles[i].pos[2] + tmpVel[2] * dt;// *.5;
+    double _tPe = 0.;
 
-                _dx = particles[j].pos[0] - tmpPos[0];	//1flop
-                _dy = particles[j].pos[1] - tmpPos[1];	//1flop	
-                _dz = particles[j].pos[2] - tmpPos[2];	//1flop
+    #pragma omp parallel reduction(+ : _tPe)
+    {
+        size_t column = ((size_t)blockJ * sizeof(T) + PARTICLE_ALIGNMENT - 1) / PARTICLE_ALIGNMENT * PARTICLE_ALIGNMENT;
+        char *buffer = (char*)std::aligned_alloc(PARTICLE_ALIGNMENT, 4 * column);
+        T *tile[4];
+        for (int k = 0; k < 4; k++)
+            tile[k] = (T*)(buffer + k * column);
+
+        std::vector<T> acc(4 * (size_t)blockI);
+
+        #pragma omp for schedule(dynamic, 1)
+        for (int ib = 0; ib < n; ib += blockI) {
+            int ie = std::min(n, ib + blockI);
+            std::fill(acc.begin(), acc.end(), (T)0.);
+
+            for (int jb = 0; jb < padded; jb += blockJ) {
+                int count = std::min(blockJ, padded - jb);
+                std::memcpy(tile[0], px + jb, count * sizeof(T));
+                std::memcpy(tile[1], py + jb, count * sizeof(T));
+                std::memcpy(tile[2], pz + jb, count * sizeof(T));
+                std::memcpy(tile[3], mass + jb, count * sizeof(T));
+                ForceSource<T> src = {tile[0], tile[1], tile[2], tile[3], count, jb};
+
+                for (int i = ib; i < ie; i++) {
+                    ForceTarget<T> tgt = {px[i], py[i], pz[i], (T)vx[i], (T)vy[i], (T)vz[i], i};
+                    T *a = &acc[4 * (size_t)(i - ib)];
+                    row(src, tgt, fc, a, energy ? &a[3] : nullptr);
+                }
+            }
 
-                _distanceSqr = _dx * _dx + _dy * _dy + _dz * _dz;	//6flops
+            for (int i = ib; i < ie; i++) {
+                T *a = &acc[4 * (size_t)(i - ib)];
+                ax[i] = a[0];
+                ay[i] = a[1];
+                az[i] = a[2];
+                if (energy) {
+                    particles.pEnergy[i] = a[3] * particles.mass[i];
+                    _tPe += particles.pEnergy[i] * .5;
+                }
+            }
+        }
 
-                //FAILSAFE part 2
-                if (_distanceSqr <= softeningSquared)
-                    _distanceSqr = softeningSquared;	//6flops
+        std::free(buffer);
+    }
 
-                //real_type force2 = 0.;
-                //_distanceSqr *= 4.;
-                distanceInv = 1.0 / sqrt(_distanceSqr);			//1div+1sqrt
-                real_type force2 = G * particles[j].mass * distanceInv * distanceInv * distanceInv;
-                particles[i].pEnergy -= .5 * force2 * particles[i].mass * (_distanceSqr);
+    interactions = (double)n * (n - 1);
 
-                //FAILSAFE part 3
-                if (distanceSqr <= softeningSquared && _distanceSqr <= softeningSquared)
-                    continue;
+    return _tPe;
+}
 
-                particles[i].acc[0] += (dx * force1 + _dx * force2) * .5;
-                particles[i].acc[1] += (dy * force1 + _dy * force2) * .5;
-                particles[i].acc[2] += (dz * force1 + _dz * force2) * .5;
-            }
-            _tPe += particles[i].pEnergy * .5;
-#ifdef advisorAnnotations
+double GSimulation::forces_symmetric(bool accel, bool energy, double* pairs) {
+    if (single_forces()) {
+        to_single();
+        return forces_symmetric<float>(particles.posF, particles.massF, particles.accF, particles.peF, accel, energy, pairs);
+    }
+    return forces_symmetric<double>(particles.pos, particles.mass, particles.acc, particles.pEnergy, accel, energy, pairs);
+}
+
+// Each pair once, on a round robin schedule of tile pairs: in every round a
+// tile takes part in at most one pair, so the pairs of a round run in
+// parallel without two threads ever writing the same accumulators.
+template<typename T>
+double GSimulation::forces_symmetric(T* const pos[3], T* mass, T* const acc[3], T* pe,
+                                     bool accel, bool energy, double* pairs) {
+    int n = get_count();
+
+    #pragma omp parallel
+    symmetric_pass<T>(pos, mass, acc, pe, accel, energy);
+
+    // back into the double columns, the sum is always taken in double
+    double _tPe = 0.;
+    #pragma omp parallel for reduction(+ : _tPe)
+    for (int i = 0; i < n; i++) {
+        if (accel) {
+            particles.acc[0][i] = acc[0][i];
+            particles.acc[1][i] = acc[1][i];
+            particles.acc[2][i] = acc[2][i];
+        }
+        if (energy) {
+            particles.pEnergy[i] = pe[i] * particles.mass[i];
+            _tPe += particles.pEnergy[i] * .5;
         }
-        //ANNOTATE_TASK_END();
-#endif
     }
-#ifdef advisorAnnotations
-    ANNOTATE_SITE_END();
-#endif
 
-    pEnergy = _tPe;
-    kEnergy = _tKe;
-	fEnergy = pEnergy + kEnergy;
+    // counted from both ends, like the other solvers
+    *pairs = (double)n * (n - 1);
+    return _tPe;
 }
 
-void GSimulation::update_energy() {
+// The worksharing loops of the symmetric pass, called by every thread of a team.
+template<typename T>
+void GSimulation::symmetric_pass(T* const pos[3], T* mass, T* const acc[3], T* pe, bool accel, bool energy) {
+    int padded = particles.padded();
+
+    T *px = pos[0], *py = pos[1], *pz = pos[2];
+    T *ax = acc[0], *ay = acc[1], *az = acc[2];
+
+    symmetric_kernel<T> kernel = kernel_set(kernel_table(isa), T()).symmetric[fastRsqrt ? 1 : 0];
+    ForceConst<T> fc = {(T)G, (T)softeningSquared, (T)get_dt()};
+
+    // at least two tiles per thread, so every round has work for all of them
+    int tile = std::min(SYMMETRIC_TILE, padded / (2 * omp_get_num_threads()));
+    tile = std::max(PARTICLE_PADDING, tile / PARTICLE_PADDING * PARTICLE_PADDING);
+    int tiles = (padded + tile - 1) / tile;
+    int slots = tiles + (tiles & 1);    // odd tile counts get a bye
+
+    auto make_tile = [&](int t) {
+        int b = t * tile;
+        ForceTile<T> ft = {px + b, py + b, pz + b, mass + b,
+            accel ? ax + b : nullptr, ay + b, az + b, energy ? pe + b : nullptr, std::min(tile, padded - b)};
+        return ft;
+    };
+
+    #pragma omp for schedule(static)
+    for (int i = 0; i < padded; i++) {
+        if (accel)
+            ax[i] = ay[i] = az[i] = 0.;
+        if (energy)
+            pe[i] = 0.;
+    }
+
+    #pragma omp for schedule(dynamic, 1)
+    for (int t = 0; t < tiles; t++)
+        kernel(make_tile(t), make_tile(t), fc, true);
+
+    // circle method: slot slots - 1 stays, the others rotate by one per round
+    for (int round = 0; round < slots - 1; round++) {
+        #pragma omp for schedule(dynamic, 1)
+        for (int k = 0; k < slots / 2; k++) {
+            int a = k == 0 ? slots - 1 : (round + k) % (slots - 1);
+            int b = (round - k + slots - 1) % (slots - 1);
+            if (a < tiles && b < tiles)
+                kernel(make_tile(a), make_tile(b), fc, false);
+        }
+    }
+}
+
+double GSimulation::forces_tree(bool accel, double* pairs) {
     int n = get_count();
-	real_type dt = get_dt();
+    real_type *mass = particles.mass;
 
-	// prevents explosion in the case the particles are really close to each other 
-	kEnergy = 0.;
-	pEnergy = 0.;
+    _octree->build(particles.pos[0], particles.pos[1], particles.pos[2], mass, n, theta);
+    *pairs = _octree->evaluate(G, softeningSquared,
+        accel ? particles.acc[0] : nullptr, particles.acc[1], particles.acc[2], particles.pEnergy);
 
-    double _tKe = 0.;
     double _tPe = 0.;
+    #pragma omp parallel for reduction(+ : _tPe)
+    for (int i = 0; i < n; i++) {
+        particles.pEnergy[i] *= mass[i];
+        _tPe += particles.pEnergy[i] * .5;
+    }
 
-	#pragma omp parallel for reduction(+ : _tKe, _tPe)
-	for (int i = 0; i < n; ++i) { // update position and velocity 
-		particles[i].kEnergy = particles[i].mass * (
-			particles[i].vel[0] * particles[i].vel[0] +
-			particles[i].vel[1] * particles[i].vel[1] +
-			particles[i].vel[2] * particles[i].vel[2]
-			) * .5;
+    return _tPe;
+}
 
-		_tKe += particles[i].kEnergy;
+double GSimulation::forces_fmm(bool accel, double* pairs) {
+    int n = get_count();
+    real_type *mass = particles.mass;
 
-		particles[i].pEnergy = 0.;
+    _fmm->order = fmmOrder;
+    _fmm->theta = theta;
+    *pairs = _fmm->evaluate(particles.pos[0], particles.pos[1], particles.pos[2], mass, n, G, softeningSquared,
+        accel ? particles.acc[0] : nullptr, particles.acc[1], particles.acc[2], particles.pEnergy);
 
-		for (int j = 0; j < n; j++) {
-			if (i == j)
-				continue;
+    double _tPe = 0.;
+    #pragma omp parallel for reduction(+ : _tPe)
+    for (int i = 0; i < n; i++) {
+        particles.pEnergy[i] *= mass[i];
+        _tPe += particles.pEnergy[i] * .5;
+    }
 
-			real_type dx, dy, dz;
-            real_type _dx, _dy, _dz;
-			real_type distanceSqr = 0.0;
-			real_type distanceInv = 0.0;
+    return _tPe;
+}
 
-			dx = particles[j].pos[0] - particles[i].pos[0];	//1flop
-			dy = particles[j].pos[1] - particles[i].pos[1];	//1flop	
-			dz = particles[j].pos[2] - particles[i].pos[2];	//1flop
+double GSimulation::forces_mesh(bool accel, double* pairs) {
+    int n = get_count();
+    real_type *mass = particles.mass;
 
-			distanceSqr = dx * dx + dy * dy + dz * dz;	//6flops
+    _mesh->grid = meshGrid;
+    _mesh->assignment = meshAssignment;
+    _mesh->shortRange = solver == Solver_P3M;
+    *pairs = _mesh->evaluate(particles.pos[0], particles.pos[1], particles.pos[2], mass, n, G, softeningSquared,
+        accel ? particles.acc[0] : nullptr, particles.acc[1], particles.acc[2], particles.pEnergy);
+    meshGrid = _mesh->grid;
 
-			double _distanceSqr = distanceSqr;
-			//FAILSAFE part 1
-			if (distanceSqr <= softeningSquared)
-				_distanceSqr = softeningSquared;	//6flops
+    double _tPe = 0.;
+    #pragma omp parallel for reduction(+ : _tPe)
+    for (int i = 0; i < n; i++) {
+        particles.pEnergy[i] *= mass[i];
+        _tPe += particles.pEnergy[i] * .5;
+    }
 
-			distanceInv = 1.0 / sqrt(_distanceSqr);			//1div+1sqrt
-            real_type force1 = G * particles[j].mass * distanceInv * distanceInv * distanceInv; //* 0.5;
-			particles[i].pEnergy -= force1 * particles[i].mass * (_distanceSqr); //* 0.5;
+    return _tPe;
+}
 
-            /*
-            //2nd part
-            real_type tmpAcc[3];
-            real_type tmpVel[3];
-            real_type tmpPos[3];
+void GSimulation::force_error(int samples, double* rms, double* max) {
+    int n = get_count();
+    samples = std::max(1, std::min(samples, n));
+
+    real_type *px = particles.pos[0], *py = particles.pos[1], *pz = particles.pos[2];
+    real_type *mass = particles.mass;
+
+    // Before the first tick (and after a load or an edit) acc is not the
+    // solver's yet, init_pos() fills it with random values. Measure a force
+    // pass of its own then, and put acc back so the run does not change.
+    const bool stale = _integratorState < 0;
+    std::vector<real_type> saved;
+    double savedInteractions = interactions;
+    if (stale) {
+        saved.resize((size_t)n * 3);
+        for (int k = 0; k < 3; k++)
+            std::copy(particles.acc[k], particles.acc[k] + n, saved.begin() + (size_t)k * n);
+        if (integrator == Integrator_Hermite4) {
+            double pairs;
+            forces_symmetric(true, false, &pairs);
+        } else
+            forces(false);
+    }
 
-            tmpAcc[0] = dx * (force1);
-            tmpAcc[1] = dy * (force1);
-            tmpAcc[2] = dz * (force1);
+    double errSqr = 0., refSqr = 0., errMax = 0.;
+
+    #pragma omp parallel for reduction(+ : errSqr, refSqr) reduction(max : errMax)
+    for (int s = 0; s < samples; s++) {
+        int i = (int)((int64_t)s * n / samples);
+
+        double ref[3] = {0., 0., 0.};
+        for (int j = 0; j < n; j++) {
+            if (i == j)
+                continue;
+            double dx = px[j] - px[i];
+            double dy = py[j] - py[i];
+            double dz = pz[j] - pz[i];
+            double distanceSqr = std::max(dx * dx + dy * dy + dz * dz, softeningSquared);
+            double distanceInv = 1.0 / sqrt(distanceSqr);
+            double force = G * mass[j] * distanceInv * distanceInv * distanceInv;
+            ref[0] += dx * force;
+            ref[1] += dy * force;
+            ref[2] += dz * force;
+        }
 
-            tmpVel[0] = particles[i].vel[0] + tmpAcc[0] * dt;// *.5;
-            tmpVel[1] = particles[i].vel[1] + tmpAcc[1] * dt;// * .5;
-            tmpVel[2] = particles[i].vel[2] + tmpAcc[2] * dt;// * .5;
+        double e = 0., r = 0.;
+        for (int k = 0; k < 3; k++) {
+            double d = particles.acc[k][i] - ref[k];
+            e += d * d;
+            r += ref[k] * ref[k];
+        }
+        errSqr += e;
+        refSqr += r;
+        if (r > 0.)
+            errMax = std::max(errMax, sqrt(e / r));
+    }
 
-            tmpPos[0] = particles[i].pos[0] + tmpVel[0] * dt;// * .5;
-            tmpPos[1] = particles[i].pos[1] + tmpVel[1] * dt;// * .5;
-            tmpPos[2] = particles[i].pos[2] + tmpVel[2] * dt;// *.5;
+    *rms = refSqr > 0. ? sqrt(errSqr / refSqr) : 0.;
+    *max = errMax;
 
-            _dx = particles[j].pos[0] - tmpPos[0];	//1flop
-            _dy = particles[j].pos[1] - tmpPos[1];	//1flop	
-            _dz = particles[j].pos[2] - tmpPos[2];	//1flop
+    if (stale) {
+        for (int k = 0; k < 3; k++)
+            std::copy(saved.begin() + (size_t)k * n, saved.begin() + (size_t)(k + 1) * n, particles.acc[k]);
+        interactions = savedInteractions;
+    }
+}
 
-            _distanceSqr = _dx*_dx + _dy*_dy + _dz*_dz;	//6flops
+double GSimulation::kinetic_energy() {
+    PROFILE_PHASE(Phase_Energy);
+    int n = get_count();
+    double _tKe = 0.;
 
-            //FAILSAFE part 2
-            if (_distanceSqr <= softeningSquared)
-				_distanceSqr = softeningSquared;	//6flops
+    real_type *vx = particles.vel[0], *vy = particles.vel[1], *vz = particles.vel[2];
+    real_type *mass = particles.mass;
 
-            //real_type force2 = 0.;
-            //_distanceSqr *= 4.;
-            distanceInv = 1.0 / sqrt(_distanceSqr);			//1div+1sqrt
-            real_type force2 = G * particles[j].mass * distanceInv * distanceInv * distanceInv;
-            particles[i].pEnergy -= .5 * force2 * particles[i].mass * (_distanceSqr);
-            */
-		}
-		_tPe += particles[i].pEnergy * .5;
+    #pragma omp parallel for reduction(+ : _tKe)
+    for (int i = 0; i < n; ++i) {
+        particles.kEnergy[i] = mass[i] * (vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i]) * .5;
+        _tKe += particles.kEnergy[i];
     }
 
-    kEnergy = _tKe;
-    pEnergy = _tPe;
-	fEnergy = pEnergy + kEnergy;
+    return _tKe;
 }
 
-void GSimulation::save_state() {
-    auto fptr = fopen("state.bin", "wb");
-
-    if (fptr == NULL)
-        return;
+void GSimulation::update_energy() {
+    PROFILE_PHASE(Phase_Energy);
 
-    fwrite(&_ncount, sizeof(int32_t), 1, fptr);
-    fwrite(&tickCount, sizeof(int32_t), 1, fptr);
-    fwrite(&elapsedTime, sizeof(real_type), 1, fptr);
-    fwrite(&_initialEnergy, sizeof(real_type), 1, fptr);
+	kEnergy = 0.;
+	pEnergy = 0.;
 
-    for (int i = 0; i < get_count(); i++) {
-        fwrite(&particles[i], sizeof(struct Particle), 1, fptr);
+    double _tKe = kinetic_energy();
+
+    // potential only, the accelerations of the last tick stay as they are.
+    // Hermite steps sample the direct potential, the energies they are
+    // compared with have to come from the same.
+    double pairs;
+    switch (forces_solver()) {
+        case Solver_BarnesHut:
+            pEnergy = forces_tree(false, &pairs);
+            break;
+        case Solver_FMM:
+            pEnergy = forces_fmm(false, &pairs);
+            break;
+        case Solver_PM:
+        case Solver_P3M:
+            pEnergy = forces_mesh(false, &pairs);
+            break;
+        default:
+            pEnergy = forces_symmetric(false, true, &pairs);
+            break;
     }
 
-    fclose(fptr);
+    kEnergy = _tKe;
+	fEnergy = pEnergy + kEnergy;
+    energyTick = tickCount;
 }
 
-void GSimulation::read_state() {
-    auto fptr = fopen("state.bin", "rb");
+bool GSimulation::save_state(const char* path, bool compress, std::string* error) {
+    PROFILE_PHASE(Phase_IO);
+    CheckpointHeader meta;
+    std::memset(&meta, 0, sizeof(meta));
+    meta.realSize = sizeof(real_type);
+    meta.count = _ncount;
+    meta.tickCount = tickCount;
+    meta.seed = _nseed;
+    meta.rng = _nrng;
+    meta.elapsedTime = elapsedTime;
+    meta.dTime = dTime;
+    meta.initialEnergy = _initialEnergy;
+    meta.maxMass = _nmaxmass;
+
+    const CheckpointType real = sizeof(real_type) == 8 ? Checkpoint_Float64 : Checkpoint_Float32;
+    const CheckpointSource columns[] = {
+        {"pos_x", real, 1, particles.pos[0]}, {"pos_y", real, 1, particles.pos[1]}, {"pos_z", real, 1, particles.pos[2]},
+        {"vel_x", real, 1, particles.vel[0]}, {"vel_y", real, 1, particles.vel[1]}, {"vel_z", real, 1, particles.vel[2]},
+        {"acc_x", real, 1, particles.acc[0]}, {"acc_y", real, 1, particles.acc[1]}, {"acc_z", real, 1, particles.acc[2]},
+        {"mass", real, 1, particles.mass},
+        {"color", Checkpoint_Float32, 3, particles.color},
+        {"id", Checkpoint_Int32, 1, particles.id},
+    };
+    return checkpoint_write(path, meta, columns, sizeof(columns) / sizeof(columns[0]),
+                            compress ? Checkpoint_ShuffleLZ : Checkpoint_Raw, error);
+}
 
-    if (fptr == NULL)
-        return;
+bool GSimulation::read_state(const char* path, std::string* error) {
+    PROFILE_PHASE(Phase_IO);
+    if (!checkpoint_probe(path))
+        return read_legacy_state(path, error);
+
+    CheckpointFile file;
+    if (!file.open(path, error))
+        return false;
+    const CheckpointHeader& h = file.header();
+    if (h.count > INT32_MAX - 64) {
+        if (error)
+            *error = std::string("too many bodies in ") + path;
+        return false;
+    }
+    // version 1 predates the choice of generator
+    const int generator = h.version >= 2 ? (int)h.rng : Rng_MT19937;
+    if (generator < 0 || generator >= Rng_Count) {
+        if (error)
+            *error = std::string("unknown generator in ") + path;
+        return false;
+    }
+
+    const CheckpointType real = sizeof(real_type) == 8 ? Checkpoint_Float64 : Checkpoint_Float32;
+    struct Target {
+        const char* name;
+        CheckpointType type;
+        void* data;
+    };
+    // the columns are checked, then decoded into a scratch array, a bad
+    // file leaves the state alone
+    const char* names[] = {"pos_x", "pos_y", "pos_z", "vel_x", "vel_y", "vel_z",
+                           "acc_x", "acc_y", "acc_z", "mass", "color", "id"};
+    for (const char* name : names) {
+        const CheckpointColumn* column = file.find(name);
+        if (!column || column->components != (strcmp(name, "color") ? 1u : 3u)) {
+            if (error)
+                *error = std::string("checkpoint ") + path + (column ? " has a malformed column " : " has no column ") + name;
+            return false;
+        }
+    }
+
+    const int32_t n = (int32_t)h.count;
+    ParticleArray loaded;
+    loaded.allocate(n);
+    const Target targets[] = {
+        {"pos_x", real, loaded.pos[0]}, {"pos_y", real, loaded.pos[1]}, {"pos_z", real, loaded.pos[2]},
+        {"vel_x", real, loaded.vel[0]}, {"vel_y", real, loaded.vel[1]}, {"vel_z", real, loaded.vel[2]},
+        {"acc_x", real, loaded.acc[0]}, {"acc_y", real, loaded.acc[1]}, {"acc_z", real, loaded.acc[2]},
+        {"mass", real, loaded.mass},
+        {"color", Checkpoint_Float32, loaded.color},
+        {"id", Checkpoint_Int32, loaded.id},
+    };
+    for (const Target& t : targets)
+        if (!file.read(file.find(t.name), t.data, t.type, error))
+            return false;
+    for (int i = 0; i < n; i++)
+        loaded.slot[i] = -1;
+    for (int i = 0; i < n; i++) {
+        int32_t b = loaded.id[i];
+        if (b < 0 || b >= n || loaded.slot[b] >= 0) {
+            if (error)
+                *error = std::string("corrupt body ids in ") + path;
+            return false;
+        }
+        loaded.slot[b] = i;
+    }
 
-    fread(&_ncount, sizeof(int32_t), 1, fptr);
-    fread(&tickCount, sizeof(int32_t), 1, fptr);
-    fread(&elapsedTime, sizeof(real_type), 1, fptr);
-    fread(&_initialEnergy, sizeof(real_type), 1, fptr);
+    particles.swap(loaded);
+    _ncount = count = n;
+    _integratorState = -1;
+    tickCount = h.tickCount;
+    seed = _nseed = h.seed;
+    rng = _nrng = generator;
+    elapsedTime = h.elapsedTime;
+    dTime = h.dTime;
+    maxMass = _nmaxmass = h.maxMass;
 
-    remove();
-    particles = new Particle[get_count()];
+    update_energy();
+    _initialEnergy = h.initialEnergy;
+    return true;
+}
 
-    for (int i = 0; i < get_count(); i++) {
-        fread(&particles[i], sizeof(struct Particle), 1, fptr);
+// Headerless dumps of the builds before checkpoints: count, tick, time,
+// energy, then one packed Particle record per body.
+#pragma pack(push, 1)
+struct LegacyParticle {
+    real_type pos[3];
+    real_type vel[3];
+    real_type acc[3];
+    real_type mass;
+    float color[3];
+    real_type kEnergy;
+    real_type pEnergy;
+};
+#pragma pack(pop)
+
+bool GSimulation::read_legacy_state(const char* path, std::string* error) {
+    auto fptr = fopen(path, "rb");
+
+    if (fptr == NULL) {
+        if (error)
+            *error = std::string("cannot open ") + path + ": " + strerror(errno);
+        return false;
     }
 
+    int32_t n = 0, tick = 0;
+    real_type time = 0., energy = 0.;
+    const long headerBytes = sizeof(int32_t) * 2 + sizeof(real_type) * 2;
+    size_t got = fread(&n, sizeof(int32_t), 1, fptr);
+    got += fread(&tick, sizeof(int32_t), 1, fptr);
+    got += fread(&time, sizeof(real_type), 1, fptr);
+    got += fread(&energy, sizeof(real_type), 1, fptr);
+    long bytes = fseek(fptr, 0, SEEK_END) == 0 ? ftell(fptr) : -1;
+    // the size has to be that of n records exactly, anything else is not a dump
+    if (got != 4 || n < 0 || n > INT32_MAX - 64
+     || bytes != headerBytes + (long)n * (long)sizeof(LegacyParticle)) {
+        fclose(fptr);
+        if (error)
+            *error = std::string("not a state file: ") + path;
+        return false;
+    }
+    fseek(fptr, headerBytes, SEEK_SET);
+
+    ParticleArray loaded;
+    loaded.allocate(n);
+    std::vector<LegacyParticle> records(std::min(n, 65536));
+    for (int done = 0; done < n; ) {
+        int batch = std::min(n - done, (int)records.size());
+        if (fread(records.data(), sizeof(LegacyParticle), batch, fptr) != (size_t)batch) {
+            fclose(fptr);
+            if (error)
+                *error = std::string("truncated state file: ") + path;
+            return false;
+        }
+        for (int r = 0; r < batch; r++) {
+            const LegacyParticle& p = records[r];
+            int i = done + r;
+            for (int k = 0; k < 3; k++) {
+                loaded.pos[k][i] = p.pos[k];
+                loaded.vel[k][i] = p.vel[k];
+                loaded.acc[k][i] = p.acc[k];
+                loaded.color[i * 3 + k] = p.color[k];
+            }
+            loaded.mass[i] = p.mass;
+        }
+        done += batch;
+    }
     fclose(fptr);
 
+    particles.swap(loaded);
+    _ncount = count = n;
+    _integratorState = -1;
+    tickCount = tick;
+    elapsedTime = time;
+    rng = _nrng = Rng_MT19937;
+
     update_energy();
     _initialEnergy = fEnergy;
+    return true;
 }
 
 GSimulation::~GSimulation() {
-    delete particles;
+    remove();
+    delete _octree;
+    delete _fmm;
+    delete _mesh;
+    delete _hermite;
+    delete _replica;
 }
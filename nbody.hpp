@@ -2,6 +2,11 @@
 #define GSIMULATION_HPP_
 
 #include <omp.h>
+#include <cstdint>
+#include <cmath>
+#include <string>
+
+#include "nbody_kernel.hpp"
 
 typedef double real_type;
 #define ImGuiDataType_Real ImGuiDataType_Double
@@ -9,22 +14,118 @@ typedef double real_type;
 //typedef float real_type;
 //#define ImGuiDataType_Real ImGuiDataType_Float
 
-#pragma pack(push, 1)
-struct Particle {
-    real_type pos[3];
-    real_type vel[3];
-    real_type acc[3];  
-    real_type mass;
-    float color[3]; 
+// Force engines GSimulation::tick() can run
+enum Solver {
+    Solver_Direct = 0,      // all pairs, predictor scheme under the legacy integrator
+    Solver_DirectSymmetric, // all pairs once each, plain softened gravity
+    Solver_BarnesHut,       // octree monopoles, plain softened gravity
+    Solver_FMM,             // fast multipole method, plain softened gravity
+    Solver_PM,              // particle-mesh, open boundaries, resolution of a few cells
+    Solver_P3M,             // particle-mesh plus direct short range part
+    Solver_Count
+};
+
+extern const char* const solverNames[Solver_Count];
+
+// Arithmetic used by a tick. The state columns are always real_type, in
+// float mode the integrator rounds them to float every step. Energy sums
+// are taken in double in every mode.
+enum Precision {
+    Precision_Double = 0,   // everything double
+    Precision_Float,        // float state and float forces
+    Precision_Mixed,        // double state, float SIMD forces
+    Precision_Count
+};
+
+extern const char* const precisionNames[Precision_Count];
+
+// Time integration of a tick
+enum Integrator {
+    Integrator_Legacy = 0,  // kick, drift, forces; predictor pairs with the direct solver
+    Integrator_Leapfrog,    // kick-drift-kick, second order symplectic
+    Integrator_Yoshida4,    // three leapfrog sub-steps, fourth order symplectic
+    Integrator_Hermite4,    // predictor-corrector on acceleration and jerk, direct forces
+    Integrator_Count
+};
+
+extern const char* const integratorNames[Integrator_Count];
 
-    real_type kEnergy;
-    real_type pEnergy;
+// Generator of the initial conditions
+enum Rng {
+    Rng_Philox = 0,         // counter based, parallel and the same on any thread count
+    Rng_MT19937,            // the serial mt19937 sequences of earlier versions
+    Rng_Count
+};
+
+extern const char* const rngNames[Rng_Count];
+
+// hue in degrees, saturation and value in [0, 1]
+void hsv2rgb(float hue, float saturation, float value, float* r, float* g, float* b);
+
+class Octree;
+class Fmm;
+class ParticleMesh;
+class BlockHermite;
+class NumaReplica;
+
+// Columns are aligned to a cache line and padded to a whole number of
+// AVX-512 float lanes, so vector loops can safely run over the padded tail.
+#define PARTICLE_ALIGNMENT 64
+#define PARTICLE_PADDING   16
+
+// Structure-of-arrays particle storage.
+// pos/vel/acc/mass are the hot columns streamed by the force loop,
+// colors and per-particle energies are cold and only touched by
+// diagnostics and the GUI. Padding entries have zero mass.
+// Bodies can move between slots (see permute()), id and slot map
+// between a slot and the body's stable number.
+class ParticleArray {
+    public:
+        real_type *pos[3];
+        real_type *vel[3];
+        real_type *acc[3];
+        real_type *mass;
+
+        float *color;       // packed rgb triplets
+        real_type *kEnergy;
+        real_type *pEnergy;
+
+        // float copies and accumulators of the single precision kernels
+        float *posF[3];
+        float *massF;
+        float *accF[3];
+        float *peF;
+
+        int32_t *id;        // body in a slot
+        int32_t *slot;      // slot of a body
+
+        ParticleArray();
+        ~ParticleArray();
+        ParticleArray(const ParticleArray&) = delete;
+        ParticleArray& operator=(const ParticleArray&) = delete;
+
+        void allocate(int32_t count);
+        void release();
+        // Slot i takes the body of slot order[i]. The float columns are
+        // scratch of the force pass and are not carried along.
+        void permute(const int32_t* order);
+        // Exchanges the blocks, loaders fill a scratch array and swap it in.
+        void swap(ParticleArray& other);
+
+        int32_t size()   {return _count;}
+        int32_t padded() {return _padded;}
+    private:
+        int32_t _count;
+        int32_t _padded;
+        size_t _bytes;
+        void *_block;
+        void carve(char* ptr);
 };
-#pragma pack(pop)
 
 class GSimulation {
     public:
         int32_t seed;
+        int rng;                    // one of Rng, the generator init() draws from
         int32_t count;
         real_type maxMass;
 
@@ -38,8 +139,35 @@ class GSimulation {
         real_type kEnergy;
         real_type pEnergy;
         real_type fEnergy;
+        int32_t energyEvery;        // energies are sampled every energyEvery ticks
+        int32_t energyTick;         // tick the energies above belong to
 
         double computeTime;
+        double interactions;        // pair evaluations done by the last tick
+        double interactionRate;     // interactions per second of the last tick
+
+        int solver;                 // one of Solver
+        real_type theta;            // Barnes-Hut opening angle, FMM acceptance
+        int fmmOrder;               // FMM expansion order
+        int meshGrid;               // PM cells per axis, a power of two
+        int meshAssignment;         // PM mass assignment, MeshAssignment
+        int tileI, tileJ;           // direct solver blocking, 0 streams all of j for every i
+        int precision;              // one of Precision, forces only for the direct solvers
+
+        bool replicate;             // direct solver rows read a copy of j on their NUMA node
+        int reorderEvery;           // Morton reorder of the bodies every reorderEvery ticks, 0 never
+        int reorderCount;           // reorder passes so far
+        double reorderTime;         // seconds of the last reorder pass
+        double reorderTotal;        // seconds of all reorder passes
+        double reorderGain;         // mean tick time before a reorder over the one after it
+
+        KernelIsa isa;              // KernelIsa_Auto picks the best one from CPUID
+        bool fastRsqrt;             // rsqrt estimate + Newton instead of 1/sqrt
+
+        int integrator;             // one of Integrator
+        bool blockSteps;            // Hermite with individual block steps instead of a shared one
+        real_type eta;              // block step accuracy parameter
+        int maxLevel;               // block steps go down to dTime / 2^maxLevel
 
         GSimulation();
         ~GSimulation();
@@ -48,34 +176,130 @@ class GSimulation {
         void init_color();
 
         void tick();
+        // Runs ticks ticks, timed like tickTimed(). The direct solvers in
+        // double under the legacy and leapfrog integrators run them in one
+        // parallel region; computeTime is then the mean of the batch. The
+        // bodies move exactly as under tick(), the energies can differ in
+        // the last bits on more than one thread: the batch adds up its per
+        // thread sums in thread order, tick() leaves that to reduction(+).
+        void run(int ticks);
 
         void rewrite_initialEnergy() { update_energy(); _initialEnergy = fEnergy; }
+        // The integrators carry accelerations, jerks and levels from one tick
+        // to the next, call after editing bodies.
+        void restart_integrator() { _integratorState = -1; }
+        BlockHermite* block_stepper() {return _hermite;}
 
         void tickTimed() {
             double startTime = omp_get_wtime();
             tick();
             double endTime = omp_get_wtime();
             computeTime = endTime - startTime;
+            interactionRate = computeTime > 0. ? interactions / computeTime : 0.;
+
+            // the gain compares the ticks around a reorder, without the pass itself
+            if (_reordered)
+                _reorderBefore = computeTime - reorderTime;
+            else
+                measure_gain(computeTime);
         }
 
-        Particle* getPtr();
+        ParticleArray* getPtr();
         int get_count()      {return _ncount;}
         real_type get_dt()   {return dTime;}
         real_type get_mass() {return _nmaxmass;}
+        int get_rng()        {return _nrng;}
+
+        // Solver and precision the forces of a tick come from. Hermite steps
+        // run plain direct forces in double whatever solver and precision say.
+        int forces_solver()    { return integrator == Integrator_Hermite4 ? Solver_DirectSymmetric : solver; }
+        int forces_precision() { return integrator == Integrator_Hermite4 ? Precision_Double : precision; }
+
+        real_type energy_deviation() { return fabs((_initialEnergy - fEnergy) * -100. / _initialEnergy); }
+
+        // Runs the force pass of the current solver on the current state,
+        // without advancing it, and returns interactions per second.
+        double measure_forces();
 
-        real_type energy_deviation() { return abs((_initialEnergy - fEnergy) * -100. / _initialEnergy); }
+        // Flops per interaction of the force kernel the current settings
+        // run, energy ticks weighed in, 0 for solvers without a count.
+        double flops_per_interaction();
 
-        void save_state();
-        void read_state();
+        // Relative error of the last tick's accelerations against a direct sum
+        // of the same softened gravity, measured on evenly spaced sample bodies.
+        // Before a first tick it measures a force pass of its own.
+        void force_error(int samples, double* rms, double* max);
+
+        // Checkpoints, see checkpoint.hpp. read_state() also takes the
+        // headerless dumps of older builds. False with a message in error
+        // when the file could not be written or read.
+        bool save_state(const char* path = "state.bin", bool compress = false, std::string* error = nullptr);
+        bool read_state(const char* path = "state.bin", std::string* error = nullptr);
     private:
         int _ncount;
         int _nseed;
+        int _nrng;
         real_type _nmaxmass;
         real_type _initialEnergy;
-        Particle *particles;
+        ParticleArray particles;
+        Octree *_octree;
+        Fmm *_fmm;
+        ParticleMesh *_mesh;
+        BlockHermite *_hermite;
+        NumaReplica *_replica;
+        int _integratorState;       // integrator the carried state belongs to, -1 for none
+        bool _reordered;            // the last tick ended with a reorder
+        double _reorderBefore;      // tick time before the last reorder, 0 once measured
+        double _gainSum;
+        int _gainCount;
         void init_pos();
         void init_mass();
+        bool read_legacy_state(const char* path, std::string* error);
+        void reorder();
+        bool team_ticks();
+        // Seconds of the first and the last tick of the batch in first and last.
+        void run_team(int ticks, double* first, double* last);
+        // A tick after a reorder, against the one before it.
+        void measure_gain(double tickTime) {
+            if (_reorderBefore > 0.) {
+                _gainSum += _reorderBefore / tickTime;
+                _gainCount++;
+                reorderGain = _gainSum / _gainCount;
+                _reorderBefore = 0.;
+            }
+        }
+        // Phases of run_team(), worksharing loops every thread of the team
+        // calls. They end on a barrier and return the sum over all threads.
+        double team_advance(real_type kick, real_type drift, double* partial);
+        double team_predictor(bool energy, double* partial);
+        double team_symmetric(bool energy, double* partial);
+        template<typename T> void symmetric_pass(T* const pos[3], T* mass, T* const acc[3], T* pe, bool accel, bool energy);
         void update_energy();
+        double kinetic_energy();
+        bool single_forces() {
+            return precision != Precision_Double && (solver == Solver_Direct || solver == Solver_DirectSymmetric);
+        }
+        void to_single();
+
+        template<typename I> double integrate(bool sample, double* ke);
+        double integrate_hermite(bool sample, double* ke);
+        template<typename T> double advance(real_type kick, real_type drift);
+        // Force pass of the current solver, returns the potential energy.
+        // Without energy the direct solvers skip the potential in the kernel
+        // and return 0.
+        double forces(bool energy);
+        double forces_direct(bool energy);
+        template<typename T> double forces_direct(T* const pos[3], const T* mass, bool energy);
+        template<typename T> double forces_direct_tiled(T* const pos[3], const T* mass,
+                                                        predictor_kernel<T> row, const ForceConst<T>& fc, bool energy);
+        template<typename T> double forces_direct_replicated(T* const pos[3], const T* mass,
+                                                             predictor_kernel<T> row, const ForceConst<T>& fc, bool energy);
+        double forces_symmetric(bool accel, bool energy, double* pairs);
+        template<typename T> double forces_symmetric(T* const pos[3], T* mass, T* const acc[3], T* pe,
+                                                     bool accel, bool energy, double* pairs);
+        double forces_tree(bool accel, double* pairs);
+        double forces_fmm(bool accel, double* pairs);
+        double forces_mesh(bool accel, double* pairs);
         //void update_acc(real_type dTime);
         //void update_vel(real_type dTime);
         //void update_pos(real_type dTime);
@@ -0,0 +1,63 @@
+#include <cpuid.h>
+#include "nbody_simd.hpp"
+
+NBODY_KERNEL_TABLE(kernel_table_scalar, "scalar", vscalar<double>, vscalar<float>)
+
+const KernelTable& kernel_table_avx2();
+const KernelTable& kernel_table_avx512();
+
+static uint64_t xgetbv0() {
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+}
+
+static KernelIsa detect_once() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return KernelIsa_Scalar;
+
+    bool fma     = ecx & (1u << 12);
+    bool osxsave = ecx & (1u << 27);
+    if (!osxsave)
+        return KernelIsa_Scalar;
+
+    // the OS has to save ymm (and zmm/opmask) state on context switch
+    uint64_t xcr0 = xgetbv0();
+    bool ymmState = (xcr0 & 0x6) == 0x6;
+    bool zmmState = (xcr0 & 0xE6) == 0xE6;
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return KernelIsa_Scalar;
+
+    bool avx2    = ebx & (1u << 5);
+    bool avx512f = ebx & (1u << 16);
+
+    if (!avx2 || !fma || !ymmState)
+        return KernelIsa_Scalar;
+    if (!avx512f || !zmmState)
+        return KernelIsa_AVX2;
+    return KernelIsa_AVX512;
+}
+
+KernelIsa kernel_detect() {
+    // initialised once, threads calling in at the same time wait for it
+    static const KernelIsa detected = detect_once();
+    return detected;
+}
+
+const char* kernel_isa_name(KernelIsa isa) {
+    return kernel_table(isa).name;
+}
+
+const KernelTable& kernel_table(KernelIsa isa) {
+    KernelIsa best = kernel_detect();
+    if (isa == KernelIsa_Auto || isa > best)
+        isa = best;
+
+    switch (isa) {
+        case KernelIsa_AVX512: return kernel_table_avx512();
+        case KernelIsa_AVX2:   return kernel_table_avx2();
+        default:               return kernel_table_scalar();
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef NBODY_KERNEL_HPP_
+#define NBODY_KERNEL_HPP_
+
+#include <cstdint>
+
+// Instruction sets the force kernels are built for.
+// Every set lives in its own translation unit compiled with matching
+// flags, the one to use is picked at runtime from CPUID.
+enum KernelIsa {
+    KernelIsa_Auto = -1,
+    KernelIsa_Scalar = 0,
+    KernelIsa_AVX2,
+    KernelIsa_AVX512,
+    KernelIsa_Count
+};
+
+// j-side columns streamed by a kernel.
+// count has to be a multiple of PARTICLE_PADDING, unused tail entries
+// must have zero mass so they contribute nothing.
+template<typename T>
+struct ForceSource {
+    const T *x, *y, *z;
+    const T *mass;
+    int32_t count;
+    int32_t offset;     // global index of element 0, used to skip the i == j pair
+};
+
+// i-side state, kept in registers for the whole row
+template<typename T>
+struct ForceTarget {
+    T x, y, z;
+    T vx, vy, vz;
+    int32_t index;
+};
+
+// One tile of the symmetric kernel, read as both source and target.
+// Results are added to the accumulators, pe per unit of own mass.
+// count has to be a multiple of PARTICLE_PADDING. ax/ay/az may be null
+// when only the potential is wanted, pe when only forces are.
+template<typename T>
+struct ForceTile {
+    const T *x, *y, *z;
+    const T *mass;
+    T *ax, *ay, *az;
+    T *pe;
+    int32_t count;
+};
+
+template<typename T>
+struct ForceConst {
+    T G;
+    T softeningSquared;
+    T dt;
+};
+
+// Accumulates the row of the predictor scheme used by GSimulation::tick()
+// into acc[3] and pe. pe is the potential per unit of i mass, null on
+// ticks that only need forces.
+template<typename T>
+using predictor_kernel = void (*)(const ForceSource<T>& src, const ForceTarget<T>& tgt,
+                                  const ForceConst<T>& c, T acc[3], T* pe);
+
+// Plain softened gravity between two tiles, every pair evaluated once and
+// applied with opposite signs to both ends. With same, a and b are one
+// tile and only j > i is visited. The caller makes sure no other thread
+// writes the accumulators of either tile meanwhile.
+template<typename T>
+using symmetric_kernel = void (*)(const ForceTile<T>& a, const ForceTile<T>& b,
+                                  const ForceConst<T>& c, bool same);
+
+// Flops of one pair evaluation as annotated in nbody_simd.hpp, a max and a
+// reciprocal square root counting one each. A symmetric pair serves the
+// interactions of both ends.
+#define PREDICTOR_FLOPS 56
+#define PREDICTOR_ENERGY_FLOPS 4
+#define SYMMETRIC_FLOPS 28
+#define SYMMETRIC_ENERGY_FLOPS 2
+
+template<typename T>
+struct KernelSet {
+    predictor_kernel<T> predictor[2];   // [exact, rsqrt+newton]
+    symmetric_kernel<T> symmetric[2];
+};
+
+struct KernelTable {
+    const char *name;
+    int width;                          // double lanes
+    KernelSet<double> d;
+    KernelSet<float> f;
+};
+
+KernelIsa kernel_detect();
+const char* kernel_isa_name(KernelIsa isa);
+// falls back to the best supported set when isa is not available
+const KernelTable& kernel_table(KernelIsa isa);
+
+inline const KernelSet<double>& kernel_set(const KernelTable& t, double) { return t.d; }
+inline const KernelSet<float>&  kernel_set(const KernelTable& t, float)  { return t.f; }
+
+#endif
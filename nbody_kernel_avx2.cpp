@@ -0,0 +1,4 @@
+// Built with -mavx2 -mfma, only called when CPUID reports both.
+#include "nbody_simd.hpp"
+
+NBODY_KERNEL_TABLE(kernel_table_avx2, "avx2", vd4, vf8)
@@ -0,0 +1,4 @@
+// Built with -mavx512f, only called when CPUID and the OS report AVX-512 state.
+#include "nbody_simd.hpp"
+
+NBODY_KERNEL_TABLE(kernel_table_avx512, "avx512", vd8, vf16)
@@ -0,0 +1,387 @@
+#ifndef NBODY_SIMD_HPP_
+#define NBODY_SIMD_HPP_
+
+// Thin vector wrappers and the kernel bodies written against them.
+// Only included by the nbody_kernel_*.cpp units, each compiled with the
+// flags of its instruction set, so the wrappers available depend on
+// which of __AVX2__/__AVX512F__ are defined.
+
+#include <cmath>
+#include <algorithm>
+#include <immintrin.h>
+
+#include "nbody_kernel.hpp"
+
+// Everything below has internal linkage: the same inline wrappers are
+// compiled with different ISA flags in every unit and must not be merged
+// by the linker.
+namespace {
+
+// one lane, used by the scalar fallback
+template<typename T>
+struct vscalar {
+    typedef T scalar;
+    typedef bool mask;
+    static constexpr int width = 1;
+    T v;
+
+    static vscalar load(const T* p)  { return {*p}; }
+    void store(T* p) const           { *p = v; }
+    static vscalar set1(T a)         { return {a}; }
+    static vscalar zero()            { return {0}; }
+    static mask lane_except(int)     { return false; }
+    static mask lane_after(int)      { return false; }
+    static mask all()                { return true; }
+    friend vscalar operator+(vscalar a, vscalar b) { return {a.v + b.v}; }
+    friend vscalar operator-(vscalar a, vscalar b) { return {a.v - b.v}; }
+    friend vscalar operator*(vscalar a, vscalar b) { return {a.v * b.v}; }
+    friend vscalar max(vscalar a, vscalar b)       { return {a.v > b.v ? a.v : b.v}; }
+    friend mask cmple(vscalar a, vscalar b)        { return a.v <= b.v; }
+    static mask mask_andnot(mask a, mask b)        { return !a && b; }   // ~a & b
+    static mask mask_and(mask a, mask b)           { return a && b; }
+    friend vscalar select(mask m, vscalar a)       { return {m ? a.v : T(0)}; }
+    friend vscalar rsqrt_exact(vscalar a)          { return {T(1) / std::sqrt(a.v)}; }
+    friend vscalar rsqrt_fast(vscalar a)           { return {T(1) / std::sqrt(a.v)}; }
+    friend T reduce_add(vscalar a)                 { return a.v; }
+};
+
+#ifdef __AVX2__
+struct vd4 {
+    typedef double scalar;
+    typedef __m256d mask;
+    static constexpr int width = 4;
+    __m256d v;
+
+    static vd4 load(const double* p) { return {_mm256_load_pd(p)}; }
+    void store(double* p) const      { _mm256_store_pd(p, v); }
+    static vd4 set1(double a)        { return {_mm256_set1_pd(a)}; }
+    static vd4 zero()                { return {_mm256_setzero_pd()}; }
+    static mask lane_except(int lane) {
+        return _mm256_cmp_pd(_mm256_set_pd(3, 2, 1, 0), _mm256_set1_pd(lane), _CMP_NEQ_OQ);
+    }
+    static mask lane_after(int lane) {
+        return _mm256_cmp_pd(_mm256_set_pd(3, 2, 1, 0), _mm256_set1_pd(lane), _CMP_GT_OQ);
+    }
+    static mask all()                { return _mm256_castsi256_pd(_mm256_set1_epi64x(-1)); }
+    friend vd4 operator+(vd4 a, vd4 b) { return {_mm256_add_pd(a.v, b.v)}; }
+    friend vd4 operator-(vd4 a, vd4 b) { return {_mm256_sub_pd(a.v, b.v)}; }
+    friend vd4 operator*(vd4 a, vd4 b) { return {_mm256_mul_pd(a.v, b.v)}; }
+    friend vd4 max(vd4 a, vd4 b)       { return {_mm256_max_pd(a.v, b.v)}; }
+    friend mask cmple(vd4 a, vd4 b)    { return _mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ); }
+    static mask mask_andnot(mask a, mask b) { return _mm256_andnot_pd(a, b); }
+    static mask mask_and(mask a, mask b)    { return _mm256_and_pd(a, b); }
+    friend vd4 select(mask m, vd4 a)   { return {_mm256_and_pd(m, a.v)}; }
+    friend vd4 rsqrt_exact(vd4 a)      { return {_mm256_div_pd(_mm256_set1_pd(1.), _mm256_sqrt_pd(a.v))}; }
+    friend vd4 rsqrt_fast(vd4 a) {
+        // 12 bit estimate from the float unit, two Newton steps bring it to ~46 bits
+        __m256d y = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(a.v)));
+        __m256d h = _mm256_mul_pd(a.v, _mm256_set1_pd(.5));
+        for (int k = 0; k < 2; k++)
+            y = _mm256_mul_pd(y, _mm256_fnmadd_pd(h, _mm256_mul_pd(y, y), _mm256_set1_pd(1.5)));
+        return {y};
+    }
+    friend double reduce_add(vd4 a) {
+        __m128d s = _mm_add_pd(_mm256_castpd256_pd128(a.v), _mm256_extractf128_pd(a.v, 1));
+        return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+    }
+};
+
+struct vf8 {
+    typedef float scalar;
+    typedef __m256 mask;
+    static constexpr int width = 8;
+    __m256 v;
+
+    static vf8 load(const float* p)  { return {_mm256_load_ps(p)}; }
+    void store(float* p) const       { _mm256_store_ps(p, v); }
+    static vf8 set1(float a)         { return {_mm256_set1_ps(a)}; }
+    static vf8 zero()                { return {_mm256_setzero_ps()}; }
+    static mask lane_except(int lane) {
+        return _mm256_cmp_ps(_mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0), _mm256_set1_ps(lane), _CMP_NEQ_OQ);
+    }
+    static mask lane_after(int lane) {
+        return _mm256_cmp_ps(_mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0), _mm256_set1_ps(lane), _CMP_GT_OQ);
+    }
+    static mask all()                { return _mm256_castsi256_ps(_mm256_set1_epi32(-1)); }
+    friend vf8 operator+(vf8 a, vf8 b) { return {_mm256_add_ps(a.v, b.v)}; }
+    friend vf8 operator-(vf8 a, vf8 b) { return {_mm256_sub_ps(a.v, b.v)}; }
+    friend vf8 operator*(vf8 a, vf8 b) { return {_mm256_mul_ps(a.v, b.v)}; }
+    friend vf8 max(vf8 a, vf8 b)       { return {_mm256_max_ps(a.v, b.v)}; }
+    friend mask cmple(vf8 a, vf8 b)    { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+    static mask mask_andnot(mask a, mask b) { return _mm256_andnot_ps(a, b); }
+    static mask mask_and(mask a, mask b)    { return _mm256_and_ps(a, b); }
+    friend vf8 select(mask m, vf8 a)   { return {_mm256_and_ps(m, a.v)}; }
+    friend vf8 rsqrt_exact(vf8 a)      { return {_mm256_div_ps(_mm256_set1_ps(1.f), _mm256_sqrt_ps(a.v))}; }
+    friend vf8 rsqrt_fast(vf8 a) {
+        __m256 y = _mm256_rsqrt_ps(a.v);
+        __m256 h = _mm256_mul_ps(a.v, _mm256_set1_ps(.5f));
+        y = _mm256_mul_ps(y, _mm256_fnmadd_ps(h, _mm256_mul_ps(y, y), _mm256_set1_ps(1.5f)));
+        return {y};
+    }
+    friend float reduce_add(vf8 a) {
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(a.v), _mm256_extractf128_ps(a.v, 1));
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehdup_ps(s)));
+    }
+};
+#endif
+
+#ifdef __AVX512F__
+struct vd8 {
+    typedef double scalar;
+    typedef __mmask8 mask;
+    static constexpr int width = 8;
+    __m512d v;
+
+    static vd8 load(const double* p) { return {_mm512_load_pd(p)}; }
+    void store(double* p) const      { _mm512_store_pd(p, v); }
+    static vd8 set1(double a)        { return {_mm512_set1_pd(a)}; }
+    static vd8 zero()                { return {_mm512_setzero_pd()}; }
+    static mask lane_except(int lane) { return (mask)~(1u << lane); }
+    static mask lane_after(int lane) { return (mask)(0xFFu << (lane + 1)); }
+    static mask all()                { return (mask)0xFF; }
+    friend vd8 operator+(vd8 a, vd8 b) { return {_mm512_add_pd(a.v, b.v)}; }
+    friend vd8 operator-(vd8 a, vd8 b) { return {_mm512_sub_pd(a.v, b.v)}; }
+    friend vd8 operator*(vd8 a, vd8 b) { return {_mm512_mul_pd(a.v, b.v)}; }
+    friend vd8 max(vd8 a, vd8 b)       { return {_mm512_max_pd(a.v, b.v)}; }
+    friend mask cmple(vd8 a, vd8 b)    { return _mm512_cmp_pd_mask(a.v, b.v, _CMP_LE_OQ); }
+    static mask mask_andnot(mask a, mask b) { return (mask)(~a & b); }
+    static mask mask_and(mask a, mask b)    { return (mask)(a & b); }
+    friend vd8 select(mask m, vd8 a)   { return {_mm512_maskz_mov_pd(m, a.v)}; }
+    friend vd8 rsqrt_exact(vd8 a)      { return {_mm512_div_pd(_mm512_set1_pd(1.), _mm512_sqrt_pd(a.v))}; }
+    friend vd8 rsqrt_fast(vd8 a) {
+        // 14 bit estimate, two Newton steps give full double precision
+        __m512d y = _mm512_rsqrt14_pd(a.v);
+        __m512d h = _mm512_mul_pd(a.v, _mm512_set1_pd(.5));
+        for (int k = 0; k < 2; k++)
+            y = _mm512_mul_pd(y, _mm512_fnmadd_pd(h, _mm512_mul_pd(y, y), _mm512_set1_pd(1.5)));
+        return {y};
+    }
+    friend double reduce_add(vd8 a)    { return _mm512_reduce_add_pd(a.v); }
+};
+
+struct vf16 {
+    typedef float scalar;
+    typedef __mmask16 mask;
+    static constexpr int width = 16;
+    __m512 v;
+
+    static vf16 load(const float* p) { return {_mm512_load_ps(p)}; }
+    void store(float* p) const       { _mm512_store_ps(p, v); }
+    static vf16 set1(float a)        { return {_mm512_set1_ps(a)}; }
+    static vf16 zero()               { return {_mm512_setzero_ps()}; }
+    static mask lane_except(int lane) { return (mask)~(1u << lane); }
+    static mask lane_after(int lane) { return (mask)(0xFFFFu << (lane + 1)); }
+    static mask all()                { return (mask)0xFFFF; }
+    friend vf16 operator+(vf16 a, vf16 b) { return {_mm512_add_ps(a.v, b.v)}; }
+    friend vf16 operator-(vf16 a, vf16 b) { return {_mm512_sub_ps(a.v, b.v)}; }
+    friend vf16 operator*(vf16 a, vf16 b) { return {_mm512_mul_ps(a.v, b.v)}; }
+    friend vf16 max(vf16 a, vf16 b)       { return {_mm512_max_ps(a.v, b.v)}; }
+    friend mask cmple(vf16 a, vf16 b)     { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ); }
+    static mask mask_andnot(mask a, mask b) { return (mask)(~a & b); }
+    static mask mask_and(mask a, mask b)    { return (mask)(a & b); }
+    friend vf16 select(mask m, vf16 a)    { return {_mm512_maskz_mov_ps(m, a.v)}; }
+    friend vf16 rsqrt_exact(vf16 a)       { return {_mm512_div_ps(_mm512_set1_ps(1.f), _mm512_sqrt_ps(a.v))}; }
+    friend vf16 rsqrt_fast(vf16 a) {
+        __m512 y = _mm512_rsqrt14_ps(a.v);
+        __m512 h = _mm512_mul_ps(a.v, _mm512_set1_ps(.5f));
+        y = _mm512_mul_ps(y, _mm512_fnmadd_ps(h, _mm512_mul_ps(y, y), _mm512_set1_ps(1.5f)));
+        return {y};
+    }
+    friend float reduce_add(vf16 a)       { return _mm512_reduce_add_ps(a.v); }
+};
+#endif
+
+template<typename V, bool Rsqrt>
+inline V inv_sqrt(V a) {
+    return Rsqrt ? rsqrt_fast(a) : rsqrt_exact(a);
+}
+
+// One vector of j for the predictor scheme of GSimulation::tick().
+// Softening is a max() against softeningSquared and the FAILSAFE branches
+// become masks, so the loop has no data dependent control flow.
+template<typename V, bool Rsqrt, bool Energy, bool Self>
+inline void predictor_block(const ForceSource<typename V::scalar>& src, int j,
+        const V* xi, const V* vi, const V& G, const V& soft, const V& dt,
+        typename V::mask self, V* acc, V& pe) {
+    const V half = V::set1(.5);
+
+    V xj = V::load(src.x + j);
+    V yj = V::load(src.y + j);
+    V zj = V::load(src.z + j);
+    V gm = G * V::load(src.mass + j);
+
+    V dx = xj - xi[0];                                      //1flop
+    V dy = yj - xi[1];                                      //1flop
+    V dz = zj - xi[2];                                      //1flop
+    V distanceSqr = dx * dx + dy * dy + dz * dz;            //5flops
+    V inv1 = inv_sqrt<V, Rsqrt>(max(distanceSqr, soft));    //1max+1rsqrt
+    V force1 = gm * inv1 * inv1 * inv1;                     //3flops
+
+    // predicted position of i under the pull of j alone
+    V tx = xi[0] + (vi[0] + dx * force1 * dt) * dt;         //5flops
+    V ty = xi[1] + (vi[1] + dy * force1 * dt) * dt;         //5flops
+    V tz = xi[2] + (vi[2] + dz * force1 * dt) * dt;         //5flops
+
+    V _dx = xj - tx;                                        //1flop
+    V _dy = yj - ty;                                        //1flop
+    V _dz = zj - tz;                                        //1flop
+    V _distanceSqr = _dx * _dx + _dy * _dy + _dz * _dz;     //5flops
+    V inv2 = inv_sqrt<V, Rsqrt>(max(_distanceSqr, soft));   //1max+1rsqrt
+    V force2 = gm * inv2 * inv2 * inv2;                     //3flops
+
+    // FAILSAFE part 3: both ends inside the softening radius
+    typename V::mask keep = V::mask_andnot(V::mask_and(cmple(distanceSqr, soft), cmple(_distanceSqr, soft)), V::all());
+    if (Self)
+        keep = V::mask_and(keep, self);
+    if (Energy) {
+        V e = (gm * inv1 + gm * inv2) * half;               //4flops
+        if (Self)
+            e = select(self, e);
+        pe = pe - e;
+    }
+    acc[0] = acc[0] + select(keep, (dx * force1 + _dx * force2) * half);   //5flops
+    acc[1] = acc[1] + select(keep, (dy * force1 + _dy * force2) * half);   //5flops
+    acc[2] = acc[2] + select(keep, (dz * force1 + _dz * force2) * half);   //5flops
+}
+
+template<typename V, bool Rsqrt, bool Energy>
+void predictor_rows(const ForceSource<typename V::scalar>& src, const ForceTarget<typename V::scalar>& tgt,
+        const ForceConst<typename V::scalar>& c, typename V::scalar acc[3], typename V::scalar* pe) {
+    const int W = V::width;
+
+    V xi[3] = {V::set1(tgt.x), V::set1(tgt.y), V::set1(tgt.z)};
+    V vi[3] = {V::set1(tgt.vx), V::set1(tgt.vy), V::set1(tgt.vz)};
+    V G = V::set1(c.G);
+    V soft = V::set1(c.softeningSquared);
+    V dt = V::set1(c.dt);
+
+    V a[3] = {V::zero(), V::zero(), V::zero()};
+    V e = V::zero();
+
+    // the vector holding i itself is the only one that needs a lane mask
+    int local = tgt.index - src.offset;
+    int selfBlock = (local >= 0 && local < src.count) ? local / W * W : src.count;
+    int selfEnd = std::min(selfBlock + W, src.count);
+
+    for (int j = 0; j < selfBlock; j += W)
+        predictor_block<V, Rsqrt, Energy, false>(src, j, xi, vi, G, soft, dt, V::all(), a, e);
+    if (selfBlock < src.count)
+        predictor_block<V, Rsqrt, Energy, true>(src, selfBlock, xi, vi, G, soft, dt, V::lane_except(local - selfBlock), a, e);
+    for (int j = selfEnd; j < src.count; j += W)
+        predictor_block<V, Rsqrt, Energy, false>(src, j, xi, vi, G, soft, dt, V::all(), a, e);
+
+    acc[0] += reduce_add(a[0]);
+    acc[1] += reduce_add(a[1]);
+    acc[2] += reduce_add(a[2]);
+    if (Energy)
+        *pe += reduce_add(e);
+}
+
+// pe may be null, the potential is then left out of the loop
+template<typename V, bool Rsqrt>
+void predictor_row(const ForceSource<typename V::scalar>& src, const ForceTarget<typename V::scalar>& tgt,
+        const ForceConst<typename V::scalar>& c, typename V::scalar acc[3], typename V::scalar* pe) {
+    if (pe)
+        predictor_rows<V, Rsqrt, true>(src, tgt, c, acc, pe);
+    else
+        predictor_rows<V, Rsqrt, false>(src, tgt, c, acc, pe);
+}
+
+// One vector of j against a single i of the symmetric kernel.
+// i keeps its sums in registers, the j side is loaded, updated and stored.
+template<typename V, bool Rsqrt, bool Accel, bool Energy, bool Masked>
+inline void symmetric_block(const ForceTile<typename V::scalar>& b, int j,
+        const V* xi, const V& gmi, const V& G, const V& soft,
+        typename V::mask lanes, V* acc, V& pe) {
+    V dx = V::load(b.x + j) - xi[0];                        //1flop
+    V dy = V::load(b.y + j) - xi[1];                        //1flop
+    V dz = V::load(b.z + j) - xi[2];                        //1flop
+    V gmj = G * V::load(b.mass + j);                        //1flop
+    V distanceSqr = dx * dx + dy * dy + dz * dz;            //5flops
+    V inv = inv_sqrt<V, Rsqrt>(max(distanceSqr, soft));     //1max+1rsqrt
+
+    V ei = gmj * inv;                                       //1flop
+    V ej = gmi * inv;                                       //1flop
+    if (Masked) {
+        ei = select(lanes, ei);
+        ej = select(lanes, ej);
+    }
+    if (Energy) {
+        pe = pe - ei;                                       //1flop
+        (V::load(b.pe + j) - ej).store(b.pe + j);           //1flop
+    }
+
+    if (Accel) {
+        V inv2 = inv * inv;                                 //1flop
+        V fi = ei * inv2;                                   //1flop
+        V fj = ej * inv2;                                   //1flop
+        acc[0] = acc[0] + dx * fi;                          //2flops
+        acc[1] = acc[1] + dy * fi;                          //2flops
+        acc[2] = acc[2] + dz * fi;                          //2flops
+        (V::load(b.ax + j) - dx * fj).store(b.ax + j);      //2flops
+        (V::load(b.ay + j) - dy * fj).store(b.ay + j);      //2flops
+        (V::load(b.az + j) - dz * fj).store(b.az + j);      //2flops
+    }
+}
+
+template<typename V, bool Rsqrt, bool Accel, bool Energy>
+void symmetric_rows(const ForceTile<typename V::scalar>& a, const ForceTile<typename V::scalar>& b,
+        const ForceConst<typename V::scalar>& c, bool same) {
+    const int W = V::width;
+    V G = V::set1(c.G);
+    V soft = V::set1(c.softeningSquared);
+
+    for (int i = 0; i < a.count; i++) {
+        V xi[3] = {V::set1(a.x[i]), V::set1(a.y[i]), V::set1(a.z[i])};
+        V gmi = V::set1(c.G * a.mass[i]);
+        V acc[3] = {V::zero(), V::zero(), V::zero()};
+        V pe = V::zero();
+
+        // inside one tile the vector holding i only takes the lanes after it
+        int j = 0;
+        if (same) {
+            int block = i / W * W;
+            symmetric_block<V, Rsqrt, Accel, Energy, true>(b, block, xi, gmi, G, soft, V::lane_after(i - block), acc, pe);
+            j = block + W;
+        }
+        for (; j < b.count; j += W)
+            symmetric_block<V, Rsqrt, Accel, Energy, false>(b, j, xi, gmi, G, soft, V::all(), acc, pe);
+
+        if (Accel) {
+            a.ax[i] += reduce_add(acc[0]);
+            a.ay[i] += reduce_add(acc[1]);
+            a.az[i] += reduce_add(acc[2]);
+        }
+        if (Energy)
+            a.pe[i] += reduce_add(pe);
+    }
+}
+
+template<typename V, bool Rsqrt>
+void symmetric_tiles(const ForceTile<typename V::scalar>& a, const ForceTile<typename V::scalar>& b,
+        const ForceConst<typename V::scalar>& c, bool same) {
+    if (a.ax && a.pe)
+        symmetric_rows<V, Rsqrt, true, true>(a, b, c, same);
+    else if (a.ax)
+        symmetric_rows<V, Rsqrt, true, false>(a, b, c, same);
+    else
+        symmetric_rows<V, Rsqrt, false, true>(a, b, c, same);
+}
+
+} // namespace
+
+// Fills a KernelTable from the double and float vector types of one ISA.
+#define NBODY_KERNEL_TABLE(tableName, isaName, VD, VF)                   \
+    const KernelTable& tableName() {                                    \
+        static const KernelTable table = {                              \
+            isaName, VD::width,                                         \
+            {{predictor_row<VD, false>, predictor_row<VD, true>},       \
+             {symmetric_tiles<VD, false>, symmetric_tiles<VD, true>}},  \
+            {{predictor_row<VF, false>, predictor_row<VF, true>},       \
+             {symmetric_tiles<VF, false>, symmetric_tiles<VF, true>}},  \
+        };                                                              \
+        return table;                                                   \
+    }
+
+#endif
@@ -0,0 +1,186 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <omp.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "numa.hpp"
+
+// "0-3,8,10-11" as written in sysfs cpulist files
+static void parse_cpulist(const char* text, std::vector<int>& cpus) {
+    const char* p = text;
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p)
+            break;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long c = first; c <= last; c++)
+            cpus.push_back((int)c);
+        if (*p == ',')
+            p++;
+        else
+            break;
+    }
+}
+
+static NumaTopology numa_detect() {
+    NumaTopology topo;
+    topo.nodes = 0;
+    topo.cpus = 0;
+
+    std::vector<std::vector<int>> nodeCpus;
+    // node numbers can have holes, stop after a run of missing ones
+    for (int node = 0, missing = 0; missing < 64; node++) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* f = fopen(path, "r");
+        if (!f) {
+            missing++;
+            continue;
+        }
+        missing = 0;
+
+        char line[4096] = {0};
+        if (fgets(line, sizeof(line), f)) {
+            std::vector<int> cpus;
+            parse_cpulist(line, cpus);
+            if (!cpus.empty()) {
+                nodeCpus.push_back(cpus);
+                for (int c : cpus)
+                    topo.cpus = std::max(topo.cpus, c + 1);
+            }
+        }
+        fclose(f);
+    }
+
+    if (nodeCpus.empty()) {
+        topo.nodes = 1;
+        topo.cpus = omp_get_num_procs();
+        topo.nodeOfCpu.assign(topo.cpus, 0);
+        return topo;
+    }
+
+    // memory only nodes were skipped above, the rest are numbered densely
+    topo.nodes = (int)nodeCpus.size();
+    topo.nodeOfCpu.assign(topo.cpus, -1);
+    for (int node = 0; node < topo.nodes; node++)
+        for (int c : nodeCpus[node])
+            topo.nodeOfCpu[c] = node;
+    return topo;
+}
+
+const NumaTopology& numa_topology() {
+    static NumaTopology topo = numa_detect();
+    return topo;
+}
+
+int numa_node_of_thread() {
+    const NumaTopology& topo = numa_topology();
+    if (topo.nodes <= 1)
+        return 0;
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    if (cpu >= 0 && cpu < topo.cpus && topo.nodeOfCpu[cpu] >= 0)
+        return topo.nodeOfCpu[cpu];
+#endif
+    return 0;
+}
+
+void numa_report(FILE* out) {
+    const NumaTopology& topo = numa_topology();
+    const char* binds[] = {"false", "true", "master", "close", "spread"};
+    int bind = (int)omp_get_proc_bind();
+
+    std::vector<int> threadsOnNode(topo.nodes, 0);
+    int threads = 1;
+    #pragma omp parallel
+    {
+        int node = numa_node_of_thread();
+        #pragma omp atomic
+        threadsOnNode[node]++;
+        #pragma omp single
+        threads = omp_get_num_threads();
+    }
+
+    fprintf(out, "Topology: %d NUMA node%s, %d cpus, %d threads, bind %s, %d places, threads per node",
+        topo.nodes, topo.nodes == 1 ? "" : "s", topo.cpus, threads,
+        bind >= 0 && bind < 5 ? binds[bind] : "?", omp_get_num_places());
+    for (int node = 0; node < topo.nodes; node++)
+        fprintf(out, "%s%d", node ? "/" : " ", threadsOnNode[node]);
+    fprintf(out, "\n");
+}
+
+NumaReplica::NumaReplica() {
+    _count = 0;
+    _bytes = 0;
+}
+
+NumaReplica::~NumaReplica() {
+    release();
+}
+
+void NumaReplica::release() {
+    for (char* c : _copies)
+        std::free(c);
+    _copies.clear();
+    _columns.clear();
+}
+
+void* const* NumaReplica::refresh(const void* const* columns, int count, size_t bytes) {
+    const int nodes = numa_topology().nodes;
+    const int t = omp_get_thread_num();
+    const int nt = omp_get_num_threads();
+    const size_t line = 64;
+
+    #pragma omp single
+    {
+        size_t rounded = (bytes + line - 1) / line * line;
+        if (rounded != _bytes || count != _count || (int)_copies.size() != nodes) {
+            release();
+            _bytes = rounded;
+            _count = count;
+            // not touched here, the first write below places the pages
+            for (int node = 0; node < nodes; node++) {
+                char* block = (char*)std::aligned_alloc(line, _bytes * count);
+                _copies.push_back(block);
+                for (int c = 0; c < count; c++)
+                    _columns.push_back(block + _bytes * c);
+            }
+        }
+        _nodeOfThread.assign(nt, 0);
+    }
+
+    int node = numa_node_of_thread();
+    _nodeOfThread[t] = node;
+    #pragma omp barrier
+
+    // this thread's share of its node's copy, in whole cache lines
+    int rank = 0, peers = 0;
+    for (int u = 0; u < nt; u++) {
+        if (_nodeOfThread[u] != node)
+            continue;
+        if (u < t)
+            rank++;
+        peers++;
+    }
+    size_t lines = (bytes + line - 1) / line;
+    size_t begin = std::min(bytes, lines * rank / peers * line);
+    size_t end = std::min(bytes, lines * (rank + 1) / peers * line);
+
+    void* const* copy = &_columns[(size_t)node * count];
+    for (int c = 0; c < count; c++)
+        if (end > begin)
+            std::memcpy((char*)copy[c] + begin, (const char*)columns[c] + begin, end - begin);
+
+    #pragma omp barrier
+    return copy;
+}
@@ -0,0 +1,50 @@
+#ifndef NUMA_HPP_
+#define NUMA_HPP_
+
+#include <vector>
+#include <cstddef>
+#include <cstdio>
+
+// NUMA nodes and their cpus as Linux lists them under
+// /sys/devices/system/node. Machines without that tree are one node.
+struct NumaTopology {
+    int nodes;
+    int cpus;                       // highest online cpu + 1
+    std::vector<int> nodeOfCpu;     // cpu -> node, -1 for cpus not listed
+};
+
+// Read once on first use.
+const NumaTopology& numa_topology();
+
+// Node of the cpu the calling thread runs on. Only stable while the thread
+// is bound (OMP_PROC_BIND), a migrated thread reads remote memory but still
+// gets correct data.
+int numa_node_of_thread();
+
+// Nodes, cpus, OpenMP binding, places and threads per node, on one line.
+void numa_report(FILE* out = stdout);
+
+// Per node copies of columns that a force pass only reads. Every node's copy
+// is written by the threads running on it, so its pages sit on that node.
+class NumaReplica {
+    public:
+        NumaReplica();
+        ~NumaReplica();
+        NumaReplica(const NumaReplica&) = delete;
+        NumaReplica& operator=(const NumaReplica&) = delete;
+
+        // Called by every thread of a team. Copies count columns of bytes
+        // each into the copy of the calling thread's node, split among the
+        // threads of that node, and returns the copied columns. Ends on a barrier.
+        void* const* refresh(const void* const* columns, int count, size_t bytes);
+    private:
+        int _count;
+        size_t _bytes;                  // per column, rounded up to a cache line
+        std::vector<char*> _copies;     // one block per node
+        std::vector<void*> _columns;    // node * _count + column
+        std::vector<int> _nodeOfThread;
+
+        void release();
+};
+
+#endif
@@ -0,0 +1,238 @@
+#include <cmath>
+#include <algorithm>
+#include <omp.h>
+
+#include "octree.hpp"
+#include "morton.hpp"
+
+// subtrees smaller than this are built by the task that found them
+#define OCTREE_TASK_THRESHOLD 4096
+
+Octree::Octree() {
+    leafSize = 16;
+    _count = 0;
+    _theta = .5;
+    _nodeCount = 0;
+    _size = 1.;
+    _origin[0] = _origin[1] = _origin[2] = 0.;
+}
+
+void Octree::build(const real_type* x, const real_type* y, const real_type* z, const real_type* mass,
+                   int n, real_type theta) {
+    _count = n;
+    _theta = theta;
+
+    _keys.resize(n);
+    _tmpKeys.resize(n);
+    _order.resize(n);
+    _tmpOrder.resize(n);
+    for (int k = 0; k < 4; k++)
+        _sorted[k].resize(n);
+    _nodes.resize(std::max(1, 2 * n));
+
+    morton_bounds(x, y, z, n, _origin, &_size);
+    morton_keys(x, y, z, n, _origin, _size, _keys.data());
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++)
+        _order[i] = i;
+
+    radix_sort(_keys.data(), _order.data(), n, _tmpKeys.data(), _tmpOrder.data());
+
+    // bodies are copied in curve order, a leaf is then one contiguous run
+    #pragma omp parallel for schedule(static)
+    for (int s = 0; s < n; s++) {
+        int i = _order[s];
+        _sorted[0][s] = x[i];
+        _sorted[1][s] = y[i];
+        _sorted[2][s] = z[i];
+        _sorted[3][s] = mass[i];
+    }
+
+    _nodeCount = 1;
+    if (n == 0) {
+        _nodes[0] = OctreeNode();
+        _nodes[0].child = -1;
+        return;
+    }
+
+    #pragma omp parallel
+    #pragma omp single
+    build_node(0, 0, n, 0);
+}
+
+void Octree::build_node(int node, int begin, int end, int depth) {
+    OctreeNode& nd = _nodes[node];
+    const uint64_t* keys = _keys.data();
+
+    nd.begin = begin;
+    nd.end = end;
+    nd.child = -1;
+    nd.childCount = 0;
+
+    // collapse the chain of cells that hold every body of the range
+    auto digit = [&](uint64_t key, int d) { return (int)(key >> (3 * (MORTON_BITS - 1 - d))) & 7; };
+    while (depth < MORTON_BITS && digit(keys[begin], depth) == digit(keys[end - 1], depth))
+        depth++;
+
+    nd.size = _size / (real_type)(1u << depth);
+    for (int k = 0; k < 3; k++) {
+        uint32_t cell = depth ? morton_decode_axis(keys[begin], k) >> (MORTON_BITS - depth) : 0;
+        nd.center[k] = _origin[k] + ((real_type)cell + .5) * nd.size;
+    }
+
+    if (end - begin <= leafSize || depth == MORTON_BITS) {
+        finish_node(node);
+        return;
+    }
+
+    int bounds[9];
+    bounds[0] = begin;
+    for (int oct = 1; oct < 8; oct++)
+        bounds[oct] = (int)(std::lower_bound(keys + bounds[oct - 1], keys + end, oct,
+            [&](uint64_t key, int o) { return digit(key, depth) < o; }) - keys);
+    bounds[8] = end;
+
+    int children = 0;
+    for (int oct = 0; oct < 8; oct++)
+        if (bounds[oct + 1] > bounds[oct])
+            children++;
+
+    int first = _nodeCount.fetch_add(children);
+    nd.child = first;
+    nd.childCount = children;
+
+    int c = first;
+    for (int oct = 0; oct < 8; oct++) {
+        int b = bounds[oct], e = bounds[oct + 1];
+        if (e == b)
+            continue;
+
+        if (e - b > OCTREE_TASK_THRESHOLD) {
+            #pragma omp task firstprivate(c, b, e)
+            build_node(c, b, e, depth + 1);
+        } else {
+            build_node(c, b, e, depth + 1);
+        }
+        c++;
+    }
+    #pragma omp taskwait
+
+    finish_node(node);
+}
+
+void Octree::finish_node(int node) {
+    OctreeNode& nd = _nodes[node];
+
+    real_type m = 0., cx = 0., cy = 0., cz = 0.;
+    if (nd.child < 0) {
+        for (int s = nd.begin; s < nd.end; s++) {
+            real_type ms = _sorted[3][s];
+            m  += ms;
+            cx += ms * _sorted[0][s];
+            cy += ms * _sorted[1][s];
+            cz += ms * _sorted[2][s];
+        }
+    } else {
+        for (int c = nd.child; c < nd.child + nd.childCount; c++) {
+            const OctreeNode& ch = _nodes[c];
+            m  += ch.mass;
+            cx += ch.mass * ch.com[0];
+            cy += ch.mass * ch.com[1];
+            cz += ch.mass * ch.com[2];
+        }
+    }
+
+    nd.mass = m;
+    if (m > 0.) {
+        nd.com[0] = cx / m;
+        nd.com[1] = cy / m;
+        nd.com[2] = cz / m;
+    } else {
+        for (int k = 0; k < 3; k++)
+            nd.com[k] = nd.center[k];
+    }
+
+    // opening distance grows with the offset of the center of mass from the cell center,
+    // which keeps a body from ever accepting the cell it sits in
+    real_type dx = nd.com[0] - nd.center[0];
+    real_type dy = nd.com[1] - nd.center[1];
+    real_type dz = nd.com[2] - nd.center[2];
+    real_type delta = sqrt(dx * dx + dy * dy + dz * dz);
+    real_type radius = _theta > 0. ? nd.size / _theta + delta : INFINITY;
+    nd.open2 = radius * radius;
+}
+
+double Octree::evaluate(real_type G, real_type softeningSquared,
+                        real_type* ax, real_type* ay, real_type* az, real_type* pe) {
+    const int n = _count;
+    const OctreeNode* nodes = _nodes.data();
+    const real_type *sx = _sorted[0].data(), *sy = _sorted[1].data(), *sz = _sorted[2].data();
+    const real_type *sm = _sorted[3].data();
+
+    double interactions = 0.;
+
+    // neighbouring bodies along the curve walk almost the same nodes
+    #pragma omp parallel for schedule(dynamic, 64) reduction(+ : interactions)
+    for (int s = 0; s < n; s++) {
+        const real_type xi = sx[s], yi = sy[s], zi = sz[s];
+        real_type accX = 0., accY = 0., accZ = 0., phi = 0.;
+        int64_t count = 0;
+
+        int stack[256];
+        int top = 0;
+        stack[top++] = 0;
+
+        while (top > 0) {
+            const OctreeNode& nd = nodes[stack[--top]];
+
+            real_type dx = nd.com[0] - xi;
+            real_type dy = nd.com[1] - yi;
+            real_type dz = nd.com[2] - zi;
+            real_type distanceSqr = dx * dx + dy * dy + dz * dz;
+
+            if (distanceSqr > nd.open2) {
+                // far enough, the cell acts as a single body at its center of mass
+                real_type distanceInv = 1.0 / sqrt(std::max(distanceSqr, softeningSquared));
+                real_type gm = G * nd.mass * distanceInv;
+                real_type force = gm * distanceInv * distanceInv;
+                accX += dx * force;
+                accY += dy * force;
+                accZ += dz * force;
+                phi -= gm;
+                count++;
+            } else if (nd.child < 0) {
+                for (int j = nd.begin; j < nd.end; j++) {
+                    if (j == s)
+                        continue;
+                    real_type ex = sx[j] - xi;
+                    real_type ey = sy[j] - yi;
+                    real_type ez = sz[j] - zi;
+                    real_type d2 = std::max(ex * ex + ey * ey + ez * ez, softeningSquared);
+                    real_type distanceInv = 1.0 / sqrt(d2);
+                    real_type gm = G * sm[j] * distanceInv;
+                    real_type force = gm * distanceInv * distanceInv;
+                    accX += ex * force;
+                    accY += ey * force;
+                    accZ += ez * force;
+                    phi -= gm;
+                }
+                count += nd.end - nd.begin - (s >= nd.begin && s < nd.end);
+            } else {
+                for (int c = nd.child; c < nd.child + nd.childCount; c++)
+                    stack[top++] = c;
+            }
+        }
+
+        int i = _order[s];
+        if (ax) {
+            ax[i] = accX;
+            ay[i] = accY;
+            az[i] = accZ;
+        }
+        pe[i] = phi;
+        interactions += (double)count;
+    }
+
+    return interactions;
+}
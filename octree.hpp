@@ -0,0 +1,64 @@
+#ifndef OCTREE_HPP_
+#define OCTREE_HPP_
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+#include "nbody.hpp"
+
+struct OctreeNode {
+    real_type com[3];       // center of mass
+    real_type mass;
+    real_type center[3];    // geometric center of the cell
+    real_type size;         // cell edge
+    real_type open2;        // nodes closer than sqrt(open2) to a target are opened
+    int32_t child;          // first child, children are contiguous. -1 for leaves
+    int32_t childCount;
+    int32_t begin, end;     // range of bodies in Morton order
+};
+
+// Linear octree over Morton sorted bodies.
+// Chains of single child cells are collapsed, so every inner node has at
+// least two children and the node count stays below 2n.
+class Octree {
+    public:
+        int leafSize;
+
+        Octree();
+
+        // Sorts the bodies along the Morton curve and builds the tree with
+        // OpenMP tasks. theta is the Barnes-Hut opening angle.
+        void build(const real_type* x, const real_type* y, const real_type* z, const real_type* mass,
+                   int n, real_type theta);
+
+        // Barnes-Hut monopole evaluation for every body, in the original order.
+        // acc* may be null when only the potential is wanted. pe receives the
+        // potential per unit of mass. Returns the number of interactions.
+        double evaluate(real_type G, real_type softeningSquared,
+                        real_type* ax, real_type* ay, real_type* az, real_type* pe);
+
+        int node_count()                 {return _nodeCount;}
+        const OctreeNode* nodes()        {return _nodes.data();}
+        // bodies in Morton order, index is the original body
+        const int32_t* order()           {return _order.data();}
+        const real_type* sorted(int k)   {return _sorted[k].data();}
+        const uint64_t* keys()           {return _keys.data();}
+    private:
+        int _count;
+        real_type _theta;
+        real_type _origin[3];
+        real_type _size;
+
+        std::vector<OctreeNode> _nodes;
+        std::atomic<int> _nodeCount;
+
+        std::vector<uint64_t> _keys, _tmpKeys;
+        std::vector<int32_t> _order, _tmpOrder;
+        std::vector<real_type> _sorted[4];    // x, y, z, mass in Morton order
+
+        void build_node(int node, int begin, int end, int depth);
+        void finish_node(int node);
+};
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef PHILOX_HPP_
+#define PHILOX_HPP_
+
+#include <cstdint>
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1,
+// 2, 3", SC'11): four 32 bit words of random bits out of a 128 bit
+// counter and a 64 bit key. Any element of a stream is computed on its
+// own, so a loop of bodies can hand out counters by body index and get
+// the same numbers on any number of threads.
+
+struct Philox4x32 {
+    uint32_t v[4];
+};
+
+inline Philox4x32 philox4x32(uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3, uint32_t k0, uint32_t k1) {
+    for (int round = 0; round < 10; round++) {
+        const uint64_t p0 = (uint64_t)0xD2511F53u * c0;
+        const uint64_t p1 = (uint64_t)0xCD9E8D57u * c2;
+        const uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        const uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        c0 = n0;
+        c2 = n2;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    Philox4x32 r = {{c0, c1, c2, c3}};
+    return r;
+}
+
+// 53 random bits of two words as a double in [0, 1)
+inline double philox_unit(uint32_t hi, uint32_t lo) {
+    return ((uint64_t)(hi >> 5) * 67108864. + (lo >> 6)) * (1. / 9007199254740992.);
+}
+
+#endif
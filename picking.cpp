@@ -0,0 +1,159 @@
+#include <cmath>
+#include <algorithm>
+
+#include "picking.hpp"
+
+// cells per axis at most, and bodies per cell aimed at
+#define PICK_MAX_DIM 512
+#define PICK_PER_CELL 2
+
+void PickGrid::build(const Snapshot& view, float radius) {
+    const int n = view.count;
+    _pos.assign(view.pos.begin(), view.pos.begin() + (size_t)n * 3);
+    const float* pos = _pos.data();
+    _count = n;
+    _radius = radius;
+    _bodies.clear();
+
+    double lo[3] = {HUGE_VAL, HUGE_VAL, HUGE_VAL};
+    double hi[3] = {-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+    for (int i = 0; i < n; i++)
+        for (int k = 0; k < 3; k++) {
+            if (!std::isfinite(pos[i*3 + k]))
+                continue;
+            lo[k] = std::min(lo[k], (double)pos[i*3 + k]);
+            hi[k] = std::max(hi[k], (double)pos[i*3 + k]);
+        }
+    if (!(lo[0] <= hi[0] && lo[1] <= hi[1] && lo[2] <= hi[2])) {
+        _dims[0] = _dims[1] = _dims[2] = 1;
+        _lo[0] = _lo[1] = _lo[2] = 0.;
+        _cell = 1.;
+        _start.assign(2, 0);
+        return;
+    }
+
+    // cubic cells of about PICK_PER_CELL bodies each over the bounds,
+    // never narrower than a body
+    double extent[3], volume = 1., widest = 0.;
+    for (int k = 0; k < 3; k++) {
+        _lo[k] = lo[k] - radius;
+        extent[k] = std::max(hi[k] - lo[k] + 2. * radius, 1e-6);
+        volume *= extent[k];
+        widest = std::max(widest, extent[k]);
+    }
+    _cell = std::cbrt(volume * PICK_PER_CELL / std::max(n, 1));
+    _cell = std::max(_cell, std::max(2. * radius, widest / PICK_MAX_DIM));
+    for (int k = 0; k < 3; k++)
+        _dims[k] = std::min(PICK_MAX_DIM, std::max(1, (int)std::ceil(extent[k] / _cell)));
+
+    // counting sort of bodies into the cells their boxes touch
+    auto range = [&](int i, int k, int& first, int& last) {
+        double p = pos[i*3 + k];
+        first = std::max(0, (int)std::floor((p - radius - _lo[k]) / _cell));
+        last = std::min(_dims[k] - 1, (int)std::floor((p + radius - _lo[k]) / _cell));
+    };
+    const size_t cells = (size_t)_dims[0] * _dims[1] * _dims[2];
+    _start.assign(cells + 1, 0);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < n; i++) {
+            if (!std::isfinite(pos[i*3]) || !std::isfinite(pos[i*3 + 1]) || !std::isfinite(pos[i*3 + 2]))
+                continue;
+            int x0, x1, y0, y1, z0, z1;
+            range(i, 0, x0, x1);
+            range(i, 1, y0, y1);
+            range(i, 2, z0, z1);
+            for (int z = z0; z <= z1; z++)
+                for (int y = y0; y <= y1; y++)
+                    for (int x = x0; x <= x1; x++) {
+                        if (pass == 0)
+                            _start[cell(x, y, z) + 1]++;
+                        else
+                            _bodies[_start[cell(x, y, z)]++] = i;
+                    }
+        }
+        if (pass == 0) {
+            for (size_t c = 0; c < cells; c++)
+                _start[c + 1] += _start[c];
+            _bodies.resize(_start[cells]);
+        } else {
+            // filling moved every start to the next cell's
+            for (size_t c = cells; c > 0; c--)
+                _start[c] = _start[c - 1];
+            _start[0] = 0;
+        }
+    }
+}
+
+int PickGrid::pick(const double origin[3], const double direction[3]) const {
+    if (_count == 0)
+        return -1;
+    double length = std::sqrt(direction[0]*direction[0] + direction[1]*direction[1] + direction[2]*direction[2]);
+    if (!(length > 0.))
+        return -1;
+    const double d[3] = {direction[0] / length, direction[1] / length, direction[2] / length};
+
+    // where the ray is inside the grid
+    double enter = 0., leave = HUGE_VAL;
+    for (int k = 0; k < 3; k++) {
+        double lo = _lo[k], hi = _lo[k] + _dims[k] * _cell;
+        if (d[k] == 0.) {
+            if (origin[k] < lo || origin[k] > hi)
+                return -1;
+            continue;
+        }
+        double a = (lo - origin[k]) / d[k], b = (hi - origin[k]) / d[k];
+        enter = std::max(enter, std::min(a, b));
+        leave = std::min(leave, std::max(a, b));
+    }
+    if (enter > leave)
+        return -1;
+
+    // walk the cells the ray crosses, in order
+    int c[3], step[3];
+    double next[3], delta[3];
+    for (int k = 0; k < 3; k++) {
+        double p = origin[k] + d[k] * enter;
+        c[k] = std::min(_dims[k] - 1, std::max(0, (int)std::floor((p - _lo[k]) / _cell)));
+        step[k] = d[k] > 0. ? 1 : -1;
+        if (d[k] == 0.) {
+            next[k] = HUGE_VAL;
+            delta[k] = HUGE_VAL;
+        } else {
+            double boundary = _lo[k] + (c[k] + (d[k] > 0. ? 1 : 0)) * _cell;
+            next[k] = (boundary - origin[k]) / d[k];
+            delta[k] = _cell / std::fabs(d[k]);
+        }
+    }
+
+    const float* pos = _pos.data();
+    const double r2 = (double)_radius * _radius;
+    int best = -1;
+    double bestT = HUGE_VAL;
+    for (;;) {
+        const int id = cell(c[0], c[1], c[2]);
+        for (uint32_t e = _start[id]; e < _start[id + 1]; e++) {
+            const int i = _bodies[e];
+            const double oc[3] = {pos[i*3] - origin[0], pos[i*3 + 1] - origin[1], pos[i*3 + 2] - origin[2]};
+            const double b = oc[0]*d[0] + oc[1]*d[1] + oc[2]*d[2];
+            const double disc = r2 - (oc[0]*oc[0] + oc[1]*oc[1] + oc[2]*oc[2] - b * b);
+            if (disc < 0.)
+                continue;
+            double t = b - std::sqrt(disc);
+            if (t < 0.)
+                t = b + std::sqrt(disc);    // from inside the sphere
+            if (t > 0. && t < bestT) {
+                bestT = t;
+                best = i;
+            }
+        }
+
+        // a hit before the ray leaves this cell beats any in later cells
+        const int k = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+        if (best >= 0 && bestT <= next[k])
+            return best;
+        c[k] += step[k];
+        if (c[k] < 0 || c[k] >= _dims[k] || next[k] > leave)
+            return best;
+        next[k] += delta[k];
+    }
+}
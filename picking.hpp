@@ -0,0 +1,39 @@
+#ifndef PICKING_HPP_
+#define PICKING_HPP_
+
+#include <vector>
+#include <cstdint>
+
+#include "sim_thread.hpp"
+
+// Uniform grid over the bodies of a snapshot for picking them with a ray.
+// A body goes into every cell its sphere's bounding box touches, so a ray
+// only looks at the cells it crosses, nearest first, and stops in the
+// first cell that holds a hit.
+class PickGrid {
+    public:
+        PickGrid() : _count(0), _radius(0.f) {}
+
+        // O(n), once per snapshot, whose positions are kept. Bodies are
+        // spheres of radius.
+        void build(const Snapshot& view, float radius);
+        float radius() const {return _radius;}
+
+        // The body id the ray origin + t * direction, t > 0, hits first, or
+        // -1, among the bodies as they were at build().
+        int pick(const double origin[3], const double direction[3]) const;
+
+    private:
+        int _count;
+        float _radius;
+        double _lo[3];
+        double _cell;
+        int _dims[3];
+        std::vector<uint32_t> _start;   // cell -> first entry, one past the last cell at the end
+        std::vector<int> _bodies;       // body ids by cell
+        std::vector<float> _pos;
+
+        int cell(int x, int y, int z) const {return (z * _dims[1] + y) * _dims[0] + x;}
+};
+
+#endif
@@ -0,0 +1,484 @@
+#include <cmath>
+#include <algorithm>
+#include <omp.h>
+
+#include "pm.hpp"
+#include "morton.hpp"
+
+// cells kept free around the bodies: one for the TSC stencil, two for the gradient
+#define PM_MARGIN 3
+#define PM_MIN_GRID 16
+#define PM_MAX_CELLS 128
+
+const char* const meshAssignmentNames[Mesh_Count] = {"cic", "tsc"};
+
+typedef std::complex<double> complex_t;
+
+// In place radix-2 transform of one line, twiddle holds exp(-2 pi i k / n) for k < n / 2
+static void fft_line(complex_t* a, int n, const complex_t* twiddle, const int32_t* bitrev, bool inverse) {
+    for (int i = 0; i < n; i++) {
+        int j = bitrev[i];
+        if (i < j)
+            std::swap(a[i], a[j]);
+    }
+
+    for (int len = 2; len <= n; len <<= 1) {
+        int half = len >> 1;
+        int step = n / len;
+        for (int i = 0; i < n; i += len) {
+            for (int k = 0; k < half; k++) {
+                complex_t w = inverse ? std::conj(twiddle[k * step]) : twiddle[k * step];
+                complex_t u = a[i + k];
+                complex_t v = a[i + k + half] * w;
+                a[i + k] = u + v;
+                a[i + k + half] = u - v;
+            }
+        }
+    }
+}
+
+// First node and weights of the assignment stencil along one axis, u in cells
+static inline int stencil(int assignment, real_type u, real_type w[3]) {
+    if (assignment == Mesh_TSC) {
+        int i = (int)floor(u + .5);
+        real_type d = u - i;
+        w[0] = .5 * (.5 - d) * (.5 - d);
+        w[1] = .75 - d * d;
+        w[2] = .5 * (.5 + d) * (.5 + d);
+        return i - 1;
+    }
+
+    int i = (int)floor(u);
+    real_type d = u - i;
+    w[0] = 1. - d;
+    w[1] = d;
+    w[2] = 0.;
+    return i;
+}
+
+// fourth order central difference
+static inline double gradient(const double* p, size_t s) {
+    return (2. / 3.) * (p[s] - p[-(ptrdiff_t)s]) - (1. / 12.) * (p[2 * s] - p[-2 * (ptrdiff_t)s]);
+}
+
+ParticleMesh::ParticleMesh() {
+    grid = 64;
+    assignment = Mesh_TSC;
+    shortRange = false;
+    split = 1.25;
+    cutoff = 4.5;
+
+    _n = 0;
+    _m = 0;
+    _h = 1.;
+    _origin[0] = _origin[1] = _origin[2] = 0.;
+    _greenSplit = 0.;
+    _greenAssignment = -1;
+    _cells = 1;
+
+#ifdef NBODY_HAVE_FFTW
+    _planned = 0;
+#endif
+}
+
+ParticleMesh::~ParticleMesh() {
+#ifdef NBODY_HAVE_FFTW
+    if (_planned) {
+        #pragma omp critical(fftw_planner)
+        {
+            fftw_destroy_plan(_forward);
+            fftw_destroy_plan(_backward);
+        }
+    }
+#endif
+}
+
+void ParticleMesh::resize(int n) {
+    if (n == _n)
+        return;
+
+    _n = n;
+    _m = 2 * n;
+    size_t padded = (size_t)_m * _m * _m;
+
+    _mesh.assign(padded, 0.);
+    _green.clear();
+    _potential.assign((size_t)_n * _n * _n, 0.);
+
+    _twiddle.resize(_m / 2);
+    for (int k = 0; k < _m / 2; k++)
+        _twiddle[k] = std::polar(1., -2. * M_PI * k / _m);
+
+    int bits = 0;
+    while ((1 << bits) < _m)
+        bits++;
+    _bitrev.resize(_m);
+    for (int i = 0; i < _m; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++)
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        _bitrev[i] = r;
+    }
+
+#ifdef NBODY_HAVE_FFTW
+    // the planner is not thread safe, ensemble runs plan concurrently
+    #pragma omp critical(fftw_planner)
+    {
+        if (_planned) {
+            fftw_destroy_plan(_forward);
+            fftw_destroy_plan(_backward);
+        }
+#ifdef NBODY_HAVE_FFTW_OMP
+        static bool threadsReady = fftw_init_threads() != 0;
+        if (threadsReady)
+            fftw_plan_with_nthreads(omp_in_parallel() ? 1 : omp_get_max_threads());
+#endif
+        fftw_complex* data = reinterpret_cast<fftw_complex*>(_mesh.data());
+        _forward = fftw_plan_dft_3d(_m, _m, _m, data, data, FFTW_FORWARD, FFTW_ESTIMATE);
+        _backward = fftw_plan_dft_3d(_m, _m, _m, data, data, FFTW_BACKWARD, FFTW_ESTIMATE);
+        _planned = 1;
+    }
+#endif
+}
+
+void ParticleMesh::fft(bool inverse, bool pruned) {
+#ifdef NBODY_HAVE_FFTW
+    (void)pruned;
+    fftw_execute(inverse ? _backward : _forward);
+#else
+    const int M = _m;
+    const size_t stride[3] = {1, (size_t)M, (size_t)M * M};
+
+    // Forward, the input is zero outside the first octant; inverse, only the
+    // first octant is read back. Either way a line along an axis only matters
+    // when the coordinates on the axes handled after it (forward) or before
+    // it (inverse) lie inside the physical grid.
+    for (int pass = 0; pass < 3; pass++) {
+        int axis = inverse ? 2 - pass : pass;
+        int b = (axis + 1) % 3, c = (axis + 2) % 3;
+        int nb = pruned && b > axis ? _n : M;
+        int nc = pruned && c > axis ? _n : M;
+
+        #pragma omp parallel
+        {
+            std::vector<complex_t> line(M);
+
+            #pragma omp for collapse(2) schedule(static)
+            for (int ic = 0; ic < nc; ic++) {
+                for (int ib = 0; ib < nb; ib++) {
+                    complex_t* p = _mesh.data() + ib * stride[b] + ic * stride[c];
+                    for (int t = 0; t < M; t++)
+                        line[t] = p[t * stride[axis]];
+                    fft_line(line.data(), M, _twiddle.data(), _bitrev.data(), inverse);
+                    for (int t = 0; t < M; t++)
+                        p[t * stride[axis]] = line[t];
+                }
+            }
+        }
+    }
+#endif
+}
+
+void ParticleMesh::setup_green() {
+    const int M = _m, N = _n;
+    const double rs = split;
+    size_t padded = (size_t)M * M * M;
+
+    // long range part of the split, in cells: -erf(r / 2rs) / r, finite at r = 0
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int c = 0; c < M; c++) {
+        for (int b = 0; b < M; b++) {
+            double dz = c < N ? c : c - M;
+            double dy = b < N ? b : b - M;
+            for (int a = 0; a < M; a++) {
+                double dx = a < N ? a : a - M;
+                double r = sqrt(dx * dx + dy * dy + dz * dz);
+                double g = r > 0. ? -erf(r / (2. * rs)) / r : -1. / (rs * sqrt(M_PI));
+                _mesh[((size_t)c * M + b) * M + a] = g;
+            }
+        }
+    }
+
+    fft(false, false);
+
+    // The kernel is real and even, so is its spectrum. Assignment and
+    // interpolation each smooth with the stencil window, sinc^p per axis,
+    // which is divided out here together with the inverse FFT scale.
+    _green.resize(padded);
+    const int p = assignment == Mesh_TSC ? 3 : 2;
+    const double scale = 1. / (double)padded;
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int c = 0; c < M; c++) {
+        for (int b = 0; b < M; b++) {
+            for (int a = 0; a < M; a++) {
+                size_t i = ((size_t)c * M + b) * M + a;
+                int f[3] = {a < N ? a : a - M, b < N ? b : b - M, c < N ? c : c - M};
+                double window = 1.;
+                for (int k = 0; k < 3; k++) {
+                    double arg = M_PI * f[k] / M;
+                    window *= f[k] ? pow(sin(arg) / arg, p) : 1.;
+                }
+                _green[i] = _mesh[i].real() * scale / (window * window);
+            }
+        }
+    }
+
+    _greenSplit = split;
+    _greenAssignment = assignment;
+}
+
+void ParticleMesh::assign(const real_type* x, const real_type* y, const real_type* z, const real_type* mass, int n) {
+    const int N = _n, M = _m;
+    const int width = assignment == Mesh_TSC ? 3 : 2;
+    const real_type invH = 1. / _h;
+
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < _mesh.size(); i++)
+        _mesh[i] = 0.;
+
+    // bucket bodies by the first x plane of their stencil
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        real_type w[3];
+        int s = stencil(assignment, (x[i] - _origin[0]) * invH, w);
+        _keys[i] = (uint64_t)std::max(0, std::min(s, N - 1));
+        _order[i] = i;
+    }
+    radix_sort(_keys.data(), _order.data(), n, _tmpKeys.data(), _tmpOrder.data());
+
+    _slabStart.resize(N + 1);
+    for (int s = 0; s <= N; s++)
+        _slabStart[s] = (int32_t)(std::lower_bound(_keys.begin(), _keys.begin() + n, (uint64_t)s) - _keys.begin());
+
+    // a stencil spans at most three planes, so slabs three apart never write
+    // the same node: three colors of slabs run one after the other, the slabs
+    // of one color in parallel
+    for (int color = 0; color < 3; color++) {
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int s = color; s < N; s += 3) {
+            for (int k = _slabStart[s]; k < _slabStart[s + 1]; k++) {
+                int i = _order[k];
+                real_type w[3][3];
+                int bx = stencil(assignment, (x[i] - _origin[0]) * invH, w[0]);
+                int by = stencil(assignment, (y[i] - _origin[1]) * invH, w[1]);
+                int bz = stencil(assignment, (z[i] - _origin[2]) * invH, w[2]);
+
+                for (int c = 0; c < width; c++) {
+                    for (int b = 0; b < width; b++) {
+                        complex_t* row = _mesh.data() + ((size_t)(bz + c) * M + (by + b)) * M + bx;
+                        real_type mw = mass[i] * w[2][c] * w[1][b];
+                        for (int a = 0; a < width; a++)
+                            row[a] += mw * w[0][a];
+                    }
+                }
+            }
+        }
+    }
+}
+
+void ParticleMesh::interpolate(const real_type* x, const real_type* y, const real_type* z, const real_type* mass,
+                               int n, real_type G, real_type* ax, real_type* ay, real_type* az, real_type* pe) {
+    const int N = _n;
+    const int width = assignment == Mesh_TSC ? 3 : 2;
+    const real_type invH = 1. / _h;
+    const size_t sy = N, sz = (size_t)N * N;
+    // a body sees the smoothed potential of its own mass, -G m / (rs sqrt(pi)) at zero distance
+    const real_type self = G / (split * _h * sqrt(M_PI));
+
+    // same stencil as the assignment, so there is no net self force
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        real_type w[3][3];
+        int bx = stencil(assignment, (x[i] - _origin[0]) * invH, w[0]);
+        int by = stencil(assignment, (y[i] - _origin[1]) * invH, w[1]);
+        int bz = stencil(assignment, (z[i] - _origin[2]) * invH, w[2]);
+
+        double gx = 0., gy = 0., gz = 0., phi = 0.;
+        for (int c = 0; c < width; c++) {
+            for (int b = 0; b < width; b++) {
+                const double* row = _potential.data() + (bz + c) * sz + (by + b) * sy + bx;
+                double wcb = w[2][c] * w[1][b];
+                for (int a = 0; a < width; a++) {
+                    const double* p = row + a;
+                    double wgt = wcb * w[0][a];
+                    phi += wgt * p[0];
+                    gx += wgt * gradient(p, 1);
+                    gy += wgt * gradient(p, sy);
+                    gz += wgt * gradient(p, sz);
+                }
+            }
+        }
+
+        if (ax) {
+            ax[i] = -gx * invH;
+            ay[i] = -gy * invH;
+            az[i] = -gz * invH;
+        }
+        pe[i] = phi + self * mass[i];
+    }
+}
+
+double ParticleMesh::short_range(const real_type* x, const real_type* y, const real_type* z, const real_type* mass,
+                                 int n, real_type G, real_type softeningSquared,
+                                 real_type* ax, real_type* ay, real_type* az, real_type* pe) {
+    const real_type rs = split * _h;
+    const real_type rc = cutoff * rs;
+    const real_type rc2 = rc * rc;
+    const real_type invTwoRs = 1. / (2. * rs);
+    const real_type twoOverSqrtPi = 2. / sqrt(M_PI);
+
+    // chaining mesh over the bodies, cells at least as large as the cutoff
+    real_type lo[3], size = (_n - 2 * PM_MARGIN - 1) * _h;
+    for (int k = 0; k < 3; k++)
+        lo[k] = _origin[k] + PM_MARGIN * _h;
+    const int C = std::max(1, std::min(PM_MAX_CELLS, (int)(size / rc)));
+    const real_type invCell = C / size;
+    _cells = C;
+
+    auto cell_of = [&](real_type v, int k) { return std::max(0, std::min(C - 1, (int)((v - lo[k]) * invCell))); };
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        _keys[i] = ((uint64_t)cell_of(z[i], 2) * C + cell_of(y[i], 1)) * C + cell_of(x[i], 0);
+        _order[i] = i;
+    }
+    radix_sort(_keys.data(), _order.data(), n, _tmpKeys.data(), _tmpOrder.data());
+
+    #pragma omp parallel for schedule(static)
+    for (int s = 0; s < n; s++) {
+        int i = _order[s];
+        _sorted[0][s] = x[i];
+        _sorted[1][s] = y[i];
+        _sorted[2][s] = z[i];
+        _sorted[3][s] = mass[i];
+    }
+
+    int total = C * C * C;
+    _cellStart.resize(total + 1);
+    #pragma omp parallel for schedule(static)
+    for (int c = 0; c <= total; c++)
+        _cellStart[c] = (int32_t)(std::lower_bound(_keys.begin(), _keys.begin() + n, (uint64_t)c) - _keys.begin());
+
+    const real_type *sx = _sorted[0].data(), *sy = _sorted[1].data(), *sz = _sorted[2].data();
+    const real_type *sm = _sorted[3].data();
+    double pairs = 0.;
+
+    // each body only writes its own result, neighbouring bodies share the cells they visit
+    #pragma omp parallel for schedule(dynamic, 64) reduction(+ : pairs)
+    for (int s = 0; s < n; s++) {
+        const real_type xi = sx[s], yi = sy[s], zi = sz[s];
+        int cx = cell_of(xi, 0), cy = cell_of(yi, 1), cz = cell_of(zi, 2);
+        real_type accX = 0., accY = 0., accZ = 0., phi = 0.;
+        int64_t count = 0;
+
+        for (int c = std::max(0, cz - 1); c <= std::min(C - 1, cz + 1); c++) {
+            for (int b = std::max(0, cy - 1); b <= std::min(C - 1, cy + 1); b++) {
+                int row = (c * C + b) * C;
+                int begin = _cellStart[row + std::max(0, cx - 1)];
+                int end = _cellStart[row + std::min(C - 1, cx + 1) + 1];
+                for (int j = begin; j < end; j++) {
+                    real_type dx = sx[j] - xi;
+                    real_type dy = sy[j] - yi;
+                    real_type dz = sz[j] - zi;
+                    real_type r2 = dx * dx + dy * dy + dz * dz;
+                    if (r2 >= rc2 || j == s)
+                        continue;
+
+                    real_type r = sqrt(r2);
+                    real_type u = r * invTwoRs;
+                    real_type e = erfc(u);
+                    real_type ex = twoOverSqrtPi * u * exp(-u * u);
+                    real_type gm = G * sm[j];
+                    real_type force, pot;
+                    if (r2 >= softeningSquared) {
+                        real_type distanceInv = 1.0 / r;
+                        pot = e * distanceInv;
+                        force = (e + ex) * distanceInv * distanceInv * distanceInv;
+                    } else {
+                        // the mesh part is unsoftened, the pair gets the softened
+                        // total minus what the mesh already applied
+                        real_type distanceInv = 1.0 / sqrt(softeningSquared);
+                        if (r > 0.) {
+                            pot = distanceInv - (1. - e) / r;
+                            force = distanceInv * distanceInv * distanceInv - (1. - e - ex) / (r * r2);
+                        } else {
+                            pot = distanceInv - 1. / (rs * sqrt(M_PI));
+                            force = 0.;
+                        }
+                    }
+                    accX += dx * gm * force;
+                    accY += dy * gm * force;
+                    accZ += dz * gm * force;
+                    phi -= gm * pot;
+                    count++;
+                }
+            }
+        }
+
+        int i = _order[s];
+        if (ax) {
+            ax[i] += accX;
+            ay[i] += accY;
+            az[i] += accZ;
+        }
+        pe[i] += phi;
+        pairs += (double)count;
+    }
+
+    return pairs;
+}
+
+double ParticleMesh::evaluate(const real_type* x, const real_type* y, const real_type* z, const real_type* mass,
+                              int n, real_type G, real_type softeningSquared,
+                              real_type* ax, real_type* ay, real_type* az, real_type* pe) {
+    if (n == 0)
+        return 0.;
+
+    int N = PM_MIN_GRID;
+    while (N < grid)
+        N <<= 1;
+    grid = N;
+    resize(N);
+
+    _keys.resize(n);
+    _tmpKeys.resize(n);
+    _order.resize(n);
+    _tmpOrder.resize(n);
+    for (int k = 0; k < 4; k++)
+        _sorted[k].resize(n);
+
+    real_type lo[3], size;
+    morton_bounds(x, y, z, n, lo, &size);
+    _h = size / (N - 2 * PM_MARGIN - 1);
+    for (int k = 0; k < 3; k++)
+        _origin[k] = lo[k] - PM_MARGIN * _h;
+
+    // the Green's function is kept in cells, only the split scale and the stencil change it
+    if (_green.empty() || _greenSplit != split || _greenAssignment != assignment)
+        setup_green();
+
+    assign(x, y, z, mass, n);
+    fft(false, true);
+
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < _mesh.size(); i++)
+        _mesh[i] *= _green[i];
+
+    fft(true, true);
+
+    const size_t M = _m;
+    const double scale = G / _h;
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int c = 0; c < N; c++)
+        for (int b = 0; b < N; b++)
+            for (int a = 0; a < N; a++)
+                _potential[((size_t)c * N + b) * N + a] = scale * _mesh[((size_t)c * M + b) * M + a].real();
+
+    interpolate(x, y, z, mass, n, G, ax, ay, az, pe);
+
+    double pairs = 0.;
+    if (shortRange)
+        pairs = short_range(x, y, z, mass, n, G, softeningSquared, ax, ay, az, pe);
+
+    return pairs + n;
+}
@@ -0,0 +1,87 @@
+#ifndef PM_HPP_
+#define PM_HPP_
+
+#include <vector>
+#include <complex>
+#include <cstdint>
+
+#ifdef NBODY_HAVE_FFTW
+#include <fftw3.h>
+#endif
+
+#include "nbody.hpp"
+
+enum MeshAssignment {
+    Mesh_CIC = 0,       // cloud in cell, 2x2x2 nodes per body
+    Mesh_TSC,           // triangular shaped cloud, 3x3x3 nodes per body
+    Mesh_Count
+};
+
+extern const char* const meshAssignmentNames[Mesh_Count];
+
+// Particle-mesh gravity with open boundaries.
+// Mass is assigned to a grid over the bounding cube and convolved with the
+// Gaussian smoothed Green's function erf(r/2rs)/r on a grid of twice the size
+// (Hockney-Eastwood zero padding), so there are no periodic images. The FFT
+// is FFTW when the build found it, a bundled radix-2 one otherwise.
+// With shortRange the erfc(r/2rs)/r remainder is summed directly over a
+// chaining mesh, which turns the solver into P3M.
+class ParticleMesh {
+    public:
+        int grid;               // cells per axis, rounded up to a power of two
+        int assignment;         // MeshAssignment
+        bool shortRange;        // add the direct short range part (P3M)
+        real_type split;        // Gaussian split scale rs, in cells
+        real_type cutoff;       // short range cutoff, in units of rs
+
+        ParticleMesh();
+        ~ParticleMesh();
+
+        // Same contract as Octree::evaluate(): accelerations (optional) and
+        // potential per unit of mass in the original order. Returns the number
+        // of short range pairs plus one mesh interaction per body.
+        double evaluate(const real_type* x, const real_type* y, const real_type* z, const real_type* mass,
+                        int n, real_type G, real_type softeningSquared,
+                        real_type* ax, real_type* ay, real_type* az, real_type* pe);
+    private:
+        typedef std::complex<double> complex_t;
+
+        int _n;                     // physical grid edge
+        int _m;                     // padded grid edge, 2 * _n
+        real_type _origin[3];
+        real_type _h;               // cell edge
+
+        std::vector<complex_t> _mesh;       // _m^3, mass in, potential out
+        std::vector<double> _green;         // _m^3 real spectrum of the Green's function
+        real_type _greenSplit;
+        int _greenAssignment;
+        std::vector<double> _potential;     // _n^3 physical part of the potential
+
+        std::vector<complex_t> _twiddle;
+        std::vector<int32_t> _bitrev;
+
+        // bodies sorted by assignment slab (x plane), then by chaining cell
+        std::vector<uint64_t> _keys, _tmpKeys;
+        std::vector<int32_t> _order, _tmpOrder;
+        std::vector<int32_t> _slabStart;
+        std::vector<int32_t> _cellStart;
+        std::vector<real_type> _sorted[4];  // x, y, z, mass in chaining cell order
+        int _cells;                         // chaining cells per axis
+
+#ifdef NBODY_HAVE_FFTW
+        fftw_plan _forward, _backward;
+        int _planned;
+#endif
+
+        void resize(int n);
+        void setup_green();
+        void fft(bool inverse, bool pruned);
+        void assign(const real_type* x, const real_type* y, const real_type* z, const real_type* mass, int n);
+        void interpolate(const real_type* x, const real_type* y, const real_type* z, const real_type* mass,
+                         int n, real_type G, real_type* ax, real_type* ay, real_type* az, real_type* pe);
+        double short_range(const real_type* x, const real_type* y, const real_type* z, const real_type* mass,
+                           int n, real_type G, real_type softeningSquared,
+                           real_type* ax, real_type* ay, real_type* az, real_type* pe);
+};
+
+#endif
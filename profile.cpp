@@ -0,0 +1,306 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <vector>
+#include <omp.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "profile.hpp"
+
+// nested deeper than this is not timed
+#define PROFILE_DEPTH 16
+
+const char* const phaseNames[Phase_Count] = {"step", "drift/kick", "forces", "energy", "reorder", "io", "snapshot", "render"};
+const char* const counterNames[Counter_Count] = {"cycles", "instructions", "llc-misses", "fp"};
+
+std::atomic<bool> profileEnabled(false);
+
+static std::atomic<uint64_t> totalCalls[Phase_Count];
+static std::atomic<uint64_t> totalNanoseconds[Phase_Count];
+static std::atomic<uint64_t> totalCounters[Phase_Count][Counter_Count];
+
+// counters every thread opens, in group read order; bumping the generation
+// makes threads reopen theirs
+static std::atomic<bool> countersOn(false);
+static std::atomic<int> generation(0);
+static int events[Counter_Count];
+static int eventCount = 0;
+static uint64_t fpConfig = 0;
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#ifdef __linux__
+static int open_event(int counter, int group) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    switch (counter) {
+        case Counter_Cycles:       attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+        case Counter_Instructions: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+        case Counter_LLCMisses:    attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+        default:
+            attr.type = PERF_TYPE_RAW;
+            attr.config = fpConfig;
+    }
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+#else
+static int open_event(int, int) {
+    errno = ENOSYS;
+    return -1;
+}
+#endif
+
+namespace {
+
+// Per OS thread: the open phases, and counter groups on the threads of
+// its OpenMP team, one group leader each.
+struct ThreadProfile {
+    struct Open {
+        Phase phase;
+        uint64_t start;
+        uint64_t counters[Counter_Count];
+    };
+    Open stack[PROFILE_DEPTH];
+    int depth;
+    int skipped;                    // scopes past PROFILE_DEPTH
+    int generation;
+    std::vector<std::vector<int>> groups;
+
+    ThreadProfile() : depth(0), skipped(0), generation(-1) {}
+    ~ThreadProfile() {close();}
+
+    void close() {
+        for (auto& g : groups)
+            for (int fd : g)
+                if (fd >= 0)
+                    ::close(fd);
+        groups.clear();
+    }
+
+    // Opens on every thread of a parallel region, so only outside one.
+    void open() {
+        close();
+        generation = ::generation;
+        if (!countersOn)
+            return;
+        groups.assign(omp_get_max_threads(), std::vector<int>());
+        #pragma omp parallel
+        {
+            std::vector<int>& g = groups[omp_get_thread_num()];
+            for (int e = 0; e < eventCount; e++) {
+                int fd = open_event(events[e], g.empty() ? -1 : g[0]);
+                if (fd < 0) {
+                    for (int f : g)
+                        ::close(f);
+                    g.clear();
+                    break;
+                }
+                g.push_back(fd);
+            }
+        }
+    }
+
+    void read(uint64_t counters[Counter_Count]) {
+        std::memset(counters, 0, sizeof(uint64_t) * Counter_Count);
+        uint64_t buffer[1 + Counter_Count];
+        for (auto& g : groups) {
+            if (g.empty() || ::read(g[0], buffer, sizeof(buffer)) < (ssize_t)sizeof(uint64_t))
+                continue;
+            for (uint64_t e = 0; e < buffer[0] && e < (uint64_t)eventCount; e++)
+                counters[events[e]] += buffer[1 + e];
+        }
+    }
+
+    // time and counts since the top phase (re)started go to it
+    void charge(uint64_t time, const uint64_t* counters) {
+        Open& top = stack[depth - 1];
+        totalNanoseconds[top.phase] += time - top.start;
+        for (int c = 0; c < Counter_Count; c++)
+            if (counters[c] > top.counters[c])
+                totalCounters[top.phase][c] += counters[c] - top.counters[c];
+    }
+};
+
+thread_local ThreadProfile profile;
+
+// Inside a parallel region the team's thread 0 speaks for it, it is the
+// thread that opened the region and its phases
+bool silent() {
+    return omp_in_parallel() && omp_get_thread_num() != 0;
+}
+
+}
+
+void phase_enter(Phase phase) {
+    if (silent())
+        return;
+    ThreadProfile& p = profile;
+    if (p.depth == PROFILE_DEPTH) {
+        p.skipped++;
+        return;
+    }
+
+    uint64_t counters[Counter_Count] = {0};
+    if (countersOn) {
+        if (p.generation != generation && !omp_in_parallel())
+            p.open();
+        p.read(counters);
+    }
+    uint64_t time = now_ns();
+
+    if (p.depth > 0)
+        p.charge(time, counters);
+    ThreadProfile::Open& top = p.stack[p.depth++];
+    top.phase = phase;
+    top.start = time;
+    std::memcpy(top.counters, counters, sizeof(counters));
+    totalCalls[phase]++;
+}
+
+void phase_exit() {
+    if (silent())
+        return;
+    ThreadProfile& p = profile;
+    if (p.skipped > 0) {
+        p.skipped--;
+        return;
+    }
+    if (p.depth == 0)
+        return;
+
+    uint64_t time = now_ns();
+    uint64_t counters[Counter_Count] = {0};
+    if (countersOn)
+        p.read(counters);
+
+    p.charge(time, counters);
+    p.depth--;
+    // the phase below carries on from here
+    if (p.depth > 0) {
+        ThreadProfile::Open& top = p.stack[p.depth - 1];
+        top.start = time;
+        std::memcpy(top.counters, counters, sizeof(counters));
+    }
+}
+
+void profile_enable(bool enabled) {
+    profileEnabled = enabled;
+}
+
+bool profile_counters(bool enabled, uint64_t fpEvent, std::string* error) {
+    if (!enabled) {
+        countersOn = false;
+        generation++;
+        return true;
+    }
+
+    // keep the events this kernel and cpu count for us, checked on this thread
+    fpConfig = fpEvent;
+    int count = 0;
+    int reason = 0;
+    for (int c = 0; c < Counter_Count; c++) {
+        if (c == Counter_FP && !fpEvent)
+            continue;
+        int fd = open_event(c, -1);
+        if (fd < 0) {
+            reason = reason ? reason : errno;
+            continue;
+        }
+        ::close(fd);
+        events[count++] = c;
+    }
+    eventCount = count;
+    countersOn = count > 0;
+    generation++;
+
+    if (count < Counter_Count - (fpEvent ? 0 : 1) && error) {
+        *error = std::string(count ? "some hardware counters unavailable: " : "hardware counters unavailable: ")
+               + strerror(reason) + (reason == EACCES || reason == EPERM ? " (see /proc/sys/kernel/perf_event_paranoid)" : "");
+    }
+    return count > 0;
+}
+
+bool profile_counters_on() {
+    return countersOn;
+}
+
+void profile_read(PhaseStats stats[Phase_Count]) {
+    for (int p = 0; p < Phase_Count; p++) {
+        stats[p].calls = totalCalls[p];
+        stats[p].nanoseconds = totalNanoseconds[p];
+        for (int c = 0; c < Counter_Count; c++)
+            stats[p].counters[c] = totalCounters[p][c];
+    }
+}
+
+void profile_reset() {
+    for (int p = 0; p < Phase_Count; p++) {
+        totalCalls[p] = 0;
+        totalNanoseconds[p] = 0;
+        for (int c = 0; c < Counter_Count; c++)
+            totalCounters[p][c] = 0;
+    }
+}
+
+void profile_print(const PhaseStats stats[Phase_Count], const PhaseStats* since, int ticks) {
+    PhaseStats d[Phase_Count];
+    double total = 0.;
+    for (int p = 0; p < Phase_Count; p++) {
+        d[p] = stats[p];
+        if (since) {
+            d[p].calls -= since[p].calls;
+            d[p].nanoseconds -= since[p].nanoseconds;
+            for (int c = 0; c < Counter_Count; c++)
+                d[p].counters[c] -= since[p].counters[c];
+        }
+        total += d[p].nanoseconds * 1e-9;
+    }
+
+    bool counters = countersOn;
+    bool has[Counter_Count] = {false};
+    for (int e = 0; counters && e < eventCount; e++)
+        has[events[e]] = true;
+
+    printf("Phase      |   Calls |  Seconds  | Share  | ms/tick ");
+    if (counters)
+        printf("| Gcycles | Ginstr | IPC  | LLC miss/kinstr | FP Ginstr ");
+    printf("|\n");
+    for (int p = 0; p < Phase_Count; p++) {
+        if (d[p].calls == 0)
+            continue;
+        double seconds = d[p].nanoseconds * 1e-9;
+        printf("%-10s | %7llu | %9.4f | %5.1f%% | %7.3f ", phaseNames[p], (unsigned long long)d[p].calls, seconds,
+            total > 0. ? 100. * seconds / total : 0., ticks > 0 ? 1e3 * seconds / ticks : 0.);
+        if (counters) {
+            const uint64_t* c = d[p].counters;
+            auto column = [&](bool on, double v, const char* format, const char* blank) {
+                if (on)
+                    printf(format, v);
+                else
+                    printf("%s", blank);
+            };
+            column(has[Counter_Cycles], c[Counter_Cycles] * 1e-9, "| %7.3f ", "|       - ");
+            column(has[Counter_Instructions], c[Counter_Instructions] * 1e-9, "| %6.3f ", "|      - ");
+            column(has[Counter_Cycles] && has[Counter_Instructions] && c[Counter_Cycles],
+                c[Counter_Cycles] ? (double)c[Counter_Instructions] / c[Counter_Cycles] : 0., "| %4.2f ", "|    - ");
+            column(has[Counter_LLCMisses] && has[Counter_Instructions] && c[Counter_Instructions],
+                c[Counter_Instructions] ? 1e3 * c[Counter_LLCMisses] / c[Counter_Instructions] : 0., "| %15.3f ", "|               - ");
+            column(has[Counter_FP], c[Counter_FP] * 1e-9, "| %9.3f ", "|         - ");
+        }
+        printf("|\n");
+    }
+    printf("Total %.4f s in phases\n", total);
+}
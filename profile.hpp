@@ -0,0 +1,88 @@
+#ifndef PROFILE_HPP_
+#define PROFILE_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Phases of a tick and around it. Time goes to the innermost open phase
+// only, so the phases of a thread add up to its wall time inside them.
+enum Phase {
+    Phase_Step = 0,     // tick bookkeeping outside the phases below
+    Phase_Advance,      // drift and kick
+    Phase_Forces,       // force passes, with the potential when sampled
+    Phase_Energy,       // kinetic and potential energy reductions
+    Phase_Reorder,
+    Phase_IO,           // checkpoints and trajectory frames
+    Phase_Publish,      // snapshot copy for the viewer
+    Phase_Render,       // drawing and GL upload
+    Phase_Count
+};
+
+extern const char* const phaseNames[Phase_Count];
+
+enum PhaseCounter {
+    Counter_Cycles = 0,
+    Counter_Instructions,
+    Counter_LLCMisses,
+    Counter_FP,         // a raw event picked with profile_counters(), no portable one exists
+    Counter_Count
+};
+
+extern const char* const counterNames[Counter_Count];
+
+struct PhaseStats {
+    uint64_t calls;
+    uint64_t nanoseconds;
+    uint64_t counters[Counter_Count];
+};
+
+// Checked inline by every PhaseScope, off costs a load and a branch.
+extern std::atomic<bool> profileEnabled;
+
+void profile_enable(bool enabled);
+
+// Hardware counters through perf_event_open, counted on every thread of
+// the OpenMP team of the thread that opens a phase. fpEvent is a raw
+// PMU event code for Counter_FP (Intel FP_ARITH_INST_RETIRED, all umasks:
+// 0xffc7), 0 leaves it out. False with the reason in error when the
+// kernel refuses, the timers keep running without counters.
+bool profile_counters(bool enabled, uint64_t fpEvent, std::string* error);
+bool profile_counters_on();
+
+// Totals since the last reset, safe to read while phases are running.
+void profile_read(PhaseStats stats[Phase_Count]);
+void profile_reset();
+
+// The table profile_read() gives, with stats minus since when since is set.
+void profile_print(const PhaseStats stats[Phase_Count], const PhaseStats* since, int ticks);
+
+void phase_enter(Phase phase);
+void phase_exit();
+
+class PhaseScope {
+    public:
+        explicit PhaseScope(Phase phase) : _active(profileEnabled.load(std::memory_order_relaxed)) {
+            if (_active)
+                phase_enter(phase);
+        }
+        ~PhaseScope() {
+            if (_active)
+                phase_exit();
+        }
+        PhaseScope(const PhaseScope&) = delete;
+        PhaseScope& operator=(const PhaseScope&) = delete;
+    private:
+        bool _active;
+};
+
+// Builds with NBODY_NO_PROFILE leave no trace of the scopes at all.
+#ifdef NBODY_NO_PROFILE
+#define PROFILE_PHASE(phase)
+#else
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_PHASE(phase) PhaseScope PROFILE_CONCAT(_phaseScope, __LINE__)(phase)
+#endif
+
+#endif
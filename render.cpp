@@ -0,0 +1,196 @@
+#include <cmath>
+#include <cstdlib>
+#include <SDL.h>
+
+#include "render.hpp"
+
+namespace {
+
+// GL 2.0 entry points, looked up at init() since neither Windows nor
+// every Linux libGL exports them
+struct GL2 {
+    PFNGLCREATESHADERPROC CreateShader;
+    PFNGLSHADERSOURCEPROC ShaderSource;
+    PFNGLCOMPILESHADERPROC CompileShader;
+    PFNGLGETSHADERIVPROC GetShaderiv;
+    PFNGLGETSHADERINFOLOGPROC GetShaderInfoLog;
+    PFNGLDELETESHADERPROC DeleteShader;
+    PFNGLCREATEPROGRAMPROC CreateProgram;
+    PFNGLATTACHSHADERPROC AttachShader;
+    PFNGLLINKPROGRAMPROC LinkProgram;
+    PFNGLGETPROGRAMIVPROC GetProgramiv;
+    PFNGLGETPROGRAMINFOLOGPROC GetProgramInfoLog;
+    PFNGLDELETEPROGRAMPROC DeleteProgram;
+    PFNGLUSEPROGRAMPROC UseProgram;
+    PFNGLGETUNIFORMLOCATIONPROC GetUniformLocation;
+    PFNGLUNIFORM1FPROC Uniform1f;
+    PFNGLGENBUFFERSPROC GenBuffers;
+    PFNGLBINDBUFFERPROC BindBuffer;
+    PFNGLBUFFERDATAPROC BufferData;
+    PFNGLBUFFERSUBDATAPROC BufferSubData;
+    PFNGLDELETEBUFFERSPROC DeleteBuffers;
+} gl;
+
+template<typename F>
+bool load(F& f, const char* name) {
+    f = (F)SDL_GL_GetProcAddress(name);
+    return f != nullptr;
+}
+
+bool load_all() {
+    return load(gl.CreateShader, "glCreateShader") && load(gl.ShaderSource, "glShaderSource")
+        && load(gl.CompileShader, "glCompileShader") && load(gl.GetShaderiv, "glGetShaderiv")
+        && load(gl.GetShaderInfoLog, "glGetShaderInfoLog") && load(gl.DeleteShader, "glDeleteShader")
+        && load(gl.CreateProgram, "glCreateProgram") && load(gl.AttachShader, "glAttachShader")
+        && load(gl.LinkProgram, "glLinkProgram") && load(gl.GetProgramiv, "glGetProgramiv")
+        && load(gl.GetProgramInfoLog, "glGetProgramInfoLog") && load(gl.DeleteProgram, "glDeleteProgram")
+        && load(gl.UseProgram, "glUseProgram") && load(gl.GetUniformLocation, "glGetUniformLocation")
+        && load(gl.Uniform1f, "glUniform1f") && load(gl.GenBuffers, "glGenBuffers")
+        && load(gl.BindBuffer, "glBindBuffer") && load(gl.BufferData, "glBufferData")
+        && load(gl.BufferSubData, "glBufferSubData") && load(gl.DeleteBuffers, "glDeleteBuffers");
+}
+
+// The sprite covers the sphere's silhouette, give or take the perspective
+// at the edges of the view
+const char* vertexShader = R"(#version 120
+uniform float sizeScale;
+uniform float radius;
+varying vec3 center;
+void main() {
+    vec4 eye = gl_ModelViewMatrix * gl_Vertex;
+    center = eye.xyz;
+    gl_Position = gl_ProjectionMatrix * eye;
+    gl_PointSize = max(2.0 * radius * sizeScale / max(-eye.z, 1e-4), 1.0);
+    gl_FrontColor = gl_Color;
+}
+)";
+
+// Blinn-Phong with GL_LIGHT0 and the front material, as the fixed
+// function pipeline lights the spheres
+const char* fragmentShader = R"(#version 120
+uniform float radius;
+varying vec3 center;
+void main() {
+    vec2 xy = gl_PointCoord * 2.0 - 1.0;
+    xy.y = -xy.y;
+    float r2 = dot(xy, xy);
+    if (r2 > 1.0)
+        discard;
+    vec3 normal = vec3(xy, sqrt(1.0 - r2));
+    vec3 p = center + normal * radius;
+
+    vec4 clip = gl_ProjectionMatrix * vec4(p, 1.0);
+    gl_FragDepth = .5 * (gl_DepthRange.diff * clip.z / clip.w + gl_DepthRange.near + gl_DepthRange.far);
+
+    vec4 light = gl_LightSource[0].position;
+    vec3 l = normalize(light.xyz - p * light.w);
+    vec3 h = normalize(l + normalize(-p));
+    float diffuse = max(dot(normal, l), 0.0);
+    float specular = diffuse > 0.0 ? pow(max(dot(normal, h), 0.0), gl_FrontMaterial.shininess) : 0.0;
+    gl_FragColor = vec4(gl_Color.rgb * (gl_LightSource[0].ambient.rgb + diffuse * gl_LightSource[0].diffuse.rgb)
+                      + specular * gl_FrontMaterial.specular.rgb * gl_LightSource[0].specular.rgb, 1.0);
+}
+)";
+
+GLuint compile(GLenum type, const char* source, std::string* error) {
+    GLuint shader = gl.CreateShader(type);
+    gl.ShaderSource(shader, 1, &source, nullptr);
+    gl.CompileShader(shader);
+    GLint ok = 0;
+    gl.GetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[1024] = "";
+        gl.GetShaderInfoLog(shader, sizeof(log), nullptr, log);
+        if (error)
+            *error = std::string(type == GL_VERTEX_SHADER ? "vertex" : "fragment") + " shader: " + log;
+        gl.DeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+}
+
+bool ParticleRenderer::init(std::string* error) {
+    release();
+    const char* version = (const char*)glGetString(GL_VERSION);
+    if (!version || atoi(version) < 2 || !load_all()) {
+        if (error)
+            *error = std::string("point sprites need OpenGL 2.0, have ") + (version ? version : "none");
+        return false;
+    }
+
+    GLuint vertex = compile(GL_VERTEX_SHADER, vertexShader, error);
+    if (!vertex)
+        return false;
+    GLuint fragment = compile(GL_FRAGMENT_SHADER, fragmentShader, error);
+    if (!fragment) {
+        gl.DeleteShader(vertex);
+        return false;
+    }
+
+    GLuint program = gl.CreateProgram();
+    gl.AttachShader(program, vertex);
+    gl.AttachShader(program, fragment);
+    gl.LinkProgram(program);
+    gl.DeleteShader(vertex);
+    gl.DeleteShader(fragment);
+    GLint ok = 0;
+    gl.GetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        char log[1024] = "";
+        gl.GetProgramInfoLog(program, sizeof(log), nullptr, log);
+        if (error)
+            *error = std::string("sprite program: ") + log;
+        gl.DeleteProgram(program);
+        return false;
+    }
+
+    _program = program;
+    _sizeScale = gl.GetUniformLocation(program, "sizeScale");
+    _radius = gl.GetUniformLocation(program, "radius");
+    gl.GenBuffers(1, &_buffer);
+    return true;
+}
+
+void ParticleRenderer::release() {
+    if (_program) {
+        gl.DeleteProgram(_program);
+        gl.DeleteBuffers(1, &_buffer);
+    }
+    _program = 0;
+    _buffer = 0;
+}
+
+void ParticleRenderer::draw(const Snapshot& view, float radius, int viewportHeight, float yFov) {
+    if (!_program || view.count <= 0)
+        return;
+    const size_t columnBytes = sizeof(float) * 3 * view.count;
+
+    // orphaning the old storage lets the driver keep drawing from it while
+    // this frame's bodies go into fresh memory
+    gl.BindBuffer(GL_ARRAY_BUFFER, _buffer);
+    gl.BufferData(GL_ARRAY_BUFFER, 2 * columnBytes, nullptr, GL_STREAM_DRAW);
+    gl.BufferSubData(GL_ARRAY_BUFFER, 0, columnBytes, view.pos.data());
+    gl.BufferSubData(GL_ARRAY_BUFFER, columnBytes, columnBytes, view.color.data());
+
+    glPushAttrib(GL_ENABLE_BIT);
+    glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+    glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+    glEnable(GL_POINT_SPRITE);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, (const void*)0);
+    glColorPointer(3, GL_FLOAT, 0, (const void*)columnBytes);
+
+    gl.UseProgram(_program);
+    gl.Uniform1f(_sizeScale, viewportHeight / (2.f * tanf(yFov * (float)M_PI / 360.f)));
+    gl.Uniform1f(_radius, radius);
+    glDrawArrays(GL_POINTS, 0, view.count);
+    gl.UseProgram(0);
+
+    // ImGui's backend draws from client memory, with no buffer bound
+    gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+    glPopClientAttrib();
+    glPopAttrib();
+}
@@ -0,0 +1,37 @@
+#ifndef RENDER_HPP_
+#define RENDER_HPP_
+
+#include <string>
+#include <SDL_opengl.h>
+
+#include "sim_thread.hpp"
+
+// Bodies as sphere impostors: one point sprite per body, shaded and depth
+// corrected in a fragment shader, out of a vertex buffer that is orphaned
+// and refilled every frame. One draw call for the lot, where the fixed
+// function path costs a gluSphere per body. Needs GL 2.0 with GLSL 1.20,
+// which Mesa's llvmpipe has.
+class ParticleRenderer {
+    public:
+        ParticleRenderer() : _program(0), _buffer(0), _sizeScale(-1), _radius(-1) {}
+        ~ParticleRenderer() {release();}
+
+        // With the GL context current. False with the reason in error when
+        // the context cannot do it, the caller keeps drawing spheres then.
+        bool init(std::string* error);
+        void release();
+        bool ready() const {return _program != 0;}
+
+        // Under the current projection and modelview, lit by GL_LIGHT0 like
+        // the spheres. viewportHeight in pixels and yFov in degrees size the
+        // sprites.
+        void draw(const Snapshot& view, float radius, int viewportHeight, float yFov);
+
+    private:
+        GLuint _program;
+        GLuint _buffer;
+        GLint _sizeScale;
+        GLint _radius;
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include <chrono>
+#include <cstdlib>
+
+#include "replay.hpp"
+
+TrajectoryPlayer::TrajectoryPlayer(TrajectoryReader& reader) : _reader(reader) {
+    hits = 0;
+    misses = 0;
+    for (Slot& s : _slots) {
+        s.frame = -1;
+        s.busy = false;
+    }
+    _shown = -1;
+    _position = 0;
+    _direction = 1;
+    _quit = false;
+    _thread = std::thread(&TrajectoryPlayer::loop, this);
+}
+
+TrajectoryPlayer::~TrajectoryPlayer() {
+    _quit = true;
+    _thread.join();
+}
+
+// How far playback is from reaching frame, frames behind it and beyond the
+// prefetch window count as farther than any inside
+int TrajectoryPlayer::distance(int frame) {
+    int direction = _direction;
+    int d = frame - _position;
+    if (direction == 0)
+        return std::abs(d);
+    d *= direction;
+    return d >= 0 && d <= REPLAY_AHEAD ? d : REPLAY_AHEAD + 1 + std::abs(d);
+}
+
+int TrajectoryPlayer::victim(int limit) {
+    int best = -1, farthest = limit;
+    for (int s = 0; s < REPLAY_SLOTS; s++) {
+        if (_slots[s].busy || s == _shown)
+            continue;
+        if (_slots[s].frame < 0)
+            return s;
+        int d = distance(_slots[s].frame);
+        if (d > farthest) {
+            best = s;
+            farthest = d;
+        }
+    }
+    return best;
+}
+
+const Snapshot& TrajectoryPlayer::frame(int k, int direction) {
+    _position = k;
+    _direction = direction;
+
+    for (;;) {
+        std::unique_lock<std::mutex> lock(_lock);
+        bool pending = false;
+        for (int s = 0; s < REPLAY_SLOTS; s++) {
+            if (_slots[s].frame != k)
+                continue;
+            if (_slots[s].busy) {
+                pending = true;
+                break;
+            }
+            _shown = s;
+            hits++;
+            return _slots[s].snapshot;
+        }
+        // the prefetcher is on it, that is sooner than starting over; with
+        // no slot free either, it is about to give one back
+        int s = pending ? -1 : victim(-1);
+        if (s < 0) {
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            continue;
+        }
+        _slots[s].frame = k;
+        _slots[s].busy = true;
+        lock.unlock();
+
+        _reader.decode(k, _slots[s].snapshot);
+
+        lock.lock();
+        _slots[s].busy = false;
+        _shown = s;
+        misses++;
+        return _slots[s].snapshot;
+    }
+}
+
+void TrajectoryPlayer::loop() {
+    while (!_quit) {
+        const int position = _position;
+        const int direction = _direction;
+        bool decoded = false;
+
+        // ahead of playback, or around it when paused
+        for (int a = 1; a <= REPLAY_AHEAD && !decoded; a++) {
+            int k = direction != 0 ? position + a * direction
+                                   : position + (a % 2 ? (a + 1) / 2 : -a / 2);
+            if (k < 0 || k >= _reader.frames())
+                continue;
+
+            std::unique_lock<std::mutex> lock(_lock);
+            bool cached = false;
+            for (const Slot& slot : _slots)
+                cached |= slot.frame == k;
+            if (cached)
+                continue;
+            int s = victim(distance(k));
+            if (s < 0)
+                break;
+            _slots[s].frame = k;
+            _slots[s].busy = true;
+            lock.unlock();
+
+            _reader.decode(k, _slots[s].snapshot);
+
+            lock.lock();
+            _slots[s].busy = false;
+            decoded = true;
+        }
+
+        if (!decoded)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef REPLAY_HPP_
+#define REPLAY_HPP_
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "trajectory.hpp"
+
+// decoded frames kept, and how many of them lie ahead of playback
+#define REPLAY_SLOTS 16
+#define REPLAY_AHEAD 8
+
+// Plays a trajectory back as Snapshots. A thread decodes the frames
+// playback reaches next into a small cache, so reading them from disk
+// overlaps with drawing the current one.
+class TrajectoryPlayer {
+    public:
+        int hits;       // frames the prefetcher had ready
+        int misses;     // frames decoded on demand
+
+        TrajectoryPlayer(TrajectoryReader& reader);
+        ~TrajectoryPlayer();
+        TrajectoryPlayer(const TrajectoryPlayer&) = delete;
+        TrajectoryPlayer& operator=(const TrajectoryPlayer&) = delete;
+
+        // Frame k, decoded here if the prefetcher has not got to it. Valid
+        // until the next call. direction is where playback goes next, 1
+        // forward, -1 backward, 0 paused.
+        const Snapshot& frame(int k, int direction);
+    private:
+        struct Slot {
+            int frame;          // -1 for none
+            bool busy;          // being decoded, outside the lock
+            Snapshot snapshot;
+        };
+
+        TrajectoryReader& _reader;
+        Slot _slots[REPLAY_SLOTS];
+        std::mutex _lock;                   // frame and busy of every slot, _shown
+        int _shown;                         // slot frame() returned last
+        std::atomic<int> _position;
+        std::atomic<int> _direction;
+        std::atomic<bool> _quit;
+        std::thread _thread;
+
+        // Slot to decode a frame into, -1 when every one is busy, shown or
+        // holds a frame closer to playback than limit. Called with the lock held.
+        int victim(int limit);
+        int distance(int frame);
+        void loop();
+};
+
+#endif
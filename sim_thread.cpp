@@ -0,0 +1,102 @@
+#include <chrono>
+#include <algorithm>
+#include <omp.h>
+
+#include "sim_thread.hpp"
+#include "profile.hpp"
+
+SimulationThread::SimulationThread(GSimulation& simulation) : _simulation(simulation) {
+    running = false;
+    batch = 1;
+    _quit = false;
+    _request = false;
+    _parked = false;
+    _steps = 0;
+
+    publish();
+    _thread = std::thread(&SimulationThread::loop, this);
+}
+
+SimulationThread::~SimulationThread() {
+    _quit = true;
+    _thread.join();
+}
+
+void SimulationThread::loop() {
+    while (!_quit) {
+        if (_request) {
+            _parked = true;
+            while (_request && !_quit)
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            _parked = false;
+            continue;
+        }
+
+        int ticks = 0;
+        if (running)
+            ticks = std::max(1, batch.load());
+        else if (_steps > 0) {
+            ticks = 1;
+            _steps--;
+        }
+        if (ticks == 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            continue;
+        }
+
+        _simulation.run(ticks);
+        if (_simulation.energyTick == _simulation.tickCount) {
+            EnergySample e = {(float)fabs(_simulation.fEnergy), (float)fabs(_simulation.kEnergy),
+                              (float)fabs(_simulation.pEnergy), (float)_simulation.energy_deviation()};
+            energies.push(e);
+        }
+        publish();
+    }
+}
+
+bool SimulationThread::acquire(double timeout) {
+    _request = true;
+    double start = omp_get_wtime();
+    while (!_parked) {
+        if (omp_get_wtime() - start >= timeout)
+            return false;
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+void SimulationThread::release() {
+    _request = false;
+}
+
+void SimulationThread::publish() {
+    PROFILE_PHASE(Phase_Publish);
+    Snapshot& s = snapshots.back();
+    ParticleArray* p = _simulation.getPtr();
+    int n = _simulation.get_count();
+
+    s.count = n;
+    s.pos.resize((size_t)n * 3);
+    s.color.resize((size_t)n * 3);
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        size_t b = (size_t)p->id[i] * 3;
+        for (int k = 0; k < 3; k++) {
+            s.pos[b + k] = (float)p->pos[k][i];
+            s.color[b + k] = p->color[i * 3 + k];
+        }
+    }
+
+    s.tickCount = _simulation.tickCount;
+    s.energyTick = _simulation.energyTick;
+    s.elapsedTime = _simulation.elapsedTime;
+    s.computeTime = _simulation.computeTime;
+    s.interactionRate = _simulation.interactionRate;
+    s.fEnergy = _simulation.fEnergy;
+    s.kEnergy = _simulation.kEnergy;
+    s.pEnergy = _simulation.pEnergy;
+    s.deviation = _simulation.energy_deviation();
+
+    snapshots.publish();
+}
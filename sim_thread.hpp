@@ -0,0 +1,130 @@
+#ifndef SIM_THREAD_HPP_
+#define SIM_THREAD_HPP_
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstddef>
+
+#include "nbody.hpp"
+
+// One writer and one reader handing over whole values without locks.
+// The writer fills back() and publish()es it, the reader's acquire() takes
+// the newest published value, if there is one, as front(). Neither side
+// ever waits, a value the reader never took is overwritten by the next.
+template<typename T>
+class TripleBuffer {
+    public:
+        TripleBuffer() : _back(0), _front(1), _middle(2) {}
+
+        T& back()             {return _slots[_back];}
+        void publish()        {_back = _middle.exchange(_back | FRESH) & INDEX;}
+
+        bool acquire() {
+            if (!(_middle.load() & FRESH))
+                return false;
+            _front = _middle.exchange(_front) & INDEX;
+            return true;
+        }
+        const T& front()      {return _slots[_front];}
+    private:
+        static const int INDEX = 3;
+        static const int FRESH = 4;
+
+        T _slots[3];
+        int _back;
+        int _front;
+        std::atomic<int> _middle;   // slot index, FRESH when the reader has not seen it
+};
+
+// Bounded single producer, single consumer queue. push() drops the value
+// when the consumer is that far behind.
+template<typename T, int N>
+class SpscQueue {
+    public:
+        SpscQueue() : _head(0), _tail(0) {}
+
+        bool push(const T& value) {
+            size_t tail = _tail.load(std::memory_order_relaxed);
+            if (tail - _head.load(std::memory_order_acquire) == N)
+                return false;
+            _items[tail % N] = value;
+            _tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T& value) {
+            size_t head = _head.load(std::memory_order_relaxed);
+            if (head == _tail.load(std::memory_order_acquire))
+                return false;
+            value = _items[head % N];
+            _head.store(head + 1, std::memory_order_release);
+            return true;
+        }
+    private:
+        T _items[N];
+        std::atomic<size_t> _head;
+        std::atomic<size_t> _tail;
+};
+
+// What the renderer and the statistics panel read, copied after a batch.
+struct Snapshot {
+    int count;
+    std::vector<float> pos;     // xyz per body, in body id order
+    std::vector<float> color;   // rgb per body, in body id order
+
+    int32_t tickCount;
+    int32_t energyTick;
+    double elapsedTime;
+    double computeTime;
+    double interactionRate;
+    double fEnergy, kEnergy, pEnergy;
+    double deviation;
+};
+
+struct EnergySample {
+    float full, kinetic, potential, deviation;
+};
+
+// Steps a GSimulation on its own thread, one batch of GSimulation::run()
+// at a time, and publishes a Snapshot after each.
+// The simulation belongs to the thread. Another thread may touch it only
+// between acquire() returning true and release(), the stepping thread is
+// parked between two batches then.
+class SimulationThread {
+    public:
+        std::atomic<bool> running;  // step batches back to back
+        std::atomic<int> batch;     // ticks per batch
+
+        TripleBuffer<Snapshot> snapshots;
+        SpscQueue<EnergySample, 4096> energies;
+
+        SimulationThread(GSimulation& simulation);
+        ~SimulationThread();
+        SimulationThread(const SimulationThread&) = delete;
+        SimulationThread& operator=(const SimulationThread&) = delete;
+
+        // One tick, also when not running.
+        void step() {_steps++;}
+
+        // Asks the thread to park after its current batch and waits at most
+        // timeout seconds for it. The request stays up when this returns
+        // false, so a later call picks the thread up after a long batch.
+        bool acquire(double timeout);
+        void release();
+
+        // Copies the current state into a snapshot. From the stepping thread,
+        // or while acquired after changing the simulation.
+        void publish();
+    private:
+        GSimulation& _simulation;
+        std::atomic<bool> _quit;
+        std::atomic<bool> _request;
+        std::atomic<bool> _parked;
+        std::atomic<int> _steps;
+        std::thread _thread;
+
+        void loop();
+};
+
+#endif
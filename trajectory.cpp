@@ -0,0 +1,349 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <climits>
+#include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trajectory.hpp"
+#include "checkpoint.hpp"
+#include "profile.hpp"
+
+static const char MAGIC[8] = {'N', 'B', 'O', 'D', 'Y', 'T', 'R', 'J'};
+
+static_assert(sizeof(TrajectoryHeader) <= TRAJECTORY_HEADER, "trajectory header must fit its page");
+static_assert(sizeof(TrajectoryFrame) % 8 == 0, "trajectory frames keep 8 byte alignment");
+
+static bool write_all(int fd, const char* data, size_t bytes) {
+    while (bytes > 0) {
+        ssize_t done = ::write(fd, data, bytes);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return false;
+        data += done;
+        bytes -= done;
+    }
+    return true;
+}
+
+TrajectoryWriter::TrajectoryWriter() {
+    frames = 0;
+    dropped = 0;
+    packTime = 0.;
+    writeTime = 0.;
+    _dropsWritten = 0;
+    _fd = -1;
+    _closing = false;
+    _error = 0;
+    std::memset(&_header, 0, sizeof(_header));
+}
+
+TrajectoryWriter::~TrajectoryWriter() {
+    close(nullptr);
+}
+
+bool TrajectoryWriter::open(const char* path, GSimulation& simulation, int every, bool velocities,
+                            int positionBits, std::string* error) {
+    close(nullptr);
+    if (positionBits != 0 && positionBits != 16 && positionBits != 32) {
+        if (error)
+            *error = "trajectory positions are 16 or 32 bit fixed point, or float";
+        return false;
+    }
+
+    _fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (_fd < 0) {
+        if (error)
+            *error = std::string("cannot create ") + path + ": " + strerror(errno);
+        return false;
+    }
+    _path = path;
+
+    const size_t n = simulation.get_count();
+    const size_t positionSize = positionBits ? positionBits / 8 : sizeof(float);
+    size_t frameBytes = sizeof(TrajectoryFrame) + n * 3 * positionSize + (velocities ? n * 3 * sizeof(float) : 0);
+    frameBytes = (frameBytes + 7) / 8 * 8;
+
+    std::memset(&_header, 0, sizeof(_header));
+    std::memcpy(_header.magic, MAGIC, sizeof(MAGIC));
+    _header.version = TRAJECTORY_VERSION;
+    _header.endianTag = CHECKPOINT_ENDIAN;
+    _header.flags = velocities ? Trajectory_Velocities : 0;
+    _header.positionBits = positionBits;
+    _header.count = n;
+    _header.every = every;
+    _header.seed = simulation.seed;
+    _header.rng = simulation.get_rng();
+    _header.dTime = simulation.get_dt();
+    _header.headerBytes = TRAJECTORY_HEADER;
+    _header.frameBytes = frameBytes;
+
+    std::vector<char> page(TRAJECTORY_HEADER, 0);
+    std::memcpy(page.data(), &_header, sizeof(_header));
+    if (!write_all(_fd, page.data(), page.size())) {
+        if (error)
+            *error = std::string("cannot write ") + path + ": " + strerror(errno);
+        ::close(_fd);
+        _fd = -1;
+        return false;
+    }
+
+    frames = 0;
+    dropped = 0;
+    packTime = 0.;
+    writeTime = 0.;
+    _dropsWritten = 0;
+    _error = 0;
+    _closing = false;
+    _buffers.assign(TRAJECTORY_BUFFERS, std::vector<char>(frameBytes, 0));
+    int b;
+    while (_free.pop(b) || _filled.pop(b))
+        ;
+    for (int i = 0; i < TRAJECTORY_BUFFERS; i++)
+        _free.push(i);
+    _thread = std::thread(&TrajectoryWriter::loop, this);
+    return true;
+}
+
+bool TrajectoryWriter::record(GSimulation& simulation) {
+    PROFILE_PHASE(Phase_IO);
+    int b;
+    if (_fd < 0)
+        return false;
+    if (!_free.pop(b)) {
+        dropped++;
+        return false;
+    }
+    double start = omp_get_wtime();
+
+    ParticleArray* p = simulation.getPtr();
+    const int n = simulation.get_count();
+    char* buffer = _buffers[b].data();
+
+    TrajectoryFrame* frame = (TrajectoryFrame*)buffer;
+    std::memset(frame, 0, sizeof(*frame));
+    frame->magic = TRAJECTORY_FRAME_MAGIC;
+    frame->tick = simulation.tickCount;
+    frame->energyTick = simulation.energyTick;
+    frame->skipped = dropped - _dropsWritten;
+    _dropsWritten = dropped;
+    frame->time = simulation.elapsedTime;
+    frame->fEnergy = simulation.fEnergy;
+    frame->kEnergy = simulation.kEnergy;
+    frame->pEnergy = simulation.pEnergy;
+    frame->deviation = simulation.energy_deviation();
+
+    char* positions = buffer + sizeof(TrajectoryFrame);
+    const int bits = _header.positionBits;
+    if (bits) {
+        double lo[3] = {HUGE_VAL, HUGE_VAL, HUGE_VAL};
+        double hi[3] = {-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+        for (int k = 0; k < 3; k++) {
+            const real_type* pos = p->pos[k];
+            double l = HUGE_VAL, h = -HUGE_VAL;
+            #pragma omp parallel for schedule(static) reduction(min:l) reduction(max:h)
+            for (int i = 0; i < n; i++) {
+                l = std::min(l, (double)pos[i]);
+                h = std::max(h, (double)pos[i]);
+            }
+            lo[k] = l;
+            hi[k] = h;
+        }
+        const double steps = bits == 16 ? 65535. : 4294967295.;
+        for (int k = 0; k < 3; k++) {
+            frame->origin[k] = n ? lo[k] : 0.;
+            frame->scale[k] = n && hi[k] > lo[k] ? (hi[k] - lo[k]) / steps : 1.;
+        }
+    }
+
+    const double origin[3] = {frame->origin[0], frame->origin[1], frame->origin[2]};
+    const double inverse[3] = {1. / frame->scale[0], 1. / frame->scale[1], 1. / frame->scale[2]};
+    float* velocities = (float*)(positions + (size_t)n * 3 * (bits ? bits / 8 : sizeof(float)));
+    const bool withVelocities = _header.flags & Trajectory_Velocities;
+
+    // slot order in, body id order out, like SimulationThread::publish()
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        size_t o = (size_t)p->id[i] * 3;
+        for (int k = 0; k < 3; k++) {
+            double x = p->pos[k][i];
+            if (bits == 16)
+                ((uint16_t*)positions)[o + k] = (uint16_t)std::min(65535., std::max(0., std::round((x - origin[k]) * inverse[k])));
+            else if (bits == 32)
+                ((uint32_t*)positions)[o + k] = (uint32_t)std::min(4294967295., std::max(0., std::round((x - origin[k]) * inverse[k])));
+            else
+                ((float*)positions)[o + k] = (float)x;
+            if (withVelocities)
+                velocities[o + k] = (float)p->vel[k][i];
+        }
+    }
+
+    _filled.push(b);
+    frames++;
+    packTime += omp_get_wtime() - start;
+    return true;
+}
+
+void TrajectoryWriter::loop() {
+    for (;;) {
+        // closing is read before the queue, a frame queued before close() is seen
+        bool closing = _closing;
+        int b;
+        if (_filled.pop(b)) {
+            if (!_error) {
+                double start = omp_get_wtime();
+                if (!write_all(_fd, _buffers[b].data(), _header.frameBytes))
+                    _error = errno ? errno : EIO;
+                writeTime = writeTime + (omp_get_wtime() - start);
+            }
+            _free.push(b);
+            continue;
+        }
+        if (closing)
+            break;
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+}
+
+bool TrajectoryWriter::close(std::string* error) {
+    if (_fd < 0)
+        return true;
+    _closing = true;
+    _thread.join();
+
+    int failed = _error;
+    if (::close(_fd) != 0 && !failed)
+        failed = errno;
+    _fd = -1;
+    _buffers.clear();
+    if (failed && error)
+        *error = std::string("cannot write ") + _path + ": " + strerror(failed);
+    return !failed;
+}
+
+TrajectoryReader::TrajectoryReader() {
+    _fd = -1;
+    _size = 0;
+    _map = nullptr;
+    _header = nullptr;
+    _frames = 0;
+}
+
+TrajectoryReader::~TrajectoryReader() {
+    close();
+}
+
+void TrajectoryReader::close() {
+    if (_map)
+        munmap((void*)_map, _size);
+    if (_fd >= 0)
+        ::close(_fd);
+    _fd = -1;
+    _size = 0;
+    _map = nullptr;
+    _header = nullptr;
+    _frames = 0;
+    _color.clear();
+}
+
+bool TrajectoryReader::open(const char* path, std::string* error) {
+    close();
+    errno = 0;
+    auto fail = [&](const char* what) {
+        if (error)
+            *error = std::string(what) + " " + path + (errno ? std::string(": ") + strerror(errno) : "");
+        close();
+        return false;
+    };
+
+    _fd = ::open(path, O_RDONLY);
+    if (_fd < 0)
+        return fail("cannot open");
+    struct stat st;
+    if (fstat(_fd, &st) != 0)
+        return fail("cannot stat");
+    if ((size_t)st.st_size < sizeof(TrajectoryHeader))
+        return fail("too short for a trajectory:");
+    _size = st.st_size;
+    void* map = mmap(nullptr, _size, PROT_READ, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED) {
+        _map = nullptr;
+        return fail("cannot map");
+    }
+    _map = (const char*)map;
+
+    errno = 0;
+    const TrajectoryHeader* h = (const TrajectoryHeader*)_map;
+    if (std::memcmp(h->magic, MAGIC, sizeof(MAGIC)))
+        return fail("not a trajectory:");
+    if (h->endianTag != CHECKPOINT_ENDIAN)
+        return fail("trajectory written with the other byte order:");
+    if (h->version != TRAJECTORY_VERSION && h->version != 1)
+        return fail("unsupported trajectory version in");
+    const int bits = h->positionBits;
+    if ((bits != 0 && bits != 16 && bits != 32) || h->count < 0 || h->count > INT32_MAX / 3)
+        return fail("corrupt trajectory header in");
+    size_t frameBytes = sizeof(TrajectoryFrame) + (size_t)h->count * 3 * (bits ? bits / 8 : sizeof(float))
+                      + (h->flags & Trajectory_Velocities ? (size_t)h->count * 3 * sizeof(float) : 0);
+    frameBytes = (frameBytes + 7) / 8 * 8;
+    if (h->frameBytes != frameBytes || h->headerBytes < sizeof(TrajectoryHeader) || h->headerBytes > _size)
+        return fail("corrupt trajectory header in");
+
+    _header = h;
+    // a frame the writer did not finish is not one
+    _frames = (int)std::min<uint64_t>(INT32_MAX, (_size - h->headerBytes) / h->frameBytes);
+    // frames are visited in any order, read ahead is the player's business
+    madvise(map, _size, MADV_RANDOM);
+
+    const int n = (int)h->count;
+    _color.resize((size_t)n * 3);
+    for (int i = 0; i < n; i++)
+        hsv2rgb((float)i * 360.f / n, 1.f, .9f, &_color[i * 3 + 0], &_color[i * 3 + 1], &_color[i * 3 + 2]);
+    return true;
+}
+
+bool TrajectoryReader::decode(int k, Snapshot& snapshot) {
+    const TrajectoryFrame* f = frame(k);
+    const int n = (int)_header->count;
+    if (f->magic != TRAJECTORY_FRAME_MAGIC) {
+        snapshot.count = 0;
+        return false;
+    }
+
+    snapshot.count = n;
+    snapshot.pos.resize((size_t)n * 3);
+    if (snapshot.color.size() != _color.size())
+        snapshot.color = _color;
+
+    const char* positions = (const char*)(f + 1);
+    const int bits = _header->positionBits;
+    const double origin[3] = {f->origin[0], f->origin[1], f->origin[2]};
+    const double scale[3] = {f->scale[0], f->scale[1], f->scale[2]};
+    float* pos = snapshot.pos.data();
+    if (bits == 0)
+        std::memcpy(pos, positions, (size_t)n * 3 * sizeof(float));
+    else if (bits == 16)
+        for (size_t i = 0; i < (size_t)n * 3; i++)
+            pos[i] = (float)(origin[i % 3] + ((const uint16_t*)positions)[i] * scale[i % 3]);
+    else
+        for (size_t i = 0; i < (size_t)n * 3; i++)
+            pos[i] = (float)(origin[i % 3] + ((const uint32_t*)positions)[i] * scale[i % 3]);
+
+    snapshot.tickCount = f->tick;
+    snapshot.energyTick = f->energyTick;
+    snapshot.elapsedTime = f->time;
+    snapshot.computeTime = 0.;
+    snapshot.interactionRate = 0.;
+    snapshot.fEnergy = f->fEnergy;
+    snapshot.kEnergy = f->kEnergy;
+    snapshot.pEnergy = f->pEnergy;
+    snapshot.deviation = f->deviation;
+    return true;
+}
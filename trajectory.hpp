@@ -0,0 +1,134 @@
+#ifndef TRAJECTORY_HPP_
+#define TRAJECTORY_HPP_
+
+#include <atomic>
+#include <thread>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "nbody.hpp"
+#include "sim_thread.hpp"
+
+// Trajectory file, version 2:
+//
+//   header   TrajectoryHeader, padded to headerBytes
+//   frames   frameBytes each, one after another
+//
+// A frame is a TrajectoryFrame followed by the positions of all bodies,
+// xyz per body in body id order, then their velocities the same way when
+// Trajectory_Velocities is set. Positions are float32, or unsigned 16/32
+// bit fixed point over the frame's bounding box: x = origin + q * scale.
+// Velocities are float32. Frames all have the same size, a reader finds
+// frame k without an index and a run cut short loses its last frame at most.
+// Frames the writer had to drop are missing from the file, so frame k is
+// not always tick k * every: every frame holds its tick, and the next frame
+// written counts the ones dropped before it in skipped.
+// Version 1 is version 2 without rng and skipped, its systems all came
+// from mt19937.
+
+#define TRAJECTORY_VERSION 2
+#define TRAJECTORY_HEADER 4096
+#define TRAJECTORY_FRAME_MAGIC 0x4d415246u      // "FRAM"
+#define TRAJECTORY_BUFFERS 8
+
+enum TrajectoryFlags {
+    Trajectory_Velocities = 1,
+};
+
+struct TrajectoryHeader {
+    char magic[8];          // "NBODYTRJ"
+    uint32_t version;
+    uint32_t endianTag;     // CHECKPOINT_ENDIAN as written
+    uint32_t flags;         // TrajectoryFlags
+    uint32_t positionBits;  // 0 for float32, 16 or 32 for fixed point
+    int64_t count;          // bodies
+    int32_t every;          // ticks between frames
+    int32_t seed;
+    double dTime;
+    uint64_t headerBytes;
+    uint64_t frameBytes;
+    uint32_t rng;           // generator of the initial conditions, Rng of nbody.hpp
+    uint32_t reserved;
+};
+
+struct TrajectoryFrame {
+    uint32_t magic;         // TRAJECTORY_FRAME_MAGIC
+    int32_t tick;
+    int32_t energyTick;     // tick the energies belong to
+    uint32_t skipped;       // frames dropped by the writer right before this one
+    double time;
+    double fEnergy, kEnergy, pEnergy;
+    double deviation;
+    double origin[3];       // fixed point positions only
+    double scale[3];
+};
+
+// Streams frames of a GSimulation to a file. record() packs the frame on
+// the calling thread into one of TRAJECTORY_BUFFERS pooled buffers and
+// hands it to a writer thread; it never waits for the disk. A frame that
+// finds every buffer still queued is dropped and counted.
+class TrajectoryWriter {
+    public:
+        int frames;             // handed to the writer
+        int dropped;            // no free buffer
+        double packTime;        // seconds spent in record()
+        std::atomic<double> writeTime;  // seconds the writer spent in write()
+
+        TrajectoryWriter();
+        ~TrajectoryWriter();
+        TrajectoryWriter(const TrajectoryWriter&) = delete;
+        TrajectoryWriter& operator=(const TrajectoryWriter&) = delete;
+
+        // positionBits 0, 16 or 32.
+        bool open(const char* path, GSimulation& simulation, int every, bool velocities,
+                  int positionBits, std::string* error);
+        bool record(GSimulation& simulation);
+        // Writes what is queued and closes the file. False when any write failed.
+        bool close(std::string* error);
+
+        uint64_t bytes() {return (uint64_t)_header.headerBytes + (uint64_t)frames * _header.frameBytes;}
+    private:
+        TrajectoryHeader _header;
+        int _fd;
+        std::string _path;
+        std::vector<std::vector<char>> _buffers;
+        SpscQueue<int, TRAJECTORY_BUFFERS> _free;       // writer -> record()
+        SpscQueue<int, TRAJECTORY_BUFFERS> _filled;     // record() -> writer
+        std::atomic<bool> _closing;
+        std::atomic<int> _error;                        // errno of the first failed write
+        std::thread _thread;
+        int _dropsWritten;                              // dropped as of the last frame recorded
+
+        void loop();
+};
+
+// A trajectory mapped read-only. Frames are decoded on demand, the pages
+// of the others stay on disk.
+class TrajectoryReader {
+    public:
+        TrajectoryReader();
+        ~TrajectoryReader();
+        TrajectoryReader(const TrajectoryReader&) = delete;
+        TrajectoryReader& operator=(const TrajectoryReader&) = delete;
+
+        bool open(const char* path, std::string* error);
+        void close();
+
+        const TrajectoryHeader& header() {return *_header;}
+        int frames() {return _frames;}
+        const TrajectoryFrame* frame(int k) {return (const TrajectoryFrame*)(_map + _header->headerBytes + (size_t)k * _header->frameBytes);}
+
+        // Positions of frame k into a snapshot, with colors by body id since
+        // trajectories carry none. False for a frame that is not one.
+        bool decode(int k, Snapshot& snapshot);
+    private:
+        int _fd;
+        size_t _size;
+        const char* _map;
+        const TrajectoryHeader* _header;
+        int _frames;
+        std::vector<float> _color;
+};
+
+#endif